@@ -0,0 +1,209 @@
+#include <netinet/in.h>
+#include <string.h>
+#include "Checksum.h"
+
+namespace Utils {
+
+// 以下内核都按内存字节序求和，最后折叠成16位再转换字节序（RFC 1071 §2(B)），
+// 所有分块都从偶数偏移开始，奇数长度的最后一个字节补0凑成一个字
+
+static inline uint32_t _fold32(uint64_t sum) {
+	sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+	return (uint32_t) ((sum & 0xFFFFFFFF) + (sum >> 32));
+}
+
+static inline uint32_t _finish(uint64_t sum) {
+	uint32_t s = _fold32(sum);
+	s = (s & 0xFFFF) + (s >> 16);
+	s = (s & 0xFFFF) + (s >> 16);
+	return ntohs((uint16_t) s);
+}
+
+static inline uint32_t _sumTail(const uint8_t* p, size_t bytes) {
+	uint32_t sum = 0;
+	uint16_t w;
+	for (; bytes >= 2; p += 2, bytes -= 2) {
+		::memcpy(&w, p, 2);
+		sum += w;
+	}
+	if (bytes > 0) {
+		uint8_t last[2] = { *p, 0 };
+		::memcpy(&w, last, 2);
+		sum += w;
+	}
+	return sum;
+}
+
+static bool _always() {
+	return true;
+}
+
+// 原来的实现：每16位一次ntohs，作为其他内核的对照
+static uint32_t _sum16(const void* data, size_t bytes) {
+	const uint8_t* buf = (const uint8_t*) data;
+	uint32_t cksum = 0;
+	if ((bytes & 1) != 0)
+		cksum = (uint16_t) buf[--bytes] << 8;
+	for (size_t i = 0; i < bytes; i += 2)
+		cksum += (uint16_t) ntohs(*(uint16_t*) (buf + i));
+	return cksum;
+}
+
+// 32位字带进位累加，适合MIPS32这类没有64位加法的CPU
+static uint32_t _sumWord32(const void* data, size_t bytes) {
+	const uint8_t* p = (const uint8_t*) data;
+	uint32_t a = 0, b = 0, w0, w1, w2, w3;
+	for (; bytes >= 16; p += 16, bytes -= 16) {
+		::memcpy(&w0, p, 4);
+		::memcpy(&w1, p + 4, 4);
+		::memcpy(&w2, p + 8, 4);
+		::memcpy(&w3, p + 12, 4);
+		a += w0;
+		a += a < w0;
+		b += w1;
+		b += b < w1;
+		a += w2;
+		a += a < w2;
+		b += w3;
+		b += b < w3;
+	}
+	for (; bytes >= 4; p += 4, bytes -= 4) {
+		::memcpy(&w0, p, 4);
+		a += w0;
+		a += a < w0;
+	}
+	return _finish((uint64_t) a + b + _sumTail(p, bytes));
+}
+
+// 64位字带进位累加，返回内存字节序、未折叠的部分和
+static uint64_t _addWords64(const uint8_t* p, size_t bytes) {
+	uint64_t a = 0, b = 0, w0, w1;
+	for (; bytes >= 32; p += 32, bytes -= 32) {
+		::memcpy(&w0, p, 8);
+		::memcpy(&w1, p + 8, 8);
+		a += w0;
+		a += a < w0;
+		b += w1;
+		b += b < w1;
+		::memcpy(&w0, p + 16, 8);
+		::memcpy(&w1, p + 24, 8);
+		a += w0;
+		a += a < w0;
+		b += w1;
+		b += b < w1;
+	}
+	for (; bytes >= 8; p += 8, bytes -= 8) {
+		::memcpy(&w0, p, 8);
+		a += w0;
+		a += a < w0;
+	}
+	return (uint64_t) _fold32(a) + _fold32(b) + _sumTail(p, bytes);
+}
+
+static uint32_t _sumWord64(const void* data, size_t bytes) {
+	return _finish(_addWords64((const uint8_t*) data, bytes));
+}
+
+// 向量内核：每个32位通道分别累加高、低16位，通道最多累加65535次就不会溢出。
+// 用GCC向量扩展而不是intrinsics，x86的SSE2/AVX2和ARM的NEON共用一份写法。
+// 包头这样的短数据向量化得不偿失，直接走64位字
+#define SUM_VECTOR_BODY(V, N) \
+	if (bytes < 128) \
+		return _sumWord64(data, bytes); \
+	const uint8_t* p = (const uint8_t*) data; \
+	uint64_t sum = 0; \
+	while (bytes >= sizeof(V)) { \
+		V lo, hi, v; \
+		::memset(&lo, 0, sizeof(V)); \
+		::memset(&hi, 0, sizeof(V)); \
+		size_t n = bytes / sizeof(V); \
+		if (n > 65535) \
+			n = 65535; \
+		bytes -= n * sizeof(V); \
+		for (; n > 0; --n, p += sizeof(V)) { \
+			::memcpy(&v, p, sizeof(V)); \
+			lo += v & 0xFFFF; \
+			hi += v >> 16; \
+		} \
+		uint32_t l[N], h[N]; \
+		::memcpy(l, &lo, sizeof(V)); \
+		::memcpy(h, &hi, sizeof(V)); \
+		for (size_t i = 0; i < N; ++i) \
+			sum += (uint64_t) l[i] + h[i]; \
+	} \
+	return _finish(sum + _addWords64(p, bytes));
+
+#if defined(__SSE2__) || defined(__ARM_NEON__) || defined(__aarch64__)
+typedef uint32_t _Vector128 __attribute__((vector_size(16)));
+
+static uint32_t _sumVector128(const void* data, size_t bytes) {
+	SUM_VECTOR_BODY(_Vector128, 4)
+}
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+typedef uint32_t _Vector256 __attribute__((vector_size(32)));
+
+__attribute__((target("avx2")))
+static uint32_t _sumVector256(const void* data, size_t bytes) {
+	SUM_VECTOR_BODY(_Vector256, 8)
+}
+
+static bool _hasAVX2() {
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+#endif
+
+// 按从慢到快排列，选用最后一个可用的
+static const ChecksumKernel _kernels[] = {
+	{ "sum16", _sum16, _always },
+#if __SIZEOF_POINTER__ >= 8
+	{ "word32", _sumWord32, _always },
+	{ "word64", _sumWord64, _always },
+#else
+	{ "word64", _sumWord64, _always },
+	{ "word32", _sumWord32, _always },
+#endif
+#if defined(__SSE2__)
+	{ "sse2", _sumVector128, _always },
+#elif defined(__ARM_NEON__) || defined(__aarch64__)
+	{ "neon", _sumVector128, _always },
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+	{ "avx2", _sumVector256, _hasAVX2 },
+#endif
+};
+
+static const size_t _kernelCount = sizeof(_kernels) / sizeof(_kernels[0]);
+static const ChecksumKernel* _selected = NULL;
+
+static const ChecksumKernel* _select() {
+	if (_selected == NULL) {
+		const ChecksumKernel* kernel = _kernels;
+		for (size_t i = 1; i < _kernelCount; ++i)
+			if (_kernels[i].isSupported())
+				kernel = &_kernels[i];
+		_selected = kernel;
+	}
+	return _selected;
+}
+
+// 第一次调用时选定内核并替换掉自己，各线程重复选择结果相同，不需要加锁
+static uint32_t _resolve(const void* data, size_t bytes) {
+	__sumKernel = _select()->sum;
+	return __sumKernel(data, bytes);
+}
+
+uint32_t (*__sumKernel)(const void* data, size_t bytes) = _resolve;
+
+const ChecksumKernel* getChecksumKernels(size_t* count) {
+	*count = _kernelCount;
+	return _kernels;
+}
+
+const ChecksumKernel* getSelectedChecksumKernel() {
+	return _select();
+}
+
+}
@@ -0,0 +1,23 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#pragma once
+
+namespace Utils {
+
+// Internet校验和（RFC 1071）的求和内核。各内核返回的部分和数值可以不同，
+// 但经过checksum()折叠后与逐16位求和的结果完全一致
+struct ChecksumKernel {
+	const char* name;
+	uint32_t (*sum)(const void* data, size_t bytes);
+	bool (*isSupported)();
+};
+
+// 当前CPU上选用的内核，第一次调用时按CPU能力确定
+extern uint32_t (*__sumKernel)(const void* data, size_t bytes);
+
+// 本平台编译进来的全部内核，第一个是逐16位求和的参考实现
+const ChecksumKernel* getChecksumKernels(size_t* count);
+const ChecksumKernel* getSelectedChecksumKernel();
+
+}
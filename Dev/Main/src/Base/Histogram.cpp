@@ -0,0 +1,87 @@
+#include <string.h>
+#include "Histogram.h"
+
+namespace Utils {
+
+Histogram::Histogram() {
+	reset();
+}
+
+void Histogram::reset() {
+	::memset(_counts, 0, sizeof(_counts));
+}
+
+size_t Histogram::_index(uint32_t value) {
+	if (value < SUB_BUCKETS)
+		return value;
+	int shift = 31 - __builtin_clz(value) - SUB_BITS;
+	return (shift + 1) * SUB_BUCKETS + (value >> shift) - SUB_BUCKETS;
+}
+
+uint32_t Histogram::_lowest(size_t index) {
+	if (index < SUB_BUCKETS)
+		return index;
+	int shift = index / SUB_BUCKETS - 1;
+	return (uint32_t) (SUB_BUCKETS + index % SUB_BUCKETS) << shift;
+}
+
+uint32_t Histogram::_highest(size_t index) {
+	return index + 1 < BUCKETS ? _lowest(index + 1) - 1 : 0xFFFFFFFF;
+}
+
+size_t Histogram::getCount() const {
+	size_t n = 0;
+	for (size_t i = 0; i < BUCKETS; ++i)
+		n += _counts[i];
+	return n;
+}
+
+size_t Histogram::getCountAtMost(uint32_t value) const {
+	size_t n = 0;
+	for (size_t i = 0; i < BUCKETS && _lowest(i) <= value; ++i)
+		n += _counts[i];
+	return n;
+}
+
+uint32_t Histogram::getMin() const {
+	for (size_t i = 0; i < BUCKETS; ++i)
+		if (_counts[i])
+			return _lowest(i);
+	return 0;
+}
+
+uint32_t Histogram::getMax() const {
+	for (size_t i = BUCKETS; i > 0; --i)
+		if (_counts[i - 1])
+			return _highest(i - 1);
+	return 0;
+}
+
+double Histogram::getMean() const {
+	double sum = 0;
+	size_t n = 0;
+	for (size_t i = 0; i < BUCKETS; ++i)
+		if (_counts[i]) {
+			sum += ((double) _lowest(i) + _highest(i)) / 2 * _counts[i];
+			n += _counts[i];
+		}
+	return n ? sum / n : 0;
+}
+
+uint32_t Histogram::getPercentile(double percentile) const {
+	size_t total = getCount();
+	if (total == 0)
+		return 0;
+	size_t rank = (size_t) (percentile / 100 * total + 0.5);
+	if (rank < 1)
+		rank = 1;
+	size_t n = 0;
+	for (size_t i = 0; i < BUCKETS; ++i) {
+		n += _counts[i];
+		if (n >= rank)
+			return _highest(i);
+	}
+	return getMax();
+}
+
+}
@@ -0,0 +1,47 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#pragma once
+
+namespace Utils {
+
+// HDR式的对数-线性直方图：小于SUB_BUCKETS的值各占一个桶，更大的值按2的幂分段，
+// 每段再等分为SUB_BUCKETS个桶，相对误差不超过1/SUB_BUCKETS。
+// 记录只是一次原子加，多个线程可以同时记录；读的时候允许稍有滞后
+class Histogram {
+public:
+	enum {
+		SUB_BITS = 4,
+		SUB_BUCKETS = 1 << SUB_BITS,
+		BUCKETS = (33 - SUB_BITS) * SUB_BUCKETS
+	};
+
+private:
+	uint32_t _counts[BUCKETS];
+
+	static size_t _index(uint32_t value);
+	static uint32_t _lowest(size_t index);
+	static uint32_t _highest(size_t index);
+
+public:
+	Histogram();
+
+	void record(uint64_t value) {
+		__sync_add_and_fetch(
+				&_counts[_index(
+						value > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t) value)], 1);
+	}
+	void reset();
+
+	size_t getCount() const;
+	// 下界不超过value的各桶的样本数之和
+	size_t getCountAtMost(uint32_t value) const;
+	uint32_t getMin() const;
+	uint32_t getMax() const;
+	// 按各桶中点估算
+	double getMean() const;
+	// percentile取0~100，返回所在桶的上界
+	uint32_t getPercentile(double percentile) const;
+};
+
+}
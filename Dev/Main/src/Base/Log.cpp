@@ -17,7 +17,8 @@ void __log(const char* tag, int level, const char* fmt, va_list ap) {
 		char s[1024];
 		::vsprintf(s, fmt, ap);
 		time_t t = ::time(NULL);
-		tm* lt = ::localtime(&t);
+		tm ltBuf;
+		tm* lt = ::localtime_r(&t, &ltBuf);
 		::fprintf(stderr, "\033[0;3%c" "m%02u:%02u:%02u %c/%s: %s\n",
 				"13724"[level], lt->tm_hour, lt->tm_min, lt->tm_sec,
 				"EWIDV"[level], tag, s);
@@ -28,7 +29,8 @@ void __log(const char* tag, int level, const char* fmt, va_list ap) {
 void __dump(const char* tag, const void* data, size_t bytes) {
 	if (LOG_LEVEL > 5) {
 		time_t t = ::time(NULL);
-		tm* lt = ::localtime(&t);
+		tm ltBuf;
+		tm* lt = ::localtime_r(&t, &ltBuf);
 		const unsigned char* buf = (const unsigned char*) data;
 		for (size_t i = 0; i < bytes; i += 16) {
 			char s[200];
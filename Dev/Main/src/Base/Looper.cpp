@@ -2,130 +2,474 @@
 
 #include <errno.h>
 #include <fcntl.h>
-#include <poll.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include "Utils.h"
 #include "Debug.h"
 #include "Looper.h"
+#include "Metrics.h"
+#include "Mutex.h"
 
-#define MAX_FD_COUNT  1000
+#define MIN_FD_COUNT  64
+#define MAX_EVENTS    64
+
+#define TVR_BITS      8
+#define TVN_BITS      6
+#define TV_LEVELS     4
+#define TVR_SIZE      (1 << TVR_BITS)
+#define TVN_SIZE      (1 << TVN_BITS)
+#define TVR_MASK      (TVR_SIZE - 1)
+#define TVN_MASK      (TVN_SIZE - 1)
+#define TV_SHIFT(l)   (TVR_BITS + ((l) - 1) * TVN_BITS)
+#define MAX_TIMEOUT   ((1ULL << TV_SHIFT(TV_LEVELS)) - 1)
+#define LEVEL_EXPIRED TV_LEVELS
+#define LEVEL_POSTED  (TV_LEVELS + 1)
+#define TV_NEVER      ((uint64_t) -1)
 
 namespace Utils {
 
 struct LooperImpl: Looper {
 	struct {
-		pollfd _fds[MAX_FD_COUNT];
-		int _prev[MAX_FD_COUNT], _next[MAX_FD_COUNT], _first, _last, _free;
-		FDListener* _listeners[MAX_FD_COUNT];
+		struct _Slot {
+			int fd, next;
+			uint32_t events, registered, gen;
+			bool dirty;
+			FDListener* listener;
+		}* _slots;
+		int _size, _free, *_dirty, _dirtyCount, _epfd;
+		epoll_event _events[MAX_EVENTS];
 
-		void init() {
-			for (int i = 0; i < MAX_FD_COUNT; ++i) {
-				_fds[i].fd = -1;
-				_next[i] = i + 1;
+		void init() THROWS {
+			_epfd = ::epoll_create(MIN_FD_COUNT);
+			THROW_IF(_epfd < 0,
+					new Utils::Exception("Looper epoll_create FAILED, errno=%u!", errno));
+			::fcntl(_epfd, F_SETFD, FD_CLOEXEC);
+			_slots = NULL;
+			_dirty = NULL;
+			_size = _dirtyCount = 0;
+			_free = -1;
+			_grow();
+		}
+
+		void _grow() {
+			int size = _size == 0 ? MIN_FD_COUNT : _size * 2;
+			_Slot* slots = new _Slot[size];
+			int* dirty = new int[size];
+			if (_size > 0) {
+				::memcpy(slots, _slots, sizeof(_Slot) * _size);
+				::memcpy(dirty, _dirty, sizeof(int) * _dirtyCount);
+				delete[] _slots;
+				delete[] _dirty;
+			}
+			for (int i = size - 1; i >= _size; --i) {
+				slots[i].fd = -1;
+				slots[i].gen = 0;
+				slots[i].dirty = false;
+				slots[i].next = _free;
+				_free = i;
+			}
+			Utils::Log::d("fd slots grown %d --> %d", _size, size);
+			_slots = slots;
+			_dirty = dirty;
+			_size = size;
+		}
+
+		void _ctl(int index, uint32_t events) THROWS {
+			_Slot& slot = _slots[index];
+			epoll_event ev;
+			::memset(&ev, 0, sizeof(ev));
+			ev.events = events;
+			ev.data.u64 = ((uint64_t) slot.gen << 32) | (uint32_t) index;
+			int r = ::epoll_ctl(_epfd, EPOLL_CTL_MOD, slot.fd, &ev);
+			THROW_IF(r != 0,
+					new Utils::Exception("#%d epoll_ctl fd=%d FAILED, errno=%u!", index, slot.fd, errno));
+			slot.registered = events;
+		}
+
+		void _setEvents(int index, uint32_t events) {
+			_Slot& slot = _slots[index];
+			slot.events = events;
+			if (!slot.dirty) {
+				slot.dirty = true;
+				_dirty[_dirtyCount++] = index;
+			}
+		}
+
+		// 事件掩码的变化只在进入epoll_wait前提交，回调中重新waitToRead不产生系统调用
+		void _flush() THROWS {
+			for (int i = 0; i < _dirtyCount; ++i) {
+				int index = _dirty[i];
+				_Slot& slot = _slots[index];
+				slot.dirty = false;
+				if (slot.fd >= 0 && slot.events != slot.registered)
+					_ctl(index, slot.events);
 			}
-			_next[MAX_FD_COUNT - 1] = _first = _last = -1;
-			_free = 0;
+			_dirtyCount = 0;
 		}
 
 		int attach(int fd, FDListener* listener) THROWS {
 			ASSERT(fd >= 0 && listener);
+			if (_free < 0)
+				_grow();
 			int index = _free;
-			THROW_IF(index < 0,
-					new Utils::Exception("Looper fd buffer overflow!!!"));
-			_free = _next[_free];
-			if (_first < 0)
-				_first = index;
-			else
-				_next[_last] = index;
-			_prev[index] = _last;
-			_next[index] = -1;
-			_last = index;
-			_fds[index].fd = fd;
-			_fds[index].events = 0;
-			_fds[index].revents = 0;
-			_listeners[index] = listener;
+			_Slot& slot = _slots[index];
 			int flags = ::fcntl(fd, F_GETFL);
 			THROW_IF(flags == -1, new Utils::Exception("F_GETFL failed."));
 			if ((flags & O_NONBLOCK) == 0) {
 				int r = ::fcntl(fd, F_SETFL, flags | O_NONBLOCK);
 				THROW_IF(r == -1, new Utils::Exception("F_SETFL failed."));
 			}
+			epoll_event ev;
+			::memset(&ev, 0, sizeof(ev));
+			ev.data.u64 = ((uint64_t) ++slot.gen << 32) | (uint32_t) index;
+			int r = ::epoll_ctl(_epfd, EPOLL_CTL_ADD, fd, &ev);
+			THROW_IF(r != 0,
+					new Utils::Exception("Looper attach fd=%d FAILED, errno=%u!", fd, errno));
+			_free = slot.next;
+			slot.fd = fd;
+			slot.next = -1;
+			slot.events = slot.registered = 0;
+			slot.listener = listener;
 			Utils::Log::d("#%d <-- attachFD fd=%d", index, fd);
 			return index;
 		}
 
 		void detach(int index) {
-			ASSERT(_fds[index].fd >= 0 && _listeners[index]);
+			_Slot& slot = _slots[index];
+			ASSERT(slot.fd >= 0 && slot.listener);
 			Utils::Log::d("detach #%d", index);
-			_fds[index].fd = -1;
-			_fds[index].events = 0;
-			_fds[index].revents = 0;
-			_listeners[index] = NULL;
-			if (_prev[index] < 0)
-				_first = _next[index];
-			else
-				_next[_prev[index]] = _next[index];
-			if (_next[index] < 0)
-				_last = _prev[index];
-			else
-				_prev[_next[index]] = _prev[index];
-			_next[index] = _free;
+			::epoll_ctl(_epfd, EPOLL_CTL_DEL, slot.fd, NULL);
+			slot.fd = -1;
+			slot.events = slot.registered = 0;
+			slot.listener = NULL;
+			++slot.gen;
+			slot.next = _free;
 			_free = index;
 		}
 
+		// 读、写等待可以同时挂着，各自触发一次后清掉
 		void waitToRead(int index) {
 			Utils::Log::d("#%d waitToRead", index);
-			_fds[index].events = POLLIN | POLLHUP | POLLRDHUP | POLLERR;
+			_setEvents(index, _slots[index].events | EPOLLIN | EPOLLRDHUP);
 		}
 
 		void waitToWrite(int index) {
 			Utils::Log::d("#%d waitToWrite", index);
-			_fds[index].events = POLLOUT | POLLHUP | POLLRDHUP | POLLERR;
+			_setEvents(index, _slots[index].events | EPOLLOUT | EPOLLRDHUP);
 		}
 
-		void loopOnce() THROWS {
-			Utils::Log::v("--> poll");
-			int eventCount = ::poll(_fds, MAX_FD_COUNT, -1);
+		int wait(int timeout) THROWS {
+			_flush();
+			Utils::Log::v("--> epoll_wait timeout=%d", timeout);
+			int eventCount = ::epoll_wait(_epfd, _events, MAX_EVENTS, timeout);
+			if (eventCount < 0 && errno == EINTR)
+				eventCount = 0;
 			THROW_IF(eventCount < 0,
-					new Utils::Exception("Looper poll FAILED, errno=%u!", errno));
-			Utils::Log::v("<-- poll eventCount=%d", eventCount);
-			for (int i = 0; eventCount > 0 && i < MAX_FD_COUNT; ++i)
-				if (_fds[i].fd >= 0 && _fds[i].revents) {
-					ASSERT(_listeners[i]);
-					if ((_fds[i].revents & POLLIN)) {
-						_fds[i].events &= ~POLLIN;
-						Utils::Log::d("#%d onToRead", i);
-						_listeners[i]->onFDToRead();
-					} else if ((_fds[i].revents & POLLOUT)) {
-						_fds[i].events &= ~POLLOUT;
-						Utils::Log::d("#%d onToWrite", i);
-						_listeners[i]->onFDToWrite();
-					} else if ((_fds[i].revents & (POLLHUP | POLLRDHUP))) {
-						_fds[i].events = 0;
-						Utils::Log::d("#%d onClosed", i);
-						_listeners[i]->onFDClosed();
-					} else if ((_fds[i].revents & POLLERR)) {
-						_fds[i].events = 0;
-						Utils::Log::d("#%d onError", i);
-						Utils::Exception* e = new Utils::Exception(
-								"poll #%d Error", i);
-						e->setTrace(__FUNCTION__, __FILE__, __LINE__);
-						_listeners[i]->onFDError(e);
-					}
-					--eventCount;
+					new Utils::Exception("Looper epoll_wait FAILED, errno=%u!", errno));
+			Utils::Log::v("<-- epoll_wait eventCount=%d", eventCount);
+			return eventCount;
+		}
+
+		void dispatch(int eventCount) THROWS {
+			for (int n = 0; n < eventCount; ++n) {
+				int i = (int) (uint32_t) _events[n].data.u64;
+				uint32_t gen = (uint32_t) (_events[n].data.u64 >> 32);
+				uint32_t revents = _events[n].events;
+				_Slot& slot = _slots[i];
+				// 同一批事件中前面的回调可能已经detach甚至复用了该slot
+				if (slot.fd < 0 || slot.gen != gen)
+					continue;
+				ASSERT(slot.listener);
+				bool handled = false;
+				if ((revents & EPOLLIN) && (slot.events & EPOLLIN)) {
+					_setEvents(i, slot.events & ~EPOLLIN);
+					Utils::Log::d("#%d onToRead", i);
+					slot.listener->onFDToRead();
+					handled = true;
+				}
+				// 读写同一轮都派发，否则读事件不断时写等待永远轮不到；
+				// 读回调可能detach了该slot，_slots也可能因attach而重新分配
+				if ((revents & EPOLLOUT) && _slots[i].fd >= 0
+						&& _slots[i].gen == gen
+						&& (_slots[i].events & EPOLLOUT)) {
+					_setEvents(i, _slots[i].events & ~EPOLLOUT);
+					Utils::Log::d("#%d onToWrite", i);
+					_slots[i].listener->onFDToWrite();
+					handled = true;
 				}
+				if (handled)
+					continue;
+				if ((revents & (EPOLLHUP | EPOLLRDHUP))) {
+					_setEvents(i, 0);
+					Utils::Log::d("#%d onClosed", i);
+					slot.listener->onFDClosed();
+				} else if ((revents & EPOLLERR)) {
+					_setEvents(i, 0);
+					Utils::Log::d("#%d onError", i);
+					Utils::Exception* e = new Utils::Exception(
+							"epoll #%d Error", i);
+					e->setTrace(__FUNCTION__, __FILE__, __LINE__);
+					slot.listener->onFDError(e);
+				}
+			}
 		}
 	} FDs;
 
-	LooperImpl() {
+	// 分层时间轮：第0层256个1ms槽，其上三层各64槽，覆盖约18.6小时
+	struct {
+		struct _Head: LooperTask {
+			_Head() {
+				_prev = _next = this;
+			}
+			~_Head() {
+				_prev = _next = NULL;
+			}
+			void runTask() {
+			}
+		} _tv1[TVR_SIZE], _tvn[TV_LEVELS - 1][TVN_SIZE], _expired, _posted;
+		struct _Mark: LooperTask {
+			void runTask() {
+			}
+		} _mark;
+		uint64_t _now, _time;
+		size_t _count[LEVEL_POSTED + 1];
+
+		static uint64_t clock() {
+			struct timespec ts;
+			::clock_gettime(CLOCK_MONOTONIC, &ts);
+			return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+		}
+
+		void init() {
+			_now = _time = clock();
+			::memset(_count, 0, sizeof(_count));
+		}
+
+		static bool _isEmpty(const LooperTask* head) {
+			return head->_next == head;
+		}
+
+		void _link(LooperTask* head, LooperTask* task, int level) {
+			task->_next = head;
+			task->_prev = head->_prev;
+			head->_prev->_next = task;
+			head->_prev = task;
+			task->_level = level;
+			++_count[level];
+		}
+
+		void _unlink(LooperTask* task) {
+			task->_prev->_next = task->_next;
+			task->_next->_prev = task->_prev;
+			task->_prev = task->_next = NULL;
+			--_count[task->_level];
+			task->_level = -1;
+		}
+
+		void _add(LooperTask* task) {
+			uint64_t expires = task->_expires;
+			if (expires < _time) {
+				_link(&_expired, task, LEVEL_EXPIRED);
+				return;
+			}
+			uint64_t idx = expires - _time;
+			if (idx < TVR_SIZE) {
+				_link(&_tv1[expires & TVR_MASK], task, 0);
+				return;
+			}
+			if (idx > MAX_TIMEOUT) // 超出时间轮范围的先挂在最远处，降层时再按真实时刻重新放置
+				expires = _time + MAX_TIMEOUT, idx = MAX_TIMEOUT;
+			for (int level = 1;; ++level)
+				if (level == TV_LEVELS - 1
+						|| idx < (1ULL << TV_SHIFT(level + 1))) {
+					int i = (expires >> TV_SHIFT(level)) & TVN_MASK;
+					_link(&_tvn[level - 1][i], task, level);
+					return;
+				}
+		}
+
+		void _cascade(int level, int index) {
+			LooperTask* head = &_tvn[level - 1][index];
+			while (!_isEmpty(head)) {
+				LooperTask* task = head->_next;
+				_unlink(task);
+				_add(task);
+			}
+		}
+
+		// 不早于from的、可能有高层任务降入第0层的最近时刻
+		uint64_t _nextBoundary(uint64_t from) const {
+			for (int level = 1; level < TV_LEVELS; ++level)
+				if (_count[level] > 0) {
+					uint64_t mask = (1ULL << TV_SHIFT(level)) - 1;
+					return (from + mask) & ~mask;
+				}
+			return TV_NEVER;
+		}
+
+		// 在head末尾插一个标记，只执行标记之前的任务。任务抛出异常时剩下的任务
+		// 仍留在原链表里，标记在下一次执行时摘掉，不会丢任务也不会破坏链表
+		void _unmark() {
+			_mark._prev->_next = _mark._next;
+			_mark._next->_prev = _mark._prev;
+			_mark._prev = _mark._next = NULL;
+		}
+
+		void _runList(LooperTask* head) THROWS {
+			if (_mark._next)
+				_unmark();
+			if (_isEmpty(head))
+				return;
+			_mark._next = head;
+			_mark._prev = head->_prev;
+			head->_prev->_next = &_mark;
+			head->_prev = &_mark;
+			while (head->_next != &_mark) {
+				LooperTask* task = head->_next;
+				_unlink(task);
+				task->runTask();
+			}
+			_unmark();
+		}
+
+		void schedule(LooperTask* task, unsigned timeout) {
+			if (task->_next)
+				_unlink(task);
+			task->_expires = _now + timeout;
+			_add(task);
+		}
+
+		void post(LooperTask* task) {
+			if (task->_next)
+				_unlink(task);
+			_link(&_posted, task, LEVEL_POSTED);
+		}
+
+		void cancel(LooperTask* task) {
+			if (task->_next)
+				_unlink(task);
+		}
+
+		// 只执行进入本轮前已投递的任务，执行中再投递的留到下一轮，不会饿死fd
+		void runPosted() THROWS {
+			if (_count[LEVEL_POSTED] > 0)
+				_runList(&_posted);
+		}
+
+		int timeout() const {
+			if (_count[LEVEL_EXPIRED] > 0 || _count[LEVEL_POSTED] > 0)
+				return 0;
+			uint64_t t = _nextBoundary(_time);
+			if (_count[0] > 0)
+				for (uint64_t i = _time; i < t && i < _time + TVR_SIZE; ++i)
+					if (!_isEmpty(&_tv1[i & TVR_MASK])) {
+						t = i;
+						break;
+					}
+			if (t == TV_NEVER)
+				return -1;
+			return t <= _now ? 0 : (int) (t - _now);
+		}
+
+		void run(uint64_t now) THROWS {
+			_now = now;
+			_runList(&_expired);
+			while (_time <= _now) {
+				int index = _time & TVR_MASK;
+				if (index == 0)
+					for (int level = 1; level < TV_LEVELS; ++level) {
+						int i = (_time >> TV_SHIFT(level)) & TVN_MASK;
+						_cascade(level, i);
+						if (i != 0)
+							break;
+					}
+				if (_count[0] == 0) {
+					_time = Utils::min(_now + 1, _nextBoundary(_time + 1));
+					continue;
+				}
+				++_time;
+				_runList(&_tv1[index]);
+			}
+		}
+	} Timers;
+
+	// 循环次数和每次唤醒拿到的事件数，只由本线程记录，抓取指标的线程来读；
+	// 同Histogram的桶一样用字长的计数，32位平台上不会读到半个值
+	size_t _iterations;
+	Histogram _wakeups;
+	size_t _index;
+	LooperImpl* _nextLooper;
+
+	LooperImpl() :
+			_iterations(0), _index(0), _nextLooper(NULL) THROWS {
 		FDs.init();
+		Timers.init();
+	}
+
+	// 挂着的任务不能被别的线程的Looper拿走，摘下来之后才能换
+	static void own(Looper* looper, LooperTask* task) {
+		ASSERT(task->_next == NULL || task->_looper == looper);
+		task->_looper = looper;
 	}
 
 	void loopOnce() THROWS {
-		FDs.loopOnce();
+		Timers.runPosted();
+		int eventCount = FDs.wait(Timers.timeout());
+		__sync_add_and_fetch(&_iterations, 1);
+		_wakeups.record(eventCount);
+		Timers.run(Timers.clock());
+		FDs.dispatch(eventCount);
 	}
 };
 
+// 各线程的Looper按创建顺序串起来，抓取指标时遍历；Looper随线程常驻，不会移除
+static struct _LooperMetrics: MetricsSource {
+	Mutex _lock;
+	LooperImpl *_first, *_last;
+	size_t _count;
+
+	_LooperMetrics() :
+			_first(NULL), _last(NULL), _count(0) {
+	}
+
+	void add(LooperImpl* looper) {
+		_lock.lock();
+		if (_count == 0)
+			Metrics::addSource(this);
+		looper->_index = _count++;
+		if (_last)
+			_last->_nextLooper = looper;
+		else
+			_first = looper;
+		_last = looper;
+		_lock.unlock();
+	}
+
+	void writeMetrics(MetricsWriter& out) {
+		_lock.lock();
+		for (LooperImpl* looper = _first; looper; looper = looper->_nextLooper)
+			out.counter("transproxy_looper_iterations_total",
+					"Looper iterations",
+					(uint64_t) __sync_fetch_and_add(&looper->_iterations, 0),
+					MetricsWriter::label("looper", looper->_index));
+		for (LooperImpl* looper = _first; looper; looper = looper->_nextLooper)
+			out.histogram("transproxy_looper_wakeup_events",
+					"Events returned by each epoll_wait", looper->_wakeups, 1,
+					0, 6, MetricsWriter::label("looper", looper->_index));
+		_lock.unlock();
+	}
+} _looperMetrics;
+
+LooperTask::~LooperTask() {
+	if (_next) {
+		ASSERT(_looper == Looper::myLooper());
+		_looper->cancel(this);
+	}
+}
+
 static LooperImpl* __fromLooper(Looper* looper) {
 	THROW_IF(looper == NULL,
 			new Utils::Exception("Looper called before preparing!!!"));
@@ -137,7 +481,9 @@ static Utils::ThreadLocal<LooperImpl> _looper;
 void Looper::prepare() THROWS {
 	LooperImpl* looper = _looper.get();
 	THROW_IF(looper != NULL, new Utils::Exception("Looper prepared already!!!"));
-	_looper.set(new LooperImpl());
+	looper = new LooperImpl();
+	_looper.set(looper);
+	_looperMetrics.add(looper);
 }
 
 void Looper::loopOnce() THROWS {
@@ -169,4 +515,22 @@ void Looper::waitToWrite(int index) {
 	__fromLooper(this)->FDs.waitToWrite(index);
 }
 
+void Looper::schedule(LooperTask* task, unsigned timeout) {
+	LooperImpl* impl = __fromLooper(this);
+	LooperImpl::own(this, task);
+	impl->Timers.schedule(task, timeout);
+}
+
+void Looper::post(LooperTask* task) {
+	LooperImpl* impl = __fromLooper(this);
+	LooperImpl::own(this, task);
+	impl->Timers.post(task);
+}
+
+void Looper::cancel(LooperTask* task) {
+	LooperImpl* impl = __fromLooper(this);
+	ASSERT(task->_next == NULL || task->_looper == this);
+	impl->Timers.cancel(task);
+}
+
 }
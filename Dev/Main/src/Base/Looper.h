@@ -1,3 +1,4 @@
+#include <stdint.h>
 #include "Debug.h"
 
 #pragma once
@@ -13,6 +14,27 @@ struct FDListener {
 	virtual void onFDError(Utils::Exception* e) THROWS = 0;
 };
 
+// 挂在Looper时间轮上的任务节点，由Looper直接链接，调度与取消都不需要系统调用；
+// 时间轮不加锁，挂着的任务只能在所属线程上调度、取消和析构
+class LooperTask {
+	friend struct Looper;
+	friend struct LooperImpl;
+	LooperTask *_prev, *_next;
+	uint64_t _expires;
+	int _level;
+	// 挂在哪个Looper上，析构时从它上面摘掉
+	struct Looper* _looper;
+public:
+	LooperTask() :
+			_prev(NULL), _next(NULL), _expires(0), _level(-1), _looper(NULL) {
+	}
+	virtual ~LooperTask();
+	bool isScheduled() const {
+		return _next != NULL;
+	}
+	virtual void runTask() THROWS = 0;
+};
+
 struct Looper {
 	static void prepare() THROWS;
 	static void loopOnce() THROWS;
@@ -22,8 +44,15 @@ struct Looper {
 	int attachFD(int fd, FDListener* listener) THROWS;
 	void detachFD(int index);
 
+	// 读、写等待可以同时挂着（splice两个方向共用一个socket），各自触发一次后清掉；
+	// 调用waitToWrite()不会取消已挂着的读等待，反之亦然，回调要容忍多出来的一次通知
 	void waitToRead(int index);
 	void waitToWrite(int index);
+
+	void schedule(LooperTask* task, unsigned timeout);
+	// 在下一次阻塞等待之前执行，不经过时间轮也不产生系统调用
+	void post(LooperTask* task);
+	void cancel(LooperTask* task);
 };
 
 }
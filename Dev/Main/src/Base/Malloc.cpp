@@ -1,9 +1,11 @@
 #define IN_MALLOC
 
 #include <malloc.h>
+#include <pthread.h>
 #include "Malloc.h"
 
 static const char* __defaultMallocTag = NULL;
+static pthread_mutex_t __mallocLock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
 
 MallocBlock* __firstMallocBlock = NULL;
 
@@ -11,6 +13,14 @@ void setDefaultMallocTag(const char* tag) {
 	__defaultMallocTag = tag;
 }
 
+void lockMallocBlocks() {
+	::pthread_mutex_lock(&__mallocLock);
+}
+
+void unlockMallocBlocks() {
+	::pthread_mutex_unlock(&__mallocLock);
+}
+
 static void* __new(size_t bytes, const char* file, int line) {
 	MallocBlock* block = (MallocBlock*) ::malloc(
 			(size_t) ((MallocBlock*) 0)->buffer + bytes);
@@ -20,16 +30,19 @@ static void* __new(size_t bytes, const char* file, int line) {
 	block->file = file;
 	block->line = line;
 	block->prev = NULL;
+	::pthread_mutex_lock(&__mallocLock);
 	block->next = __firstMallocBlock;
 	if (__firstMallocBlock)
 		__firstMallocBlock->prev = block;
 	__firstMallocBlock = block;
+	::pthread_mutex_unlock(&__mallocLock);
 	return block->buffer;
 }
 
 static void __delete(void* ptr) {
 	MallocBlock* block = (MallocBlock*) ((uint8_t*) ptr
 			- (size_t) ((MallocBlock*) 0)->buffer);
+	::pthread_mutex_lock(&__mallocLock);
 	MallocBlock* prev = block->prev;
 	MallocBlock* next = block->next;
 	if (prev)
@@ -38,6 +51,7 @@ static void __delete(void* ptr) {
 		__firstMallocBlock = next;
 	if (next)
 		next->prev = prev;
+	::pthread_mutex_unlock(&__mallocLock);
 	::free(block);
 }
 
@@ -26,3 +26,7 @@ void operator delete[](void* ptr);
 #endif
 
 void setDefaultMallocTag(const char* tag);
+
+// 遍历__firstMallocBlock链表前后调用，锁可重入，遍历中仍可以new/delete
+void lockMallocBlocks();
+void unlockMallocBlocks();
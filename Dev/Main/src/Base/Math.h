@@ -1,6 +1,7 @@
 #include <netinet/in.h>
 #include <stdint.h>
 #include <time.h>
+#include "Checksum.h"
 #include "String.h"
 
 #pragma once
@@ -19,14 +20,9 @@ template<typename T> static inline T max(T a, T b) {
 	return a >= b ? a : b;
 }
 
+// 16位反码部分和，由Checksum.cpp中按CPU选定的内核计算
 static inline uint32_t sum(const void* data, size_t bytes) {
-	const uint8_t* buf = (const uint8_t*) data;
-	uint32_t cksum = 0;
-	if ((bytes & 1) != 0)
-		cksum = (uint16_t) buf[--bytes] << 8;
-	for (size_t i = 0; i < bytes; i += 2)
-		cksum += (uint16_t) ntohs(*(uint16_t*) (buf + i));
-	return cksum;
+	return __sumKernel(data, bytes);
 }
 
 static inline uint16_t checksum(uint32_t cksum) {
@@ -39,6 +35,23 @@ static inline uint16_t checksum(uint32_t cksum) {
 	return htons(~cksum);
 }
 
+// RFC 1624：字段由oldv改为newv时校验和的增量（反码和），16位和32位字段都适用
+static inline uint32_t checksumDelta(uint32_t oldv, uint32_t newv) {
+	return (~oldv >> 16) + (~oldv & 0xFFFF) + (newv >> 16) + (newv & 0xFFFF);
+}
+
+// RFC 1624 式3：HC' = ~(~HC + ~m + m')，cksum为网络字节序的原校验和字段
+static inline uint16_t adjustChecksum(uint16_t cksum, uint32_t delta) {
+	return checksum((uint16_t) ~ntohs(cksum) + delta);
+}
+
+// 单调时钟，纳秒
+static inline uint64_t nanoTime() {
+	struct timespec ts;
+	::clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 static inline void formatTime(char* buf, time_t t) {
 	struct tm* lt = localtime(&t);
 	::sprintf(buf, "%u:%02u:%02u", lt->tm_hour, lt->tm_min, lt->tm_sec);
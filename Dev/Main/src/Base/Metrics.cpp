@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <string.h>
+#include "Mutex.h"
+#include "Metrics.h"
+
+namespace Utils {
+
+static Mutex _lock;
+static MetricsSource *_first = NULL, *_last = NULL;
+
+void MetricsWriter::_header(const char* name, const char* type,
+		const char* help) {
+	if (_family == name)
+		return;
+	_family = name;
+	_text += "# HELP ";
+	_text += name;
+	_text += ' ';
+	_text += help;
+	_text += "\n# TYPE ";
+	_text += name;
+	_text += ' ';
+	_text += type;
+	_text += '\n';
+}
+
+void MetricsWriter::_sample(const char* name, const char* labels,
+		const char* value) {
+	_text += name;
+	if (labels && *labels) {
+		_text += '{';
+		_text += labels;
+		_text += '}';
+	}
+	_text += ' ';
+	_text += value;
+	_text += '\n';
+}
+
+void MetricsWriter::counter(const char* name, const char* help,
+		uint64_t value, const char* labels) {
+	char s[24];
+	::snprintf(s, sizeof(s), "%llu", (unsigned long long) value);
+	_header(name, "counter", help);
+	_sample(name, labels, s);
+}
+
+void MetricsWriter::gauge(const char* name, const char* help, double value,
+		const char* labels) {
+	char s[32];
+	::snprintf(s, sizeof(s), "%.10g", value);
+	_header(name, "gauge", help);
+	_sample(name, labels, s);
+}
+
+// 直方图按桶的下界归入各个le，误差不超过一个桶宽
+void MetricsWriter::histogram(const char* name, const char* help,
+		const Histogram& h, double scale, unsigned minBits, unsigned maxBits,
+		const char* labels) {
+	_header(name, "histogram", help);
+	String bucket = String(name) + "_bucket";
+	String prefix = labels && *labels ? String(labels) + "," : String("");
+	char s[64];
+	for (unsigned bits = minBits; bits <= maxBits && bits < 32; ++bits) {
+		uint32_t bound = (uint32_t) 1 << bits;
+		::snprintf(s, sizeof(s), "le=\"%.10g\"", bound * scale);
+		String l = prefix + (const char*) s;
+		::snprintf(s, sizeof(s), "%llu",
+				(unsigned long long) h.getCountAtMost(bound));
+		_sample(bucket, l, s);
+	}
+	size_t count = h.getCount();
+	::snprintf(s, sizeof(s), "%llu", (unsigned long long) count);
+	_sample(bucket, prefix + "le=\"+Inf\"", s);
+	char v[32];
+	::snprintf(v, sizeof(v), "%.10g", h.getMean() * count * scale);
+	_sample(String(name) + "_sum", labels, v);
+	_sample(String(name) + "_count", labels, s);
+}
+
+String MetricsWriter::label(const char* name, const char* value) {
+	StringBuilder s(64);
+	s += name;
+	s += "=\"";
+	for (const char* p = value; *p; ++p)
+		if (*p == '\\')
+			s += "\\\\";
+		else if (*p == '"')
+			s += "\\\"";
+		else if (*p == '\n')
+			s += "\\n";
+		else
+			s += *p;
+	s += '"';
+	return s.toString();
+}
+
+String MetricsWriter::label(const char* name, uint64_t value) {
+	char s[24];
+	::snprintf(s, sizeof(s), "%llu", (unsigned long long) value);
+	return label(name, s);
+}
+
+void Metrics::addSource(MetricsSource* source) {
+	_lock.lock();
+	source->_next = NULL;
+	if (_last)
+		_last->_next = source;
+	else
+		_first = source;
+	_last = source;
+	_lock.unlock();
+}
+
+void Metrics::write(MetricsWriter& out) {
+	_lock.lock();
+	for (MetricsSource* source = _first; source; source = source->_next)
+		source->writeMetrics(out);
+	_lock.unlock();
+}
+
+}
@@ -0,0 +1,65 @@
+#include <stddef.h>
+#include <stdint.h>
+#include "Histogram.h"
+#include "String.h"
+
+#pragma once
+
+namespace Utils {
+
+// 按Prometheus文本格式（0.0.4）输出指标。
+// 同名的样本必须连续写出，HELP和TYPE只在名字变化时写一次。
+// labels形如 a="x",b="y"，可为NULL
+class MetricsWriter {
+	StringBuilder _text;
+	String _family;
+
+	void _header(const char* name, const char* type, const char* help);
+	void _sample(const char* name, const char* labels, const char* value);
+
+public:
+	MetricsWriter() :
+			_text(16384), _family("") {
+	}
+
+	void counter(const char* name, const char* help, uint64_t value,
+			const char* labels = NULL);
+	void gauge(const char* name, const char* help, double value,
+			const char* labels = NULL);
+	// 桶的上界取2^minBits~2^maxBits，记录值乘以scale换算成导出的单位
+	void histogram(const char* name, const char* help, const Histogram& h,
+			double scale, unsigned minBits, unsigned maxBits,
+			const char* labels = NULL);
+
+	// 生成 name="value"，转义value中的\、"和换行
+	static String label(const char* name, const char* value);
+	static String label(const char* name, uint64_t value);
+
+	const char* toString() const {
+		return _text.toString();
+	}
+};
+
+// 指标的来源。计数本身由各模块在热路径上自己累加（通常是所属线程独写的普通变量），
+// 被抓取时才读出来写给MetricsWriter，允许稍有滞后
+class MetricsSource {
+	friend class Metrics;
+	MetricsSource* _next;
+
+public:
+	MetricsSource() :
+			_next(NULL) {
+	}
+	virtual ~MetricsSource() {
+	}
+	virtual void writeMetrics(MetricsWriter& out) = 0;
+};
+
+// 全局的来源登记表，任何线程都可以登记
+class Metrics {
+public:
+	static void addSource(MetricsSource* source);
+	static void write(MetricsWriter& out);
+};
+
+}
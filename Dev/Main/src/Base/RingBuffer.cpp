@@ -35,6 +35,17 @@ size_t RingBuffer::free() const {
 	return l;
 }
 
+void RingBuffer::grow(size_t ring_size) {
+	if (!mNeedFree || ring_size <= mRing->buffer_size)
+		return;
+	TRing* ring = (TRing*) new uint8_t[calcTotalSize(ring_size)];
+	ring->buffer_size = ring_size;
+	ring->read = 0;
+	ring->write = peek(ring->buffer, ring_size);
+	delete[] (uint8_t*) mRing;
+	mRing = ring;
+}
+
 size_t RingBuffer::peek(size_t offset, size_t bytes, void* buffer) {
 	size_t r = (mRing->read + offset) % (mRing->buffer_size << 1);
 	size_t w = mRing->write;
@@ -45,8 +45,13 @@ public:
 			delete[] (uint8_t*) mRing;
 	}
 
+	size_t size() const {
+		return mRing->buffer_size;
+	}
 	size_t available() const;
 	size_t free() const;
+	// 把缓冲区扩大到ring_size，已有数据保留；只能用于alloc()出来的
+	void grow(size_t ring_size);
 
 	size_t peek(size_t offset, size_t bytes, void* buffer);
 	size_t peek(void* buffer, size_t bytes) {
@@ -54,6 +59,14 @@ public:
 	}
 
 	size_t read(void* buffer, size_t bytes);
+	// 丢掉开头的bytes字节
+	size_t skip(size_t bytes) {
+		size_t l = available();
+		if (bytes > l)
+			bytes = l;
+		end_read(bytes);
+		return bytes;
+	}
 	size_t write(const void* buffer, size_t bytes);
 
 	void clear_unsafe() {
@@ -84,7 +84,7 @@ class _Request: public HttpClient::Request {
 		void onTcpDisconnected() THROWS {
 			if (_this->_state != STATE_CLOSED) {
 				_this->_state = STATE_CLOSED;
-				_this->_timer.setTimeout(0);
+				_this->_timer.post();
 				_this->_listener->onHttpClientError(
 				new Utils::Exception("Disconnected by peer"));
 			}
@@ -130,7 +130,7 @@ public:
 		Utils::Log::d("==> close");
 		if (_state != STATE_CLOSED) {
 			_state = STATE_CLOSED;
-			_timer.setTimeout(0);
+			_timer.post();
 		}
 		Utils::Log::d("<== close");
 	}
@@ -246,7 +246,7 @@ void _Request::send(void* data, size_t bytes, const char* type) THROWS {
 		::memcpy(_content, data, bytes);
 		_content[bytes] = '\0';
 	}
-	_timer.setTimeout(0);
+	_timer.post();
 }
 
 void _Request::_doHttp() THROWS {
@@ -288,7 +288,7 @@ void _Request::_doHttp() THROWS {
 		_header = s.toString();
 		_state = STATE_SEND_HEADER;
 		_sent = 0;
-		_timer.setTimeout(0);
+		_timer.post();
 	} else if (_state == STATE_SEND_HEADER) {
 		_sent += _conn->send(_header.sz() + _sent, _header.length() - _sent);
 		if (_sent < _header.length()) {
@@ -296,7 +296,7 @@ void _Request::_doHttp() THROWS {
 		} else if (_content) {
 			_state = STATE_SEND_CONTENT;
 			_sent = 0;
-			_timer.setTimeout(0);
+			_timer.post();
 		} else {
 			_state = STATE_RECEIVE_HEADER;
 			_conn->waitToRecv();
@@ -342,7 +342,7 @@ void _Request::_doHttp() THROWS {
 				} else {
 					_state = STATE_COMPLETED;
 				}
-				_timer.setTimeout(0);
+				_timer.post();
 				_listener->onResponseHeader(&_response);
 				break;
 			}
@@ -362,7 +362,7 @@ void _Request::_doHttp() THROWS {
 				_response.contentLength = l;
 				_state = STATE_RECEIVE_CHUNK_DATA;
 				_sent = 0;
-				_timer.setTimeout(0);
+				_timer.post();
 			}
 		} else {
 			_conn->waitToRecv();
@@ -390,7 +390,7 @@ void _Request::_doHttp() THROWS {
 				_state = STATE_COMPLETED;
 			else
 				_state = STATE_RECEIVE_CHUNK_TAIL;
-			_timer.setTimeout(0);
+			_timer.post();
 		} else {
 			_conn->waitToRecv();
 		}
@@ -405,13 +405,13 @@ void _Request::_doHttp() THROWS {
 			} else {
 				_state = STATE_COMPLETED;
 			}
-			_timer.setTimeout(0);
+			_timer.post();
 		} else {
 			_conn->waitToRecv();
 		}
 	} else if (_state == STATE_COMPLETED) {
 		_state = STATE_CLOSED;
-		_timer.setTimeout(0);
+		_timer.post();
 		_listener->onResponseCompleted();
 	} else if (_state == STATE_CLOSED) {
 		delete this;
@@ -1,6 +1,7 @@
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <netinet/in.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include "Base/Math.h"
 #include "Base/String.h"
@@ -17,10 +18,12 @@ static inline uint32_t aton(const char* ip) {
 	return ntohl(::inet_addr(ip));
 }
 
+// inet_ntoa()用的是进程内唯一的静态缓冲区，工作线程并发调用会互相覆盖，这里改为每线程一份
 static inline const char* ntoa(uint32_t ip) {
-	struct in_addr ia;
-	ia.s_addr = htonl(ip);
-	return ::inet_ntoa(ia);
+	static __thread char s[16];
+	::sprintf(s, "%u.%u.%u.%u", ip >> 24, (ip >> 16) & 0xFF, (ip >> 8) & 0xFF,
+			ip & 0xFF);
+	return s;
 }
 
 static inline bool isLanIP(uint32_t ip) {
@@ -198,8 +201,8 @@ public:
 	static uint8_t getProtocol(void* ptr) {
 		return ((uint8_t*) ptr)[9];
 	}
-	IpPacket(void* ptr, size_t size) :
-			Packet(ptr, size) {
+	IpPacket(void* ptr, size_t size, VnetHeader* vnet = NULL) :
+			Packet(ptr, size, vnet) {
 		THROW_IF(!isValid(ptr), new Utils::Exception("Not IPv4 packet"));
 		_hdrlen = ((*(Packet*) this)[0] & 0x0F) * 4;
 	}
@@ -272,6 +275,16 @@ public:
 		checksum = Utils::checksum(Utils::sum(header, _hdrlen));
 		//Log::d("IP checksum = 0x%04X", checksum);
 	}
+	// 改写源、目的地址并增量更新首部校验和，返回的增量供上层协议修正伪首部校验和
+	uint32_t rewriteAddrs(uint32_t src, uint32_t dest) {
+		uint32_t delta = Utils::checksumDelta(getSrcAddr(), src)
+				+ Utils::checksumDelta(getDestAddr(), dest);
+		setSrcAddr(src);
+		setDestAddr(dest);
+		uint16_t& checksum = *(uint16_t*) (ptr() + 10);
+		checksum = Utils::adjustChecksum(checksum, delta);
+		return delta;
+	}
 };
 
 class TcpPacket: public IpPacket {
@@ -439,6 +452,97 @@ public:
 						+ Utils::sum(data, datalen));
 		//Log::d("TCP checksum = 0x%04X", checksum);
 	}
+	// 只填伪首部部分和，由内核在分段（GSO）时补全TCP校验和，需要包带有vnet头
+	void fillPartialChecksum() {
+		IpPacket::fillChecksum();
+
+		uint8_t* header = ptr();
+		uint8_t* data = header + IpPacket::headerSize();
+		size_t datalen = IpPacket::getDataSize();
+
+		uint16_t& checksum = *(uint16_t*) (data + 16);
+		checksum = ~Utils::checksum(
+				Utils::sum(header + 12, 8) + IPPROTO_TCP + datalen);
+
+		VnetHeader* vnet = Packet::vnet();
+		vnet->flags = VnetHeader::F_NEEDS_CSUM;
+		vnet->csumStart = IpPacket::headerSize();
+		vnet->csumOffset = 16;
+	}
+	// 转发时只改写这些首部字段，按RFC 1624在原校验和上增量修正，不再遍历负载。
+	// 原包校验和必须是完整的（非offload），原来错的改写后也仍然是错的
+	void rewrite(SockAddr src, SockAddr dest, uint32_t seq, uint32_t ack,
+			uint16_t windowSize) {
+		uint32_t delta = IpPacket::rewriteAddrs(src.ip, dest.ip)
+				+ Utils::checksumDelta(getSrcPort(), src.port)
+				+ Utils::checksumDelta(getDestPort(), dest.port)
+				+ Utils::checksumDelta(getSeq(), seq)
+				+ Utils::checksumDelta(getAck(), ack)
+				+ Utils::checksumDelta(getWindowSize(), windowSize);
+		setSrcPort(src.port);
+		setDestPort(dest.port);
+		setSeq(seq);
+		setAck(ack);
+		setWindowSize(windowSize);
+		uint16_t& checksum = *(uint16_t*) (IpPacket::dataPtr() + 16);
+		checksum = Utils::adjustChecksum(checksum, delta);
+	}
+	// 写入选项，bytes须为4的倍数（不足的用NOP补齐），要在写数据之前调用
+	void setOptions(const void* options, size_t bytes) {
+		_hdrlen = 20 + bytes;
+		IpPacket::dataPtr()[12] = (_hdrlen / 4) << 4;
+		IpPacket::write(20, options, bytes);
+	}
+	// 窗口扩大选项的移位数，没有时返回-1
+	int getWindowScale() const {
+		size_t offset = _findOption(3, 3);
+		return offset ? IpPacket::dataPtr()[offset + 2] : -1;
+	}
+	// MSS选项的值，没有时返回0
+	uint16_t getMss() const {
+		size_t offset = _findOption(2, 4);
+		return offset ? IpPacket::read16(offset + 2) : 0;
+	}
+	// MSS选项大于mss时改成mss，按增量修正校验和，返回是否改了。
+	// 没带MSS选项的不补（首部没有空位），对方会按默认的536处理
+	bool clampMss(uint16_t mss) {
+		size_t offset = _findOption(2, 4);
+		if (offset == 0)
+			return false;
+		uint16_t old = IpPacket::read16(offset + 2);
+		if (old <= mss)
+			return false;
+		IpPacket::write16(offset + 2, mss);
+		// 字段落在奇数偏移上时，反码和里它的两个字节是对调的
+		uint32_t delta =
+				(offset & 1) ?
+						Utils::checksumDelta(
+								(uint16_t) (old << 8 | old >> 8),
+								(uint16_t) (mss << 8 | mss >> 8)) :
+						Utils::checksumDelta(old, mss);
+		uint16_t& checksum = *(uint16_t*) (IpPacket::dataPtr() + 16);
+		checksum = Utils::adjustChecksum(checksum, delta);
+		return true;
+	}
+
+private:
+	// 在选项里找指定类型和长度的选项，返回其在TCP首部中的偏移，没有或选项格式不对时返回0
+	size_t _findOption(uint8_t kind, uint8_t length) const {
+		const uint8_t* p = IpPacket::dataPtr();
+		size_t i = 20;
+		while (i < _hdrlen && p[i] != 0) {
+			if (p[i] == 1) {
+				++i;
+				continue;
+			}
+			if (i + 1 >= _hdrlen || p[i + 1] < 2 || i + p[i + 1] > _hdrlen)
+				break;
+			if (p[i] == kind)
+				return p[i + 1] == length ? i : 0;
+			i += p[i + 1];
+		}
+		return 0;
+	}
 };
 
 class TcpPacketBuffer: public TcpPacket {
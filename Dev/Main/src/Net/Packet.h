@@ -9,19 +9,40 @@ enum {
 	PROTO_NULL = -1, PROTO_TCP = 0, PROTO_UDP, PROTO_COUNT
 };
 
+// 与内核virtio_net_hdr布局一致（主机字节序），TUN开启IFF_VNET_HDR后每个包前都带着它
+struct VnetHeader {
+	enum {
+		F_NEEDS_CSUM = 1, F_DATA_VALID = 2
+	};
+	enum {
+		GSO_NONE = 0, GSO_TCPV4 = 1, GSO_ECN = 0x80
+	};
+	uint8_t flags;
+	uint8_t gsoType;
+	uint16_t hdrLen;
+	uint16_t gsoSize;
+	uint16_t csumStart;
+	uint16_t csumOffset;
+};
+
 class Packet {
 	uint8_t* _ptr;
 	size_t _size;
+	VnetHeader* _vnet;
 
 public:
-	Packet(void* ptr, size_t size) :
-			_ptr((uint8_t*) ptr), _size(size) {
+	Packet(void* ptr, size_t size, VnetHeader* vnet = NULL) :
+			_ptr((uint8_t*) ptr), _size(size), _vnet(vnet) {
 	}
 	virtual ~Packet() {
 	}
 	size_t size() const {
 		return _size;
 	}
+	// TUN工作在offload模式时随包收发的VnetHeader，普通模式下为NULL
+	VnetHeader* vnet() const {
+		return _vnet;
+	}
 	uint8_t* ptr() {
 		return _ptr;
 	}
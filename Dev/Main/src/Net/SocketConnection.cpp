@@ -157,7 +157,7 @@ size_t SocketConnection::recv(void* data, size_t bytes) THROWS {
 
 size_t SocketConnection::send(const void* data, size_t bytes) THROWS {
 	ASSERT(_socket >= 0);
-	ssize_t r = ::send(_socket, data, bytes, 0);
+	ssize_t r = ::send(_socket, data, bytes, MSG_NOSIGNAL);
 	if (r < 0 && errno == EAGAIN)
 		r = 0;
 	THROW_IF(r < 0,
@@ -3,35 +3,110 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <net/if.h>
 #include <netinet/in.h>
 #include <linux/if_tun.h>
 #include "Net/IPv4.h"
 #include "Tun.h"
 
+#define TUN_BUFFER_SIZE  1500
+#define TUN_GSO_MAX_SIZE 65535
+#define TUN_BATCH_MAX    256
+#define TUN_ALIGN        4
+
 namespace Net {
 
-Tun::Tun(uint32_t ip, uint32_t mask, TunListener* listener) :
-		_listener(listener) THROWS {
-	Utils::Log::i("TUN initializing...");
+void Tun::_open(const char* name, size_t batchSize, bool multiQueue) THROWS {
+	::pthread_spin_init(&_statsLock, PTHREAD_PROCESS_PRIVATE);
+	_batch.size = Utils::max(Utils::min(batchSize, (size_t) TUN_BATCH_MAX),
+			(size_t) 1);
+	// offload模式下内核会交上来最大64K的GSO大包，前面还带着10字节的vnet头；
+	// 头前面垫2字节，格子大小取4的倍数，MIPS上不对齐的读写会出异常
+	_batch.offset =
+			_offload ?
+					(TUN_ALIGN - sizeof(VnetHeader) % TUN_ALIGN) % TUN_ALIGN : 0;
+	_batch.slotSize =
+			_offload ?
+					(_batch.offset + sizeof(VnetHeader) + TUN_GSO_MAX_SIZE
+							+ TUN_ALIGN - 1) / TUN_ALIGN * TUN_ALIGN :
+					TUN_BUFFER_SIZE;
 
-	_fd = ::open("/dev/net/tun", O_RDWR);
+	_fd = ::open("/dev/net/tun", O_RDWR | O_NONBLOCK);
 	THROW_IF(_fd < 0, new Utils::Exception("Open TUN failed."));
 	Utils::Log::i("TUN device open.");
 
 	TRY{
 		struct ifreq ifr = {0};
+		::strncpy(ifr.ifr_name, name, IFNAMSIZ - 1);
 		ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+		if (_offload)
+			ifr.ifr_flags |= IFF_VNET_HDR;
+		if (multiQueue)
+			ifr.ifr_flags |= IFF_MULTI_QUEUE;
 		int r = ::ioctl(_fd, TUNSETIFF, &ifr);
 		THROW_IF(r < 0,
 				new Utils::Exception("Create TUN device failed, errno=%d", errno));
 
 		_name = ifr.ifr_name;
-		Utils::Log::i("TUN '%s' created.", ifr.ifr_name);
+		Utils::Log::i(multiQueue ? "TUN '%s' queue created." : "TUN '%s' created.",
+				ifr.ifr_name);
+
+		if (_offload) {
+			int hdrlen = sizeof(VnetHeader);
+			r = ::ioctl(_fd, TUNSETVNETHDRSZ, &hdrlen);
+			THROW_IF(r < 0,
+					new Utils::Exception("Set TUN vnet header size failed, errno=%d", errno));
+			r = ::ioctl(_fd, TUNSETOFFLOAD, TUN_F_CSUM | TUN_F_TSO4);
+			THROW_IF(r < 0,
+					new Utils::Exception("Set TUN offload failed, errno=%d", errno));
+			Utils::Log::i("TUN '%s' offload enabled (CSUM, TSO4).", _name.sz());
+		}
+	}CATCH(e){
+		::close(_fd);
+		THROW(e);
+	}
+}
+
+void Tun::_start(size_t txQueue, TxDrop txDrop) THROWS {
+	TRY{
+		_selector = Utils::Looper::myLooper()->attachFD(_fd, this);
+		Utils::Log::i("TUN '%s' running, selector #%d...", _name.sz(), _selector);
+		Utils::Looper::myLooper()->waitToRead(_selector);
+	}CATCH(e){
+		::close(_fd);
+		THROW(e);
+	}
+
+	_batch.buffers = new uint8_t[_batch.size * _batch.slotSize];
+	_batch.lengths = new size_t[_batch.size];
+	Utils::Log::i("TUN '%s' reads up to %u packets per wakeup.", _name.sz(),
+			_batch.size);
+
+	_tx.size = Utils::max(txQueue, (size_t) 1);
+	_tx.slots = new _TxSlot[_tx.size];
+	::memset(_tx.slots, 0, sizeof(_TxSlot) * _tx.size);
+	_tx.head = _tx.count = 0;
+	_tx.drop = txDrop;
+	Utils::Log::i("TUN '%s' queues up to %u packets when full, dropping %s.",
+			_name.sz(), _tx.size, txDrop == TX_DROP_HEAD ? "oldest" : "newest");
+}
 
+Tun::Tun(uint32_t ip, uint32_t mask, TunListener* listener, size_t batchSize,
+		bool offload, bool multiQueue, size_t txQueue, TxDrop txDrop) :
+		_listener(listener), _offload(offload), _rxBatches(0), _rxPackets(0), _rxBytes(
+				0), _txPackets(0), _txBytes(0), _txDeferred(0), _txDrops(0), _txErrors(
+				0) THROWS {
+	Utils::Log::i("TUN initializing...");
+
+	_open("", batchSize, multiQueue);
+
+	TRY{
+		struct ifreq ifr;
 		int s = ::socket(PF_INET, SOCK_STREAM, 0);
 		THROW_IF(s < 0, new Utils::Exception("Error create socket"));
 
@@ -70,23 +145,37 @@ Tun::Tun(uint32_t ip, uint32_t mask, TunListener* listener) :
 			::close(s);
 			THROW(e);
 		}
-
-		_selector = Utils::Looper::myLooper()->attachFD(_fd, this);
-		Utils::Log::i("TUN '%s' running, selector #%d...", _name.sz(), _selector);
-		Utils::Looper::myLooper()->waitToRead(_selector);
 	}CATCH(e){
 		::close(_fd);
 		THROW(e);
 	}
+
+	_start(txQueue, txDrop);
+}
+
+Tun::Tun(const char* name, TunListener* listener, size_t batchSize,
+		bool offload, size_t txQueue, TxDrop txDrop) :
+		_listener(listener), _offload(offload), _rxBatches(0), _rxPackets(0), _rxBytes(
+				0), _txPackets(0), _txBytes(0), _txDeferred(0), _txDrops(0), _txErrors(
+				0) THROWS {
+	Utils::Log::i("TUN '%s' adding queue...", name);
+	_open(name, batchSize, true);
+	_start(txQueue, txDrop);
 }
 
 Tun::~Tun() {
 	Utils::Looper::myLooper()->detachFD(_selector);
 	::close(_fd);
 	_fd = -1;
+	delete[] _batch.buffers;
+	delete[] _batch.lengths;
+	for (size_t i = 0; i < _tx.size; ++i)
+		delete[] _tx.slots[i].buf;
+	delete[] _tx.slots;
+	::pthread_spin_destroy(&_statsLock);
 }
 
-void Tun::send(void* packet, size_t bytes) THROWS {
+void Tun::send(void* packet, size_t bytes, const VnetHeader* vnet) THROWS {
 	const uint8_t* buf = (const uint8_t*) packet;
 	if (buf[9] == IPPROTO_TCP || buf[9] == IPPROTO_UDP) {
 		size_t l = (buf[0] & 0x0F) * 4;
@@ -101,31 +190,146 @@ void Tun::send(void* packet, size_t bytes) THROWS {
 	}
 	Utils::Log::dump(packet, bytes);
 
-	int r = ::write(_fd, packet, bytes);
-	THROW_IF(r != (int )bytes,
-			new Utils::Exception("Error when send %u bytes", bytes));
-}
+	struct iovec iov[2];
+	int iovcnt = 0;
+	size_t total = bytes;
+	if (_offload) {
+		// 自己构造的包没有vnet头，补一个全零的：无GSO、校验和已算好
+		static const VnetHeader none = VnetHeader();
+		iov[iovcnt].iov_base = (void*) (vnet ? vnet : &none);
+		iov[iovcnt++].iov_len = sizeof(VnetHeader);
+		total += sizeof(VnetHeader);
+	}
+	iov[iovcnt].iov_base = packet;
+	iov[iovcnt++].iov_len = bytes;
 
-void Tun::onFDToRead() {
-	uint8_t buf[1500];
-	int r = ::read(_fd, buf, sizeof(buf));
-	if (r < 0)
+	// 前面还有排队的包就不能插队
+	if (_tx.count > 0) {
+		_enqueue(iov, iovcnt, total);
 		return;
+	}
+	int r = _write(iov, iovcnt, total);
+	if (r > 0) {
+		::pthread_spin_lock(&_statsLock);
+		++_txPackets;
+		_txBytes += bytes;
+		::pthread_spin_unlock(&_statsLock);
+	} else if (r == 0) {
+		_enqueue(iov, iovcnt, total);
+	}
+}
+
+// 写出一个包返回1，设备队列满返回0；其他错误只丢掉这个包，返回-1
+int Tun::_write(const struct iovec* iov, int iovcnt, size_t bytes) {
+	ssize_t r = ::writev(_fd, iov, iovcnt);
+	if (r == (ssize_t) bytes)
+		return 1;
+	if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS))
+		return 0;
+	_add(_txErrors, 1);
+	Utils::Log::w("'%s' send %u bytes FAILED, r=%d, errno=%d", _name.sz(),
+			bytes, (int) r, errno);
+	return -1;
+}
+
+void Tun::_enqueue(const struct iovec* iov, int iovcnt, size_t bytes) {
+	if (_tx.count == _tx.size) {
+		_add(_txDrops, 1);
+		if (_tx.drop == TX_DROP_TAIL)
+			return;
+		// 丢掉最早的，腾出的格子正好给新包用
+		_tx.head = (_tx.head + 1) % _tx.size;
+		--_tx.count;
+	}
+	_TxSlot& slot = _tx.slots[(_tx.head + _tx.count) % _tx.size];
+	if (slot.capacity < bytes) {
+		delete[] slot.buf;
+		slot.buf = new uint8_t[bytes];
+		slot.capacity = bytes;
+	}
+	slot.bytes = 0;
+	for (int i = 0; i < iovcnt; ++i) {
+		::memcpy(slot.buf + slot.bytes, iov[i].iov_base, iov[i].iov_len);
+		slot.bytes += iov[i].iov_len;
+	}
+	_add(_txDeferred, 1);
+	if (_tx.count++ == 0)
+		Utils::Looper::myLooper()->waitToWrite(_selector);
+}
+
+// 可写时按序把积压的包一口气写出去，又写不进了就等下一次可写
+void Tun::onFDToWrite() {
+	while (_tx.count > 0) {
+		_TxSlot& slot = _tx.slots[_tx.head];
+		struct iovec iov;
+		iov.iov_base = slot.buf;
+		iov.iov_len = slot.bytes;
+		int r = _write(&iov, 1, slot.bytes);
+		if (r == 0) {
+			Utils::Looper::myLooper()->waitToWrite(_selector);
+			return;
+		}
+		if (r > 0) {
+			::pthread_spin_lock(&_statsLock);
+			++_txPackets;
+			_txBytes += slot.bytes - (_offload ? sizeof(VnetHeader) : 0);
+			::pthread_spin_unlock(&_statsLock);
+		}
+		_tx.head = (_tx.head + 1) % _tx.size;
+		--_tx.count;
+	}
+}
 
+void Tun::_logReceived(const uint8_t* buf, size_t bytes) {
 	if (buf[9] == IPPROTO_TCP || buf[9] == IPPROTO_UDP) {
 		size_t l = (buf[0] & 0x0F) * 4;
 		Utils::Log::v("'%s' %u.%u.%u.%u:%u <-- P%u[%u] -- %u.%u.%u.%u:%u",
 				(const char*) _name, buf[16], buf[17], buf[18], buf[19],
-				ntohs(*(uint16_t*) (buf + l + 2)), buf[9], r, buf[12], buf[13],
+				ntohs(*(uint16_t*) (buf + l + 2)), buf[9], bytes, buf[12], buf[13],
 				buf[14], buf[15], ntohs(*(uint16_t*) (buf + l)));
 	} else {
 		Utils::Log::v("'%s' %u.%u.%u.%u <-- P%u[%u] -- %u.%u.%u.%u",
 				(const char*) _name, buf[16], buf[17], buf[18], buf[19], buf[9],
-				r, buf[12], buf[13], buf[14], buf[15]);
+				bytes, buf[12], buf[13], buf[14], buf[15]);
+	}
+	Utils::Log::dump(buf, bytes);
+}
+
+void Tun::onFDToRead() {
+	// 先把设备读空（或读满一批）再统一分发，省掉每包一次的Looper往返
+	size_t n = 0, total = 0;
+	while (n < _batch.size) {
+		int r = ::read(_fd,
+				_batch.buffers + n * _batch.slotSize + _batch.offset,
+				_batch.slotSize - _batch.offset);
+		if (r <= 0)
+			break;
+		if (_offload && r <= (int) sizeof(VnetHeader))
+			continue;
+		_batch.lengths[n++] = r;
+		total += r - (_offload ? sizeof(VnetHeader) : 0);
 	}
-	Utils::Log::dump(buf, r);
-	_listener->onTunReceived(buf, r);
 	Utils::Looper::myLooper()->waitToRead(_selector);
+	if (n == 0)
+		return;
+
+	::pthread_spin_lock(&_statsLock);
+	++_rxBatches;
+	_rxPackets += n;
+	_rxBytes += total;
+	::pthread_spin_unlock(&_statsLock);
+	for (size_t i = 0; i < n; ++i) {
+		uint8_t* buf = _batch.buffers + i * _batch.slotSize + _batch.offset;
+		size_t bytes = _batch.lengths[i];
+		VnetHeader* vnet = NULL;
+		if (_offload) {
+			vnet = (VnetHeader*) buf;
+			buf += sizeof(VnetHeader);
+			bytes -= sizeof(VnetHeader);
+		}
+		_logReceived(buf, bytes);
+		_listener->onTunReceived(buf, bytes, vnet);
+	}
 }
 
 }
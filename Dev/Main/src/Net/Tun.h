@@ -1,6 +1,9 @@
 #include <fcntl.h>
+#include <pthread.h>
+#include <sys/uio.h>
 #include "Base/Utils.h"
 #include "Base/Looper.h"
+#include "Net/Packet.h"
 
 #pragma once
 
@@ -9,29 +12,138 @@ namespace Net {
 struct TunListener {
 	virtual ~TunListener() {
 	}
-	virtual void onTunReceived(void* packet, size_t bytes) THROWS = 0;
+	// vnet仅在offload模式下非NULL
+	virtual void onTunReceived(void* packet, size_t bytes, VnetHeader* vnet)
+			THROWS = 0;
 	virtual void onTunError(Utils::Exception* e) THROWS = 0;
 };
 
 class Tun: Utils::FDListener {
+public:
+	// 发送队列满时丢新来的包还是最早排队的包
+	enum TxDrop {
+		TX_DROP_TAIL, TX_DROP_HEAD
+	};
+
+private:
 	TunListener* _listener;
 	int _fd, _selector;
 	Utils::String _name;
-	void onFDToRead() THROWS;
-	void onFDToWrite() {
+	bool _offload;
+
+	// 每次唤醒最多读取的包数，及其复用的收包缓冲池；
+	// 每格读到offset处，让vnet头后面的IP首部4字节对齐
+	struct {
+		size_t size, slotSize, offset;
+		uint8_t* buffers;
+		size_t* lengths;
+	} _batch;
+
+	// 发送队列：设备写不进（EAGAIN）时包先按序排在这个环里，可写时再成批补发。
+	// 每格的缓冲按需增长并复用，offload模式下连同vnet头一起存
+	struct _TxSlot {
+		uint8_t* buf;
+		size_t capacity, bytes;
+	};
+	struct {
+		_TxSlot* slots;
+		size_t size, head, count;
+		TxDrop drop;
+	} _tx;
+
+	// 收发包统计，平均每次唤醒读到的包数 = packets / batches；只由所属线程累加，
+	// 指标由别的线程读，32位平台上64位数读写不是一次完成，两边都在_statsLock下进行
+	mutable pthread_spinlock_t _statsLock;
+	uint64_t _rxBatches, _rxPackets, _rxBytes, _txPackets, _txBytes;
+	// 排过队的包、队列满丢弃的包，以及写出错丢弃的包
+	uint64_t _txDeferred, _txDrops, _txErrors;
+
+	void _add(uint64_t& counter, uint64_t n) {
+		::pthread_spin_lock(&_statsLock);
+		counter += n;
+		::pthread_spin_unlock(&_statsLock);
 	}
+	uint64_t _get(const uint64_t& counter) const {
+		::pthread_spin_lock(&_statsLock);
+		uint64_t n = counter;
+		::pthread_spin_unlock(&_statsLock);
+		return n;
+	}
+
+	void _open(const char* name, size_t batchSize, bool multiQueue) THROWS;
+	void _start(size_t txQueue, TxDrop txDrop) THROWS;
+	void _logReceived(const uint8_t* buf, size_t bytes);
+	int _write(const struct iovec* iov, int iovcnt, size_t bytes);
+	void _enqueue(const struct iovec* iov, int iovcnt, size_t bytes);
+
+	void onFDToRead() THROWS;
+	void onFDToWrite();
 	void onFDClosed() {
 	}
 	void onFDError(Utils::Exception* e) THROWS {
 		THROW(e);
 	}
 public:
-	Tun(uint32_t ip, uint32_t mask, TunListener* listener) THROWS;
+	// txQueue为发送队列最多排多少个包
+	Tun(uint32_t ip, uint32_t mask, TunListener* listener, size_t batchSize = 1,
+			bool offload = false, bool multiQueue = false,
+			size_t txQueue = 256, TxDrop txDrop = TX_DROP_TAIL) THROWS;
+	// 给已经以multiQueue方式创建的设备再挂一个队列，由调用线程的Looper收包
+	Tun(const char* name, TunListener* listener, size_t batchSize = 1,
+			bool offload = false, size_t txQueue = 256, TxDrop txDrop =
+					TX_DROP_TAIL) THROWS;
 	~Tun();
-	void send(void* packet, size_t bytes) THROWS;
+	// 写不进时排队，队列满时按丢包策略丢弃，都不抛异常
+	void send(void* packet, size_t bytes, const VnetHeader* vnet = NULL)
+			THROWS;
 	const char* getName() const {
 		return _name;
 	}
+	bool isOffload() const {
+		return _offload;
+	}
+	size_t getBatchSize() const {
+		return _batch.size;
+	}
+	size_t getTxQueueSize() const {
+		return _tx.size;
+	}
+	TxDrop getTxDrop() const {
+		return _tx.drop;
+	}
+	size_t getTxQueued() const {
+		return __sync_fetch_and_add((size_t*) &_tx.count, 0);
+	}
+	uint64_t getRxBatches() const {
+		return _get(_rxBatches);
+	}
+	uint64_t getRxPackets() const {
+		return _get(_rxPackets);
+	}
+	uint64_t getRxBytes() const {
+		return _get(_rxBytes);
+	}
+	uint64_t getTxPackets() const {
+		return _get(_txPackets);
+	}
+	uint64_t getTxBytes() const {
+		return _get(_txBytes);
+	}
+	uint64_t getTxDeferred() const {
+		return _get(_txDeferred);
+	}
+	uint64_t getTxDrops() const {
+		return _get(_txDrops);
+	}
+	uint64_t getTxErrors() const {
+		return _get(_txErrors);
+	}
+	double getAvgRxBatch() const {
+		::pthread_spin_lock(&_statsLock);
+		double avg = _rxBatches == 0 ? 0 : (double) _rxPackets / _rxBatches;
+		::pthread_spin_unlock(&_statsLock);
+		return avg;
+	}
 };
 
 }
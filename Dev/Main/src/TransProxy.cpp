@@ -8,18 +8,24 @@
 #include "Base/Debug.h"
 #include "Net/Tun.h"
 #include "TransProxy/Config.h"
+#include "TransProxy/ChecksumHTTP.h"
 #include "TransProxy/MallocHTTP.h"
+#include "TransProxy/MetricsHTTP.h"
 #include "TransProxy/DomainResolver.h"
 #include "TransProxy/DomainRules.h"
 #include "TransProxy/CustomList.h"
 #include "TransProxy/TunMac.h"
 #include "TransProxy/IPv4.h"
+#include "TransProxy/PathMTU.h"
 #include "TransProxy/Ping.h"
+#include "TransProxy/Shaper.h"
 #include "TransProxy/UDP.h"
 #include "TransProxy/TCP.h"
 #include "TransProxy/DNS.h"
 #include "TransProxy/HTTP.h"
+#include "TransProxy/Upstreams.h"
 #include "TransProxy/TransTCP.h"
+#include "TransProxy/Workers.h"
 
 using namespace TransProxy;
 
@@ -38,6 +44,7 @@ static Utils::String getExeDir() {
 	return dir;
 }
 
+static Workers* _workers;
 static DNS* _dns;
 static TransTCP* _transTCP;
 
@@ -81,6 +88,30 @@ static struct _: HttpService, Utils::TimerListener {
 					Utils::formatSize(_transTCP->getTotalUpBytes()).sz());
 			response.put("TotalDownData",
 					Utils::formatSize(_transTCP->getTotalDownBytes()).sz());
+			response.put("AgentPoolSize",
+					(long long) _transTCP->getAgentPoolCapacity());
+			response.put("AgentPoolInUse",
+					(long long) _transTCP->getAgentPoolInUse());
+			response.put("AgentPoolQuarantined",
+					(long long) _transTCP->getAgentPoolQuarantined());
+			response.put("AgentPoolFailures",
+					(long long) _transTCP->getAgentPoolFailures());
+			response.put("UpstreamPoolIdle",
+					(long long) _transTCP->getUpstreamPoolIdle());
+			response.put("UpstreamPoolHits",
+					(long long) _transTCP->getUpstreamPoolHits());
+			response.put("UpstreamPoolMisses",
+					(long long) _transTCP->getUpstreamPoolMisses());
+			response.put("Workers", (int) _workers->getCount());
+			response.put("TunRxPackets",
+					(long long) _workers->getTunRxPackets());
+			response.put("TunAvgRxBatch", _workers->getAvgTunRxBatch());
+			response.put("TunTxPackets",
+					(long long) _workers->getTunTxPackets());
+			response.put("TunTxQueued", (long long) _workers->getTunTxQueued());
+			response.put("TunTxDrops", (long long) _workers->getTunTxDrops());
+			response.put("SteeredPackets",
+					(long long) _workers->getSteeredPackets());
 			return true;
 		} else if (path == "/reboot.json") {
 			_timer.setTimeout(3000);
@@ -121,20 +152,43 @@ static void run() THROWS {
 	domainResolver->addRules(customList);
 	Utils::Log::i("DomainResolver <--addRules-- CustomList");
 
-	TunMac* tunMac = new TunMac(config.getClientIP(), config.getMask());
+	size_t queues = config.getTunQueues();
+	TunMac* tunMac = new TunMac(config.getClientIP(), config.getMask(),
+			config.getTunBatchSize(), config.getTunOffload(), queues > 1,
+			config.getTunTxQueue(),
+			config.getTunTxDropHead() ?
+					Net::Tun::TX_DROP_HEAD : Net::Tun::TX_DROP_TAIL);
 
-	IPv4* ipv4 = new IPv4(tunMac);
-	tunMac->addProtocol(ipv4);
+	Upstreams* upstreams = new Upstreams(config.getProxyURL(),
+			config.getClientIP(), config.getProxySelect());
 
-	Ping* ping = new Ping(ipv4);
+	// 总限速在各工作线程间平分；同一客户端的TCP都归一个线程（见getShardOfClient()），
+	// 每客户端的限速不用分
+	Shaper* shaper = NULL;
+	if (config.getShaperClientRate() > 0 || config.getShaperTotalRate() > 0)
+		shaper = new Shaper(tunMac, upstreams, config.getShaperClientRate(),
+				config.getShaperTotalRate() / queues, config.getShaperBurst(),
+				config.getShaperQueue());
+	IPv4* ipv4 = new IPv4(shaper ? (Mac*) shaper : tunMac);
+
+	PathMTU* pathMtu = new PathMTU(config.getUplinkMtu());
+	Ping* ping = new Ping(ipv4, pathMtu);
 	UDP* udp = new UDP(ipv4);
-	TCP* tcp = new TCP(ipv4);
-	_transTCP = new TransTCP(ipv4, config.getAgentMin(), domainResolver,
-			config.getProxyURL(), config.getClientIP());
+	TCP* tcp = new TCP(ipv4, config.getTcpSendBuffer(),
+			config.getTcpRecvBuffer());
+	_transTCP = new TransTCP(config.getAgentMin(), config.getAgentMax(),
+			domainResolver, upstreams, queues,
+			::strcmp(config.getTcpEngine(), "splice") == 0,
+			config.getUpstreamPoolSize(), config.getTcpOptimistic(),
+			config.getProxyRace());
+	_transTCP->setPathMTU(pathMtu);
+	_transTCP->setClientBuffers(config.getTcpSendBuffer(),
+			config.getTcpRecvBuffer());
 	ipv4->addProtocol(ping);
 	ipv4->addProtocol(udp);
+	// 透明代理的流先认领，剩下的交给本机的TCP栈
+	ipv4->addProtocol(_transTCP->bindShard(0, ipv4, shaper));
 	ipv4->addProtocol(tcp);
-	ipv4->addProtocol(_transTCP);
 
 	domainResolver->addRules(_transTCP);
 	Utils::Log::i("DomainResolver <--addRules-- TransTCP");
@@ -143,6 +197,8 @@ static void run() THROWS {
 	_dns = new DNS(udp, dnsUrl.sz(), config.getUpDnsURL(), domainResolver);
 
 	MallocHTTP* mallocHTTP = new MallocHTTP();
+	ChecksumHTTP* checksumHTTP = new ChecksumHTTP();
+	MetricsHTTP* metricsHTTP = new MetricsHTTP();
 
 	HTTP* http = new HTTP(tcp->bind(Net::IPv4::aton(config.getServerIP())), 80,
 			workDir + "/www");
@@ -150,9 +206,23 @@ static void run() THROWS {
 	http->addService(&config);
 	http->addService(domainResolver);
 	http->addService(_transTCP);
+	http->addService(upstreams);
 	http->addService(_dns);
 	http->addService(mallocHTTP);
+	http->addService(checksumHTTP);
+	http->addService(metricsHTTP);
+
+	_workers = new Workers(queues, tunMac, shaper, ipv4, _transTCP,
+			config.getVipMin(), config.getVipMax(), config.getAgentMin(),
+			config.getAgentMax());
+
+	Utils::Metrics::addSource(_workers);
+	Utils::Metrics::addSource(_transTCP);
+	Utils::Metrics::addSource(upstreams);
+	Utils::Metrics::addSource(_dns);
+	Utils::Metrics::addSource(pathMtu);
 
+	upstreams->startProbing();
 	MallocHTTP::startLog();
 	Utils::Looper::loop();
 }
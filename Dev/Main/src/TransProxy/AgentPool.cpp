@@ -0,0 +1,57 @@
+#define LOG_TAG "AgentPool"
+
+#include "Base/Debug.h"
+#include "Base/Utils.h"
+#include "AgentPool.h"
+
+namespace TransProxy {
+
+AgentPool::AgentPool(uint32_t ipMin, uint32_t ipMax, uint16_t portMin,
+		uint16_t portMax, uint16_t step, uint16_t offset, unsigned quarantine) :
+		_ipMin(ipMin), _portStep(step), _fresh(0), _quarantine(quarantine), _queueSize(
+				64), _queueHead(0), _queueCount(0), _inUse(0), _failures(0) {
+	_portMin = portMin + (offset + step - portMin % step) % step;
+	_portsPerIP = _portMin > portMax ? 0 : (portMax - _portMin) / step + 1;
+	uint64_t capacity =
+			ipMax < ipMin ? 0 : (uint64_t) (ipMax - ipMin + 1) * _portsPerIP;
+	_capacity = (uint32_t) Utils::min(capacity, (uint64_t) 0xFFFFFFFF);
+	_queue = new _Quarantined[_queueSize];
+}
+
+bool AgentPool::alloc(Net::IPv4::SockAddr* addr) {
+	uint32_t index;
+	if (_queueCount > 0
+			&& _now() - _queue[_queueHead].released >= _quarantine) {
+		index = _queue[_queueHead].index;
+		_queueHead = (_queueHead + 1) % _queueSize;
+		--_queueCount;
+	} else if (_fresh < _capacity) {
+		index = _fresh++;
+	} else {
+		++_failures;
+		return false;
+	}
+	++_inUse;
+	*addr = _addressOf(index);
+	return true;
+}
+
+void AgentPool::free(const Net::IPv4::SockAddr& addr) {
+	if (_queueCount == _queueSize) {
+		_Quarantined* queue = new _Quarantined[_queueSize * 2];
+		for (uint32_t i = 0; i < _queueCount; ++i)
+			queue[i] = _queue[(_queueHead + i) % _queueSize];
+		delete[] _queue;
+		_queue = queue;
+		_queueHead = 0;
+		_queueSize *= 2;
+	}
+	_Quarantined& q = _queue[(_queueHead + _queueCount) % _queueSize];
+	q.index = (addr.ip - _ipMin) * _portsPerIP
+			+ (addr.port - _portMin) / _portStep;
+	q.released = _now();
+	++_queueCount;
+	--_inUse;
+}
+
+}
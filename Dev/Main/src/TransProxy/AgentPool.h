@@ -0,0 +1,70 @@
+#include <stdint.h>
+#include "Base/Debug.h"
+#include "Base/Utils.h"
+#include "Net/IPv4.h"
+
+#pragma once
+
+namespace TransProxy {
+
+// agent地址池：agent.min..agent.max的每个IP上，端口号模step等于offset的那些端口。
+// 地址按序号管理：从没用过的按序号顺序发放；释放的进隔离队列，
+// 等代理那边的TIME_WAIT过去之后才会再被发放。分配、释放都是O(1)，
+// 不是线程安全的，由所属的TransTCP分片独占使用；只有统计可以在别的线程读，
+// 统计都是字长的计数，只有所属线程写，读的一方用__sync取值
+class AgentPool {
+	struct _Quarantined {
+		uint32_t index;
+		uint64_t released;
+	};
+
+	uint32_t _ipMin;
+	uint16_t _portMin, _portStep;
+	uint32_t _portsPerIP;
+	uint32_t _capacity, _fresh;
+	unsigned _quarantine;
+
+	// 隔离队列：环形数组，按释放时间先后排列，满了加倍
+	_Quarantined* _queue;
+	uint32_t _queueSize, _queueHead, _queueCount;
+
+	uint32_t _inUse;
+	uint32_t _failures;
+
+	// 隔离按单调时钟计秒，不受NTP校时影响
+	static uint64_t _now() {
+		return Utils::nanoTime() / 1000000000;
+	}
+
+	Net::IPv4::SockAddr _addressOf(uint32_t index) const {
+		return Net::IPv4::SockAddr(_ipMin + index / _portsPerIP,
+				_portMin + index % _portsPerIP * _portStep);
+	}
+
+public:
+	AgentPool(uint32_t ipMin, uint32_t ipMax, uint16_t portMin,
+			uint16_t portMax, uint16_t step, uint16_t offset,
+			unsigned quarantine);
+	virtual ~AgentPool() {
+		delete[] _queue;
+	}
+
+	// 地址耗尽时返回false
+	bool alloc(Net::IPv4::SockAddr* addr);
+	void free(const Net::IPv4::SockAddr& addr);
+
+	uint32_t getCapacity() const {
+		return _capacity;
+	}
+	uint32_t getInUse() const {
+		return __sync_fetch_and_add((uint32_t*) &_inUse, 0);
+	}
+	uint32_t getQuarantined() const {
+		return __sync_fetch_and_add((uint32_t*) &_queueCount, 0);
+	}
+	uint32_t getFailures() const {
+		return __sync_fetch_and_add((uint32_t*) &_failures, 0);
+	}
+};
+
+}
@@ -0,0 +1,104 @@
+#define LOG_TAG  "ChecksumHTTP"
+
+#include <stdlib.h>
+#include "Base/Debug.h"
+#include "Base/Utils.h"
+#include "ChecksumHTTP.h"
+
+namespace TransProxy {
+
+static const size_t SIZES[] = { 40, 64, 128, 256, 576, 1500, 4096, 9000, 16384,
+		65536 };
+static const size_t SIZE_COUNT = sizeof(SIZES) / sizeof(SIZES[0]);
+
+// 页面在主线程的Looper上同步生成，测量期间收发包都停着：
+// 每格最多处理这么多字节，也最多跑这么久，整页控制在几十毫秒
+static const size_t BYTES_PER_RUN = 256 * 1024;
+static const uint64_t NS_PER_RUN = 2000000;
+
+// 与参考内核对比：各种长度、奇偶起始地址都要折叠后完全一致
+static bool _verify(const Utils::ChecksumKernel& kernel,
+		const Utils::ChecksumKernel& reference, const uint8_t* buf,
+		size_t bytes) {
+	for (size_t offset = 0; offset < 4; ++offset)
+		for (size_t len = 0; len <= 70 && len + offset <= bytes; ++len)
+			if (Utils::checksum(kernel.sum(buf + offset, len))
+					!= Utils::checksum(reference.sum(buf + offset, len)))
+				return false;
+	for (size_t i = 0; i < SIZE_COUNT; ++i)
+		if (Utils::checksum(kernel.sum(buf + 1, SIZES[i] - 1))
+				!= Utils::checksum(reference.sum(buf + 1, SIZES[i] - 1))
+				|| Utils::checksum(kernel.sum(buf, SIZES[i]))
+						!= Utils::checksum(reference.sum(buf, SIZES[i])))
+			return false;
+	return true;
+}
+
+bool ChecksumHTTP::onHttpRequest(Net::HttpRequest& request,
+		Net::HttpResponse& response) THROWS {
+	Utils::String path = request.getPath();
+	if (path == "/debug/checksum.html") {
+		size_t count;
+		const Utils::ChecksumKernel* kernels = Utils::getChecksumKernels(
+				&count);
+
+		size_t bufSize = SIZES[SIZE_COUNT - 1];
+		uint8_t* buf = new uint8_t[bufSize];
+		for (size_t i = 0; i < bufSize; ++i)
+			buf[i] = (uint8_t) ::rand();
+
+		response.setStatus(200, "OK");
+		response.setContentType("text/html");
+		response.printf(
+				"<meta name=\"viewport\" content=\"width=device-width, initial-scale=1.0\" />");
+		response.printf("<title>Checksum</title>");
+		response.printf("<p>Selected kernel: <b>%s</b></p>",
+				Utils::getSelectedChecksumKernel()->name);
+		response.printf(
+				"<table border=\"1\" bordercolor=\"lightgrey\" style=\"border-collapse: collapse\">");
+		response.printf("<tr><th>MB/s</th>");
+		for (size_t k = 0; k < count; ++k)
+			response.printf("<th>%s</th>", kernels[k].name);
+		response.printf("</tr>");
+
+		response.printf("<tr><th>Bit-exact</th>");
+		for (size_t k = 0; k < count; ++k)
+			response.printf("<td align=\"center\">%s</td>",
+					!kernels[k].isSupported() ? "-" :
+					_verify(kernels[k], kernels[0], buf, bufSize) ?
+							"OK" : "<font color=\"red\">FAIL</font>");
+		response.printf("</tr>");
+
+		volatile uint32_t sink = 0;
+		for (size_t i = 0; i < SIZE_COUNT; ++i) {
+			size_t bytes = SIZES[i];
+			size_t runs = Utils::max(BYTES_PER_RUN / bytes, (size_t) 1);
+			response.printf("<tr><th align=\"right\">%u</th>", bytes);
+			for (size_t k = 0; k < count; ++k) {
+				if (!kernels[k].isSupported()) {
+					response.printf("<td align=\"center\">-</td>");
+					continue;
+				}
+				uint64_t start = Utils::nanoTime(), ns = 0;
+				size_t r = 0;
+				while (r < runs) {
+					sink += kernels[k].sum(buf, bytes);
+					if ((++r & 7) == 0
+							&& (ns = Utils::nanoTime() - start) >= NS_PER_RUN)
+						break;
+				}
+				ns = Utils::max(Utils::nanoTime() - start, (uint64_t) 1);
+				response.printf("<td align=\"right\">%u</td>",
+						(uint32_t) ((uint64_t) bytes * r * 1000 / ns));
+			}
+			response.printf("</tr>");
+		}
+		response.printf("</table>");
+
+		delete[] buf;
+		return true;
+	}
+	return HttpService::onHttpRequest(request, response);
+}
+
+}
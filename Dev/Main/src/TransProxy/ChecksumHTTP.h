@@ -0,0 +1,13 @@
+#include "Base/Debug.h"
+#include "HTTP.h"
+
+namespace TransProxy {
+
+// /debug/checksum.html：各校验和内核在不同包长下的吞吐，并逐一核对与参考实现结果一致
+class ChecksumHTTP: public HttpService {
+public:
+	bool onHttpRequest(Net::HttpRequest& request, Net::HttpResponse& response)
+			THROWS;
+};
+
+}
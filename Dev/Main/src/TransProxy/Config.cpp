@@ -85,6 +85,22 @@ const char* Config::getProxyURL() {
 const char* Config::getUpDnsURL() {
 	return _ini.getValue("Proxy", "up.dns", "udp://114.114.114.114");
 }
+const char* Config::getProxySelect() {
+	return _ini.getValue("Proxy", "proxy.select", "latency");
+}
+bool Config::getProxyRace() {
+	return ::atoi(_ini.getValue("Proxy", "proxy.race", "0")) != 0;
+}
+const char* Config::getTcpEngine() {
+	return _ini.getValue("Proxy", "tcp.engine", "nat");
+}
+bool Config::getTcpOptimistic() {
+	return ::atoi(_ini.getValue("Proxy", "tcp.optimistic", "0")) != 0;
+}
+size_t Config::getUpstreamPoolSize() {
+	int n = ::atoi(_ini.getValue("Proxy", "upstream.pool", "16"));
+	return n < 0 ? 0 : n > 256 ? 256 : n;
+}
 const char* Config::_getRulesURL() {
 	return _ini.getValue("Proxy", "rules.url",
 			"https://raw.githubusercontent.com/gfwlist/gfwlist/master/gfwlist.txt");
@@ -153,6 +169,68 @@ const char* Config::getAgentMax() {
 			type == 10 ? type10_agentMax : type100_agentMax;
 }
 
+size_t Config::getTunBatchSize() {
+	int n = ::atoi(_ini.getValue("Network", "tun.batch", "32"));
+	return n > 0 ? n : 1;
+}
+
+bool Config::getTunOffload() {
+	return ::atoi(_ini.getValue("Network", "tun.offload", "0")) != 0;
+}
+
+size_t Config::getTunQueues() {
+	int n = ::atoi(_ini.getValue("Network", "tun.queues", "1"));
+	return n < 1 ? 1 : n > 16 ? 16 : n;
+}
+
+size_t Config::getTunTxQueue() {
+	int n = ::atoi(_ini.getValue("Network", "tun.txqueue", "256"));
+	return n < 16 ? 16 : n > 4096 ? 4096 : n;
+}
+
+bool Config::getTunTxDropHead() {
+	return ::strcmp(_ini.getValue("Network", "tun.txdrop", "tail"), "head")
+			== 0;
+}
+
+// 配置里以KB为单位
+size_t Config::getShaperClientRate() {
+	int n = ::atoi(_ini.getValue("Network", "shaper.client", "0"));
+	return n > 0 ? n * 1024 : 0;
+}
+
+size_t Config::getShaperTotalRate() {
+	int n = ::atoi(_ini.getValue("Network", "shaper.total", "0"));
+	return n > 0 ? n * 1024 : 0;
+}
+
+size_t Config::getShaperBurst() {
+	int n = ::atoi(_ini.getValue("Network", "shaper.burst", "64"));
+	return (n < 4 ? 4 : n) * 1024;
+}
+
+size_t Config::getShaperQueue() {
+	int n = ::atoi(_ini.getValue("Network", "shaper.queue", "256"));
+	return (n < 16 ? 16 : n) * 1024;
+}
+
+// 配置里以KB为单位
+size_t Config::getTcpSendBuffer() {
+	int n = ::atoi(_ini.getValue("Network", "tcp.sndbuf", "64"));
+	return (n < 4 ? 4 : n > 1024 ? 1024 : n) * 1024;
+}
+
+size_t Config::getTcpRecvBuffer() {
+	int n = ::atoi(_ini.getValue("Network", "tcp.rcvbuf", "64"));
+	return (n < 4 ? 4 : n > 1024 ? 1024 : n) * 1024;
+}
+
+// PPPoE拨号一般是1492
+size_t Config::getUplinkMtu() {
+	int n = ::atoi(_ini.getValue("Network", "uplink.mtu", "0"));
+	return n <= 0 ? 0 : n < 576 ? 576 : n > 65535 ? 65535 : n;
+}
+
 void Config::_updateRulesFile() THROWS {
 	Utils::String fTmp = _rulesFile + ".tmp";
 	if (::strcasecmp(_getRulesFormat(), "Base64") == 0) {
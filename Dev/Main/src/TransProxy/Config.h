@@ -90,8 +90,19 @@ public:
 		return _workDir;
 	}
 
+	// 可以是空格或逗号分隔的多个代理
 	const char* getProxyURL();
+	// 多个代理时的选择策略："latency"或"leastconn"
+	const char* getProxySelect();
+	// 所选代理迟迟连不通时，是否再找另一个代理同时连，先通的用
+	bool getProxyRace();
 	const char* getUpDnsURL();
+	// TransTCP引擎："nat"按包改写转发，"splice"在本机终结客户端TCP后用socket连代理
+	const char* getTcpEngine();
+	// splice引擎连SOCKS5代理时最多预热多少条上游连接，0为不预热
+	size_t getUpstreamPoolSize();
+	// 乐观模式：不等代理应答，客户端的首批数据紧跟在代理请求后面发出
+	bool getTcpOptimistic();
 
 	const char* getRulesFile() const {
 		return _rulesFile;
@@ -111,6 +122,27 @@ public:
 	const char* getVipMax();
 	const char* getAgentMin();
 	const char* getAgentMax();
+
+	size_t getTunBatchSize();
+	bool getTunOffload();
+	size_t getTunQueues();
+	// 写TUN遇到设备队列满时最多排队的包数，以及排满后丢新包（"tail"）还是旧包（"head"）
+	size_t getTunTxQueue();
+	bool getTunTxDropHead();
+
+	// 发往客户端方向的整形，字节/秒，0为不限：每个客户端的速率和全部客户端的总速率
+	size_t getShaperClientRate();
+	size_t getShaperTotalRate();
+	// 令牌桶深度，以及每个客户端最多积压多少字节
+	size_t getShaperBurst();
+	size_t getShaperQueue();
+
+	// 内置TCP协议栈（管理页面和splice引擎用）每个连接收发缓冲区的上限，字节
+	size_t getTcpSendBuffer();
+	size_t getTcpRecvBuffer();
+
+	// 上行链路的MTU，用来压小经过的TCP握手里的MSS；0为按路由自动探测
+	size_t getUplinkMtu();
 };
 
 }
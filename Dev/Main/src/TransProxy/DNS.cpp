@@ -10,6 +10,7 @@ namespace TransProxy {
 
 void DNS::onReceived(Net::IPv4::SockAddr addr, void* data, size_t bytes)
 		THROWS {
+	++_queries;
 	uint16_t QDCOUNT = ntohs(((uint16_t*) data)[2]);
 	uint16_t ANCOUNT = ((uint16_t*) data)[3];
 	uint16_t NSCOUNT = ((uint16_t*) data)[4];
@@ -56,6 +57,7 @@ void DNS::onReceived(Net::IPv4::SockAddr addr, void* data, size_t bytes)
 				*(uint32_t*) (p + 12) = htonl(ip);
 				_dnsServer->send(addr, response, responseSize);
 				_log(addr.ip, hostname, ip);
+				++_answered;
 				return;
 			}
 			_log(addr.ip, hostname, 0);
@@ -66,13 +68,28 @@ void DNS::onReceived(Net::IPv4::SockAddr addr, void* data, size_t bytes)
 				uint16_t& FLAGS = *(uint16_t*) (response + 2);
 				FLAGS = FLAGS | 0x8080; // QR=1, RA=1
 				_dnsServer->send(addr, response, bytes);
+				++_answered;
 				return;
 			}
 		}
 	}
+	++_forwarded;
 	new _AgentRequest(this, addr, data, bytes);
 }
 
+void DNS::writeMetrics(Utils::MetricsWriter& out) {
+	out.counter("transproxy_dns_queries_total", "DNS queries received",
+			_queries);
+	out.counter("transproxy_dns_answered_total",
+			"DNS queries answered locally", _answered);
+	out.counter("transproxy_dns_forwarded_total",
+			"DNS queries forwarded to the upstream DNS", _forwarded);
+	out.counter("transproxy_dns_upstream_answered_total",
+			"Answers received from the upstream DNS", _upstreamAnswered);
+	out.histogram("transproxy_dns_upstream_latency_seconds",
+			"Upstream DNS response time", _upstreamLatency, 1e-6, 7, 23);
+}
+
 // DNS::HttpService
 class IpSetItem: public Utils::MapItem<uint32_t> {
 	uint32_t _ip;
@@ -1,5 +1,7 @@
 #include <time.h>
 #include "Base/Debug.h"
+#include "Base/Histogram.h"
+#include "Base/Metrics.h"
 #include "Base/Utils.h"
 #include "DnsAgent.h"
 #include "UDP.h"
@@ -10,7 +12,10 @@ namespace TransProxy {
 
 class DomainResolver;
 
-class DNS: public HttpService, DnsAgentListener, Net::UdpPeerListener {
+class DNS: public HttpService,
+		public Utils::MetricsSource,
+		DnsAgentListener,
+		Net::UdpPeerListener {
 	enum {
 		MAX_LOGS = 1000
 	};
@@ -19,9 +24,10 @@ class DNS: public HttpService, DnsAgentListener, Net::UdpPeerListener {
 		DNS* _this;
 		Net::IPv4::SockAddr _addr;
 		int _id;
+		uint64_t _start;
 		_AgentRequest(DNS* thiz, Net::IPv4::SockAddr addr, void* data,
 				size_t bytes) :
-				_this(thiz), _addr(addr) {
+				_this(thiz), _addr(addr), _start(Utils::nanoTime()) {
 			_id = thiz->_dnsAgent->query(this, data, bytes);
 		}
 		~_AgentRequest() {
@@ -54,6 +60,10 @@ class DNS: public HttpService, DnsAgentListener, Net::UdpPeerListener {
 	Net::UdpPeer* _dnsServer;
 	Utils::List<_LogItem> _logs;
 	size_t _count;
+	// 收到的查询、本地直接应答的、转给上游的和上游应答的个数
+	uint64_t _queries, _answered, _forwarded, _upstreamAnswered;
+	// 上游应答耗时，微秒
+	Utils::Histogram _upstreamLatency;
 
 	void _log(uint32_t client, const char* hostname, uint32_t ip) {
 		if (_logs.size() >= MAX_LOGS)
@@ -71,6 +81,8 @@ class DNS: public HttpService, DnsAgentListener, Net::UdpPeerListener {
 	// DnsAgentListener {
 	void onDnsAgentResponse(void* user, const void* data, size_t bytes) THROWS {
 		_AgentRequest* req = (_AgentRequest*) user;
+		++_upstreamAnswered;
+		_upstreamLatency.record((Utils::nanoTime() - req->_start) / 1000);
 		_dnsServer->send(req->_addr, data, bytes);
 		req->_id = -1;
 		delete req;
@@ -80,6 +92,7 @@ public:
 	DNS(UDP* udp, Net::IPv4::ServiceAddr bindAddr,
 			Net::IPv4::ServiceAddr upDnsAddr, DomainResolver* domainResolver) :
 			_serverIP(bindAddr.sockAddr.ip), _domainResolver(domainResolver), _count(
+					0), _queries(0), _answered(0), _forwarded(0), _upstreamAnswered(
 					0) THROWS {
 		Utils::Log::i("DNS initializing...");
 		THROW_IF(
@@ -106,6 +119,9 @@ public:
 	// HttpService
 	bool onHttpRequest(Net::HttpRequest& request, Utils::JSONObject& response)
 			THROWS;
+
+	// Utils::MetricsSource
+	void writeMetrics(Utils::MetricsWriter& out);
 };
 
 }
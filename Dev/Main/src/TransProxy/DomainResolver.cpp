@@ -15,20 +15,13 @@ Utils::String DomainResolver::ResolvItemByName::getKeyString() const {
 			Net::IPv4::ntoa((*this)->ip));
 }
 
-uint32_t DomainResolver::ResolvItemByIP::getKey() const {
-	return (*this)->ip;
-}
-
-Utils::String DomainResolver::ResolvItemByIP::getKeyString() const {
-	return Utils::String::format("%s %s", Net::IPv4::ntoa((*this)->ip),
-			(*this)->name.sz());
-}
-
 DomainResolver::DomainResolver(const char* ipBase, const char* workDir) :
-		_ip(Net::IPv4::aton(ipBase)), _rules(NULL), _nameToIp("name->ip"), _ipToName(
-				"ip->name") THROWS {
+		_ipBase(Net::IPv4::aton(ipBase)), _ip(_ipBase), _rules(NULL), _nameToIp(
+				"name->ip") THROWS {
 	Utils::Log::i("DomainResolver initializing...");
 
+	::memset(&_ipToName, 0, sizeof(_ipToName));
+
 	_cacheFile = workDir;
 	_cacheFile += "/dns.cache";
 
@@ -56,7 +49,7 @@ DomainResolver::DomainResolver(const char* ipBase, const char* workDir) :
 
 			ResolvItem* host = new ResolvItem(hostname, _ip++);
 			_nameToIp.add(&host->nameItem);
-			_ipToName.add(&host->ipItem);
+			_publish(host);
 			++n;
 		}
 		::fclose(fp);
@@ -68,16 +61,37 @@ DomainResolver::DomainResolver(const char* ipBase, const char* workDir) :
 	ReadErr: ;
 	::fclose(fp);
 	::unlink(_cacheFile);
-	_ip = Net::IPv4::aton(ipBase);
+	_ip = _ipBase;
 	_nameToIp.clear();
-	_ipToName.clear();
+	_ipToName.count = 0;
 	Utils::Log::e("FAILED to load domains from cache, cache cleared");
 }
 
+void DomainResolver::_publish(ResolvItem* host) {
+	size_t n = _ipToName.count;
+	size_t chunk = n >> IP_CHUNK_BITS;
+	if (chunk >= IP_CHUNKS) {
+		Utils::Log::w("Too many domains, %s not reversible",
+				Net::IPv4::ntoa(host->ip));
+		return;
+	}
+	if (_ipToName.chunks[chunk] == NULL)
+		_ipToName.chunks[chunk] = new ResolvItem*[IP_CHUNK_SIZE];
+	_ipToName.chunks[chunk][n & (IP_CHUNK_SIZE - 1)] = host;
+	__atomic_store_n(&_ipToName.count, n + 1, __ATOMIC_RELEASE);
+}
+
+DomainResolver::ResolvItem* DomainResolver::_lookup(uint32_t ip) const {
+	size_t i = ip - _ipBase;
+	if (ip < _ipBase || i >= __atomic_load_n(&_ipToName.count, __ATOMIC_ACQUIRE))
+		return NULL;
+	return _ipToName.chunks[i >> IP_CHUNK_BITS][i & (IP_CHUNK_SIZE - 1)];
+}
+
 DomainResolver::ResolvItem* DomainResolver::_add(const char* hostname) THROWS {
 	ResolvItem* host = new ResolvItem(hostname, _ip++);
 	_nameToIp.add(&host->nameItem);
-	_ipToName.add(&host->ipItem);
+	_publish(host);
 
 	size_t size;
 	FILE* fp = ::fopen(_cacheFile, "rb+");
@@ -142,7 +156,7 @@ uint32_t DomainResolver::dns(uint32_t client, const char* hostname) THROWS {
 
 const char* DomainResolver::ddns(uint32_t ip) THROWS {
 	const char* hostname = NULL;
-	ResolvItem* host = *_ipToName.get(ip);
+	ResolvItem* host = _lookup(ip);
 	if (host) {
 		hostname = host->name;
 		Utils::Log::d("%s <-- ddns %s", hostname, Net::IPv4::ntoa(ip));
@@ -30,31 +30,34 @@ private:
 		Utils::String getKeyString() const;
 	};
 
-	struct ResolvItemByIP: Utils::MapItemPtr<uint32_t, ResolvItem> {
-		ResolvItemByIP(ResolvItem* p) :
-				Utils::MapItemPtr<uint32_t, ResolvItem>(p) {
-		}
-		uint32_t getKey() const;
-		Utils::String getKeyString() const;
-	};
-
 	struct ResolvItem {
 		ResolvItemByName nameItem;
-		ResolvItemByIP ipItem;
 		Utils::String name;
 		uint32_t ip;
 		ResolvItem(const char* name, uint32_t ip) :
-				nameItem(this), ipItem(this), name(name), ip(ip) {
+				nameItem(this), name(name), ip(ip) {
 		}
 	};
 
-	uint32_t _ip;
+	enum {
+		IP_CHUNK_BITS = 10, IP_CHUNK_SIZE = 1 << IP_CHUNK_BITS, IP_CHUNKS = 4096
+	};
+
+	uint32_t _ipBase, _ip;
 	Rules* _rules;
 	Utils::String _cacheFile;
 
 	Utils::Map<Utils::String, ResolvItemByName> _nameToIp;
-	Utils::Map<uint32_t, ResolvItemByIP> _ipToName;
 
+	// VIP从_ipBase起顺序分配、从不回收，ip->name按序号存进分块数组。
+	// 只有主线程写：先填槽位再发布count；ddns()在各工作线程无锁读取
+	struct {
+		ResolvItem** chunks[IP_CHUNKS];
+		size_t count;
+	} _ipToName;
+
+	void _publish(ResolvItem* host);
+	ResolvItem* _lookup(uint32_t ip) const;
 	ResolvItem* _add(const char* hostname) THROWS;
 
 public:
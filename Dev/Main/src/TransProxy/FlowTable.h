@@ -0,0 +1,151 @@
+#include <stdlib.h>
+#include <string.h>
+#include "Base/Debug.h"
+#include "Base/Utils.h"
+#include "Net/IPv4.h"
+
+#pragma once
+
+namespace TransProxy {
+
+// 按四元组查找的开放寻址（线性探测）散列表。键和散列值直接存在槽里，
+// 查找时先比散列值再比键，一次探测序列内完成，不经过虚函数也不追指针。
+// 删除时把后面的槽往回挪（backward shift），不留墓碑，装载率保持在1/2以下。
+// 需要有序遍历时用ordered()，按键排好序的副本在表改动后第一次调用时才重建
+template<typename T> class FlowTable {
+public:
+	struct Entry {
+		uint32_t hash;
+		Net::IPv4::SockAddrPair key;
+		T* value;
+	};
+
+private:
+	enum {
+		MIN_CAPACITY = 64
+	};
+
+	Entry* _slots;
+	size_t _mask, _count;
+	Entry* _view;
+	size_t _viewCount;
+	bool _viewDirty;
+
+	static int _compare(const void* a, const void* b) {
+		const Net::IPv4::SockAddrPair& ka = ((const Entry*) a)->key;
+		const Net::IPv4::SockAddrPair& kb = ((const Entry*) b)->key;
+		return ka < kb ? -1 : ka == kb ? 0 : 1;
+	}
+
+	size_t _find(uint32_t hash, const Net::IPv4::SockAddrPair& key) const {
+		for (size_t i = hash & _mask;; i = (i + 1) & _mask) {
+			const Entry& e = _slots[i];
+			if (e.value == NULL || (e.hash == hash && e.key == key))
+				return i;
+		}
+	}
+
+	void _resize(size_t capacity) {
+		Entry* slots = _slots;
+		size_t n = _mask + 1;
+		_slots = new Entry[capacity];
+		_mask = capacity - 1;
+		for (size_t i = 0; i <= _mask; ++i)
+			_slots[i].value = NULL;
+		for (size_t i = 0; i < n; ++i)
+			if (slots[i].value)
+				_slots[_find(slots[i].hash, slots[i].key)] = slots[i];
+		delete[] slots;
+	}
+
+public:
+	FlowTable() :
+			_slots(NULL), _mask(0), _count(0), _view(NULL), _viewCount(0), _viewDirty(
+					false) {
+		_slots = new Entry[MIN_CAPACITY];
+		_mask = MIN_CAPACITY - 1;
+		for (size_t i = 0; i <= _mask; ++i)
+			_slots[i].value = NULL;
+	}
+	virtual ~FlowTable() {
+		delete[] _slots;
+		if (_view)
+			delete[] _view;
+	}
+
+	static uint32_t hash(const Net::IPv4::SockAddrPair& key) {
+		uint32_t h = key.remote.ip * 0x9E3779B1
+				^ (key.local.ip << 16 | key.local.ip >> 16)
+				^ ((uint32_t) key.remote.port << 16 | key.local.port);
+		h ^= h >> 16;
+		h *= 0x85EBCA6B;
+		h ^= h >> 13;
+		h *= 0xC2B2AE35;
+		h ^= h >> 16;
+		return h;
+	}
+
+	size_t count() const {
+		return _count;
+	}
+
+	T* get(const Net::IPv4::SockAddrPair& key) const {
+		return _slots[_find(hash(key), key)].value;
+	}
+
+	// 键已经存在时替换原来的值
+	void put(const Net::IPv4::SockAddrPair& key, T* value) {
+		if ((_count + 1) * 2 > _mask + 1)
+			_resize((_mask + 1) * 2);
+		uint32_t h = hash(key);
+		Entry& e = _slots[_find(h, key)];
+		if (e.value == NULL)
+			++_count;
+		e.hash = h;
+		e.key = key;
+		e.value = value;
+		_viewDirty = true;
+	}
+
+	void remove(const Net::IPv4::SockAddrPair& key) {
+		size_t i = _find(hash(key), key);
+		if (_slots[i].value == NULL)
+			return;
+		--_count;
+		_viewDirty = true;
+		for (;;) {
+			_slots[i].value = NULL;
+			size_t j = i;
+			for (;;) {
+				j = (j + 1) & _mask;
+				if (_slots[j].value == NULL)
+					return;
+				// 理想位置k循环地落在(i, j]之间的不能往前挪
+				size_t k = _slots[j].hash & _mask;
+				if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+					continue;
+				break;
+			}
+			_slots[i] = _slots[j];
+			i = j;
+		}
+	}
+
+	const Entry* ordered(size_t* count) {
+		if (_viewDirty) {
+			if (_view)
+				delete[] _view;
+			_view = _count > 0 ? new Entry[_count] : NULL;
+			_viewCount = 0;
+			for (size_t i = 0; i <= _mask; ++i)
+				if (_slots[i].value)
+					_view[_viewCount++] = _slots[i];
+			::qsort(_view, _viewCount, sizeof(Entry), _compare);
+			_viewDirty = false;
+		}
+		*count = _viewCount;
+		return _view;
+	}
+};
+
+}
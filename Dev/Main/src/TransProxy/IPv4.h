@@ -1,5 +1,6 @@
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 #include "Base/Debug.h"
 #include "Base/Utils.h"
 #include "Net/IPv4.h"
@@ -9,43 +10,80 @@
 
 namespace TransProxy {
 
+// 登记在一个协议号上的处理者。同一协议号上的按登记顺序排成认领链，
+// 包交给第一个认领的（返回true），后面的就不再查找了
 class IPv4Protocol {
 	friend class IPv4;
+	uint8_t _protocol;
 	IPv4Protocol* _next;
+protected:
+	IPv4Protocol(uint8_t protocol) :
+			_protocol(protocol), _next(NULL) {
+	}
 public:
 	virtual ~IPv4Protocol() {
 	}
-	virtual void dispatchPacket(Net::IPv4::IpPacket& packet) THROWS = 0;
+	virtual bool dispatchPacket(Net::IPv4::IpPacket& /* packet */) THROWS {
+		return false;
+	}
+	// TCP包由IPv4统一解析一次首部再交过来
+	virtual bool dispatchTcpPacket(Net::IPv4::TcpPacket& /* packet */) THROWS {
+		return false;
+	}
 };
 
 class IPv4: public MacProtocol {
 	Mac* _mac;
-	IPv4Protocol* _protocols = NULL;
+	// 按协议号索引的认领链
+	IPv4Protocol* _protocols[256];
+	// 按协议号统计分发的包数，只由所属线程累加
+	uint64_t _dispatched[256];
 
 public:
 	IPv4(Mac* mac) :
 			_mac(mac) THROWS {
 		Utils::Log::i("IPv4 initializing...");
+		::memset(_protocols, 0, sizeof(_protocols));
+		::memset(_dispatched, 0, sizeof(_dispatched));
 	}
 	virtual ~IPv4() {
 		Utils::Log::e("~IPv4");
 	}
 
+	// 接在该协议号认领链的末尾，先登记的先查
 	void addProtocol(IPv4Protocol* protocol) {
-		protocol->_next = _protocols;
-		_protocols = protocol;
+		IPv4Protocol** p = &_protocols[protocol->_protocol];
+		while (*p)
+			p = &(*p)->_next;
+		protocol->_next = NULL;
+		*p = protocol;
 	}
 	void sendPacket(Net::IPv4::IpPacket& packet) {
-		_mac->sendPacket(packet.ptr(), packet.packetSize());
+		_mac->sendPacket(packet.ptr(), packet.packetSize(), packet.vnet());
+	}
+	uint64_t getDispatched(uint8_t protocol) const {
+		return _dispatched[protocol];
 	}
 
 	// MacProtocol
-	void dispatchPacket(void* packet, size_t bytes) THROWS {
+	void dispatchPacket(void* packet, size_t bytes, Net::VnetHeader* vnet)
+			THROWS {
 		if (Net::IPv4::IpPacket::isValid(packet)) {
-			Net::IPv4::IpPacket in(packet, bytes);
-			for (IPv4Protocol* protocol = _protocols; protocol; protocol =
-					protocol->_next)
-				protocol->dispatchPacket(in);
+			Net::IPv4::IpPacket in(packet, bytes, vnet);
+			++_dispatched[in.protocol()];
+			IPv4Protocol* protocol = _protocols[in.protocol()];
+			if (protocol == NULL)
+				return;
+			if (in.protocol() == IPPROTO_TCP) {
+				if (!Net::IPv4::TcpPacket::isValid(in))
+					return;
+				Net::IPv4::TcpPacket tcp = in;
+				while (protocol && !protocol->dispatchTcpPacket(tcp))
+					protocol = protocol->_next;
+			} else {
+				while (protocol && !protocol->dispatchPacket(in))
+					protocol = protocol->_next;
+			}
 		}
 	}
 };
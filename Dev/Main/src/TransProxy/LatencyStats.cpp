@@ -0,0 +1,88 @@
+#include "LatencyStats.h"
+
+namespace TransProxy {
+
+const char* const LatencyStats::STAGE_NAMES[STAGE_COUNT] = { "Connect",
+		"Request", "Setup", "FirstUp", "FirstDown", "Transfer", "Lifetime" };
+
+const LatencyStats::Mark LatencyStats::STAGE_MARKS[STAGE_COUNT][2] = { {
+		MARK_SYN, MARK_SYN_ACK }, { MARK_AUTH_SENT, MARK_AUTH_DONE }, {
+		MARK_SYN, MARK_ESTABLISHED }, { MARK_ESTABLISHED, MARK_FIRST_UP }, {
+		MARK_ESTABLISHED, MARK_FIRST_DOWN }, { MARK_ESTABLISHED, MARK_FIN }, {
+		MARK_SYN, MARK_CLOSED } };
+
+// 乐观模式下客户端的数据可能早于ESTABLISHED就到了，这种倒序的记为0，不丢样本
+void LatencyStats::record(const uint64_t* marks) {
+	for (size_t i = 0; i < STAGE_COUNT; ++i) {
+		uint64_t begin = marks[STAGE_MARKS[i][0]];
+		uint64_t end = marks[STAGE_MARKS[i][1]];
+		if (begin && end)
+			_stages[i].record(end > begin ? (end - begin) / 1000 : 0);
+	}
+}
+
+// 各阶段给出样本数和分位数，毫秒
+void LatencyStats::toJSON(Utils::JSONObject* json) const {
+	for (size_t i = 0; i < STAGE_COUNT; ++i) {
+		const Utils::Histogram& h = _stages[i];
+		Utils::JSONObject* stage = new Utils::JSONObject();
+		stage->put("Count", (long long) h.getCount());
+		stage->put("Mean", h.getMean() / 1000);
+		stage->put("P50", h.getPercentile(50) / 1000.0);
+		stage->put("P90", h.getPercentile(90) / 1000.0);
+		stage->put("P99", h.getPercentile(99) / 1000.0);
+		stage->put("P999", h.getPercentile(99.9) / 1000.0);
+		stage->put("Max", h.getMax() / 1000.0);
+		json->put(STAGE_NAMES[i], stage);
+	}
+}
+
+void LatencyStats::writeMetrics(Utils::MetricsWriter& out, const char* name,
+		const char* help, const char* labels) const {
+	for (size_t i = 0; i < STAGE_COUNT; ++i) {
+		Utils::String l = Utils::String(labels) + ","
+				+ Utils::MetricsWriter::label("stage", STAGE_NAMES[i]).sz();
+		// 128微秒到约67秒
+		out.histogram(name, help, _stages[i], 1e-6, 7, 26, l);
+	}
+}
+
+void PortLatencyStats::record(uint16_t port, const uint64_t* marks) {
+	LatencyStats* stats = &_others;
+	_lock.lock();
+	for (size_t i = 0; i < _count; ++i)
+		if (_slots[i].port == port) {
+			stats = _slots[i].stats;
+			break;
+		}
+	if (stats == &_others && _count < SLOTS) {
+		_slots[_count].port = port;
+		stats = _slots[_count].stats = new LatencyStats();
+		++_count;
+	}
+	_lock.unlock();
+	stats->record(marks);
+}
+
+void PortLatencyStats::toJSON(Utils::JSONArray* json) {
+	_lock.lock();
+	for (size_t i = 0; i <= _count; ++i) {
+		Utils::JSONObject* item = new Utils::JSONObject();
+		item->put("Port", i < _count ? (int) _slots[i].port : 0);
+		(i < _count ? _slots[i].stats : &_others)->toJSON(item);
+		json->put(item);
+	}
+	_lock.unlock();
+}
+
+void PortLatencyStats::writeMetrics(Utils::MetricsWriter& out,
+		const char* name, const char* help) {
+	_lock.lock();
+	for (size_t i = 0; i <= _count; ++i)
+		(i < _count ? _slots[i].stats : &_others)->writeMetrics(out, name, help,
+				Utils::MetricsWriter::label("port",
+						i < _count ? (uint64_t) _slots[i].port : 0));
+	_lock.unlock();
+}
+
+}
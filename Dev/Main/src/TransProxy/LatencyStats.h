@@ -0,0 +1,89 @@
+#include <stdint.h>
+#include "Base/Histogram.h"
+#include "Base/Metrics.h"
+#include "Base/Mutex.h"
+#include "Base/Utils.h"
+
+#pragma once
+
+namespace TransProxy {
+
+// 连接生命周期各阶段的耗时分布。连接在各个时刻打上纳秒时间戳（见Mark），
+// 结束时交给record()，由相邻时刻算出各阶段耗时（见Stage）记进直方图，单位微秒
+class LatencyStats {
+public:
+	enum Mark {
+		MARK_SYN, // 收到客户端的SYN
+		MARK_SYN_ACK, // 与代理的TCP握手完成
+		MARK_AUTH_SENT, // 发出代理请求
+		MARK_AUTH_DONE, // 收到代理应答
+		MARK_ESTABLISHED, // 两边接通
+		MARK_FIRST_UP, // 客户端的第一个字节
+		MARK_FIRST_DOWN, // 服务器的第一个字节
+		MARK_FIN, // 任一方开始关闭
+		MARK_CLOSED, // 连接释放
+		MARK_COUNT
+	};
+	enum Stage {
+		STAGE_CONNECT, // SYN --> SYN_ACK：代理的TCP握手
+		STAGE_REQUEST, // AUTH_SENT --> AUTH_DONE：代理处理请求（CONNECT）
+		STAGE_SETUP, // SYN --> ESTABLISHED：客户端感受到的建连耗时
+		STAGE_FIRST_UP, // ESTABLISHED --> FIRST_UP：乐观模式下可能为0
+		STAGE_FIRST_DOWN, // ESTABLISHED --> FIRST_DOWN：首字节时间
+		STAGE_TRANSFER, // ESTABLISHED --> FIN
+		STAGE_LIFETIME, // SYN --> CLOSED
+		STAGE_COUNT
+	};
+
+private:
+	Utils::Histogram _stages[STAGE_COUNT];
+
+	static const char* const STAGE_NAMES[STAGE_COUNT];
+	static const Mark STAGE_MARKS[STAGE_COUNT][2];
+
+public:
+	// 打时间戳：只记第一次
+	static void mark(uint64_t* marks, Mark m) {
+		if (marks[m] == 0)
+			marks[m] = Utils::nanoTime();
+	}
+
+	// 两端时间戳都有的阶段才记录
+	void record(const uint64_t* marks);
+	void toJSON(Utils::JSONObject* json) const;
+	// 各阶段一个直方图，以stage标签区分，单位秒
+	void writeMetrics(Utils::MetricsWriter& out, const char* name,
+			const char* help, const char* labels) const;
+};
+
+// 按目的端口分开统计。常见端口各占一格，格子用完之后的端口合在一起，端口号记为0
+class PortLatencyStats {
+	enum {
+		SLOTS = 32
+	};
+	struct _Slot {
+		uint16_t port;
+		LatencyStats* stats;
+	};
+
+	Utils::Mutex _lock;
+	_Slot _slots[SLOTS];
+	size_t _count;
+	LatencyStats _others;
+
+public:
+	PortLatencyStats() :
+			_count(0) {
+	}
+	virtual ~PortLatencyStats() {
+		for (size_t i = 0; i < _count; ++i)
+			delete _slots[i].stats;
+	}
+
+	void record(uint16_t port, const uint64_t* marks);
+	void toJSON(Utils::JSONArray* json);
+	void writeMetrics(Utils::MetricsWriter& out, const char* name,
+			const char* help);
+};
+
+}
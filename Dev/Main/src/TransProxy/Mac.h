@@ -1,6 +1,7 @@
 #include <stdint.h>
 #include "Base/Debug.h"
 #include "Base/Utils.h"
+#include "Net/Packet.h"
 
 #pragma once
 
@@ -9,7 +10,8 @@ namespace TransProxy {
 struct MacProtocol {
 	virtual ~MacProtocol() {
 	}
-	virtual void dispatchPacket(void* packet, size_t bytes) THROWS = 0;
+	virtual void dispatchPacket(void* packet, size_t bytes,
+			Net::VnetHeader* vnet) THROWS = 0;
 };
 
 class Mac {
@@ -28,11 +30,13 @@ public:
 	void addProtocol(MacProtocol* protocol) {
 		_protocol[_protocols++] = protocol;
 	}
-	virtual void sendPacket(void* packet, size_t bytes) THROWS = 0;
+	virtual void sendPacket(void* packet, size_t bytes,
+			const Net::VnetHeader* vnet) THROWS = 0;
 
-	void dispatchPacket(void* packet, size_t bytes) THROWS {
+	void dispatchPacket(void* packet, size_t bytes, Net::VnetHeader* vnet)
+			THROWS {
 		for (size_t i = 0; i < _protocols; ++i)
-			_protocol[i]->dispatchPacket(packet, bytes);
+			_protocol[i]->dispatchPacket(packet, bytes, vnet);
 	}
 };
 
@@ -26,6 +26,7 @@ bool MallocHTTP::onHttpRequest(Net::HttpRequest& request,
 				"<table border=\"1\" bordercolor=\"lightgrey\" style=\"border-collapse: collapse\">");
 		size_t totalBytes = 0;
 		char t[32], s[32];
+		lockMallocBlocks();
 		for (MallocBlock* block = __firstMallocBlock; block; block =
 				block->next)
 			if (block->tag == MALLOC_TAG) {
@@ -39,6 +40,7 @@ bool MallocHTTP::onHttpRequest(Net::HttpRequest& request,
 				response.printf("<td>#%u</td>", block->line);
 				response.printf("</tr>");
 			}
+		unlockMallocBlocks();
 		Utils::formatSize(s, totalBytes);
 		response.printf("<tr>");
 		response.printf("<th>Total</th>");
@@ -0,0 +1,24 @@
+#define LOG_TAG  "MetricsHTTP"
+
+#include "Base/Debug.h"
+#include "Base/Metrics.h"
+#include "Base/Utils.h"
+#include "MetricsHTTP.h"
+
+namespace TransProxy {
+
+bool MetricsHTTP::onHttpRequest(Net::HttpRequest& request,
+		Net::HttpResponse& response) THROWS {
+	Utils::String path = request.getPath();
+	if (path == "/metrics") {
+		Utils::MetricsWriter out;
+		Utils::Metrics::write(out);
+		response.setStatus(200, "OK");
+		response.setContentType("text/plain; version=0.0.4");
+		response.print(out.toString());
+		return true;
+	}
+	return HttpService::onHttpRequest(request, response);
+}
+
+}
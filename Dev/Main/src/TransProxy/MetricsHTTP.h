@@ -0,0 +1,15 @@
+#include "Base/Debug.h"
+#include "HTTP.h"
+
+#pragma once
+
+namespace TransProxy {
+
+// 以Prometheus文本格式在/metrics输出Utils::Metrics里登记的全部指标
+class MetricsHTTP: public HttpService {
+public:
+	bool onHttpRequest(Net::HttpRequest& request, Net::HttpResponse& response)
+			THROWS;
+};
+
+}
@@ -0,0 +1,122 @@
+#define LOG_TAG "PathMTU"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <net/route.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include "Net/IPv4.h"
+#include "PathMTU.h"
+
+namespace TransProxy {
+
+PathMTU::PathMTU(size_t uplinkMtu) :
+		_uplinkMtu(uplinkMtu), _updates(0), _clamped(0) THROWS {
+	Utils::Log::i("PathMTU initializing...");
+	::memset(_entries, 0, sizeof(_entries));
+	if (_uplinkMtu == 0)
+		_uplinkMtu = _detect(0);
+	if (_uplinkMtu < MIN_MTU)
+		_uplinkMtu = MIN_MTU;
+	Utils::Log::i("Uplink MTU %u", (unsigned) _uplinkMtu);
+}
+
+// 在/proc/net/route里按最长前缀找到ip的出口网卡，再取网卡的MTU
+size_t PathMTU::_detect(uint32_t ip) {
+	FILE* fp = ::fopen("/proc/net/route", "rt");
+	if (fp == NULL)
+		return LAN_MTU;
+	char line[256], iface[IFNAMSIZ] = "";
+	unsigned long bestMask = 0;
+	bool found = false;
+	uint32_t addr = htonl(ip);
+	// 表里的地址和掩码是按本机字节序打印的网络序数值
+	::fgets(line, sizeof(line), fp);
+	while (::fgets(line, sizeof(line), fp)) {
+		char name[IFNAMSIZ];
+		unsigned long dest, gateway, mask;
+		unsigned flags, refcnt, use, metric;
+		if (::sscanf(line, "%15s %lx %lx %x %u %u %u %lx", name, &dest,
+				&gateway, &flags, &refcnt, &use, &metric, &mask) != 8)
+			continue;
+		if (!(flags & RTF_UP) || (addr & mask) != dest)
+			continue;
+		if (!found || ntohl(mask) > ntohl(bestMask)) {
+			found = true;
+			bestMask = mask;
+			::snprintf(iface, sizeof(iface), "%s", name);
+		}
+	}
+	::fclose(fp);
+	if (!found)
+		return LAN_MTU;
+
+	int s = ::socket(AF_INET, SOCK_DGRAM, 0);
+	if (s < 0)
+		return LAN_MTU;
+	struct ifreq ifr;
+	::memset(&ifr, 0, sizeof(ifr));
+	::snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", iface);
+	int r = ::ioctl(s, SIOCGIFMTU, &ifr);
+	::close(s);
+	if (r < 0) {
+		Utils::Log::w("FAILED to get MTU of %s", iface);
+		return LAN_MTU;
+	}
+	Utils::Log::i("Route interface %s, MTU %d", iface, ifr.ifr_mtu);
+	return ifr.ifr_mtu;
+}
+
+size_t PathMTU::get(uint32_t ip) {
+	size_t mtu = Net::IPv4::isLanIP(ip) ? (size_t) LAN_MTU : _uplinkMtu;
+	_Entry& e = _entries[_index(ip)];
+	_lock.lock();
+	if (e.ip == ip && e.mtu > 0) {
+		if (e.expires > _now())
+			mtu = Utils::min(mtu, (size_t) e.mtu);
+		else
+			e.mtu = 0;
+	}
+	_lock.unlock();
+	return mtu;
+}
+
+// 散列冲突时后来的覆盖先来的，丢了也只是下次再学一遍
+void PathMTU::update(uint32_t ip, size_t mtu) {
+	if (mtu < MIN_MTU)
+		mtu = MIN_MTU;
+	if (mtu >= get(ip))
+		return;
+	Utils::Log::i("PMTU to %s: %u", Net::IPv4::ntoa(ip), (unsigned) mtu);
+	_Entry& e = _entries[_index(ip)];
+	_lock.lock();
+	e.ip = ip;
+	e.mtu = (uint16_t) mtu;
+	e.expires = _now() + EXPIRE;
+	++_updates;
+	_lock.unlock();
+}
+
+void PathMTU::writeMetrics(Utils::MetricsWriter& out) {
+	out.gauge("transproxy_uplink_mtu_bytes", "MTU of the uplink", _uplinkMtu);
+	out.counter("transproxy_pmtu_updates_total",
+			"Path MTU reductions learned from ICMP fragmentation needed",
+			_updates);
+	out.counter("transproxy_tcp_mss_clamped_total",
+			"TCP handshakes whose MSS option was lowered", _clamped);
+	uint64_t now = _now();
+	size_t entries = 0;
+	_lock.lock();
+	for (size_t i = 0; i < ENTRIES; ++i)
+		if (_entries[i].mtu > 0 && _entries[i].expires > now)
+			++entries;
+	_lock.unlock();
+	out.gauge("transproxy_pmtu_entries",
+			"Destinations with a learned path MTU", entries);
+}
+
+}
@@ -0,0 +1,74 @@
+#include <stddef.h>
+#include <stdint.h>
+#include "Base/Debug.h"
+#include "Base/Metrics.h"
+#include "Base/Mutex.h"
+#include "Base/Utils.h"
+
+#pragma once
+
+namespace TransProxy {
+
+// 路径MTU：上行链路的MTU（配置的，或按到目的地址的路由查出口网卡），
+// 加上按目的地址记下的ICMP“需要分片”报告的下一跳MTU，过期后回到上行链路的值。
+// ICMP在主线程收到，TransTCP各分片在握手时来查，所以加锁
+class PathMTU: public Utils::MetricsSource {
+	enum {
+		ENTRIES = 256,
+		// 学到的MTU保留这么久（RFC 1191建议不短于10分钟）
+		EXPIRE = 600000,
+		// 不接受比这更小的MTU，免得伪造的ICMP把MSS压得太小（同Linux的min_pmtu）
+		MIN_MTU = 552,
+		LAN_MTU = 1500
+	};
+
+	struct _Entry {
+		uint32_t ip;
+		uint16_t mtu;
+		uint64_t expires;
+	};
+
+	size_t _uplinkMtu;
+	Utils::Mutex _lock;
+	_Entry _entries[ENTRIES];
+	// 各分片线程都会累加，用字长的计数（32位平台上没有64位原子操作）
+	size_t _updates, _clamped;
+
+	static uint64_t _now() {
+		return Utils::nanoTime() / 1000000;
+	}
+	static size_t _index(uint32_t ip) {
+		ip ^= ip >> 16;
+		ip *= 0x45D9F3B;
+		ip ^= ip >> 16;
+		return ip % ENTRIES;
+	}
+	static size_t _detect(uint32_t ip);
+
+public:
+	// uplinkMtu为0时按默认路由的出口网卡自动探测，探测不到按1500
+	PathMTU(size_t uplinkMtu) THROWS;
+	virtual ~PathMTU() {
+	}
+
+	size_t getUplinkMtu() const {
+		return _uplinkMtu;
+	}
+	// 到ip的路径MTU：局域网地址按以太网的1500，其余不超过上行链路的MTU
+	size_t get(uint32_t ip);
+	// 到ip的TCP报文段最多能带多少数据（去掉20字节IP首部和20字节TCP首部）
+	uint16_t getMss(uint32_t ip) {
+		return (uint16_t) (get(ip) - 40);
+	}
+	// 收到ICMP“需要分片”，ip是原包的目的地址，mtu为下一跳的MTU
+	void update(uint32_t ip, size_t mtu);
+	// 握手时确实压小了MSS就计一次，只用于统计
+	void onClamped() {
+		__sync_fetch_and_add(&_clamped, 1);
+	}
+
+	// Utils::MetricsSource
+	void writeMetrics(Utils::MetricsWriter& out);
+};
+
+}
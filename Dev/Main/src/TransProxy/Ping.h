@@ -1,5 +1,6 @@
 #include "Base/Debug.h"
 #include "IPv4.h"
+#include "PathMTU.h"
 
 #pragma once
 
@@ -7,10 +8,32 @@ namespace TransProxy {
 
 class Ping: public IPv4Protocol {
 	IPv4* _ipv4;
+	PathMTU* _pathMtu;
+
+	// ICMP目的不可达（3）里的需要分片（4）：第6、7字节为下一跳MTU，
+	// 第8字节起是原包的IP首部（可能带选项），原包是从agent地址发往代理的
+	bool _onFragNeeded(Net::IPv4::IpPacket& packet) {
+		const uint8_t* icmp = packet.dataPtr();
+		size_t size = packet.getDataSize();
+		if (size < 8 + 20 || icmp[0] != 3 || icmp[1] != 4)
+			return false;
+		const uint8_t* inner = icmp + 8;
+		size_t ihl = (inner[0] & 0x0F) * 4;
+		// 引用的首部不完整或不是IPv4的，不当真
+		if ((inner[0] >> 4) != 4 || ihl < 20 || 8 + ihl > size)
+			return true;
+		uint16_t mtu = (uint16_t) (icmp[6] << 8 | icmp[7]);
+		uint32_t dst = (uint32_t) inner[16] << 24 | inner[17] << 16
+				| inner[18] << 8 | inner[19];
+		// 老的路由器不填下一跳MTU，没法知道该降到多少，不理会
+		if (_pathMtu && mtu > 0)
+			_pathMtu->update(dst, mtu);
+		return true;
+	}
 
 public:
-	Ping(IPv4* ipv4) :
-			_ipv4(ipv4) THROWS {
+	Ping(IPv4* ipv4, PathMTU* pathMtu = NULL) :
+			IPv4Protocol(IPPROTO_ICMP), _ipv4(ipv4), _pathMtu(pathMtu) THROWS {
 		Utils::Log::i("Protocol Ping initializing...");
 	}
 	virtual ~Ping() {
@@ -18,17 +41,18 @@ public:
 	}
 
 	// IPv4Protocol
-	void dispatchPacket(Net::IPv4::IpPacket& packet) THROWS {
-		if (packet.protocol() == IPPROTO_ICMP) {
-			//Utils::Log::d("ICMP packet");
-			uint32_t src = packet.getSrcAddr();
-			uint32_t dst = packet.getDestAddr();
-			packet.setSrcAddr(dst);
-			packet.setDestAddr(src);
-
-			// 仅仅交换地址数据顺序不需要重新计算校验和
-			_ipv4->sendPacket(packet);
-		}
+	bool dispatchPacket(Net::IPv4::IpPacket& packet) THROWS {
+		//Utils::Log::d("ICMP packet");
+		if (_onFragNeeded(packet))
+			return true;
+		uint32_t src = packet.getSrcAddr();
+		uint32_t dst = packet.getDestAddr();
+		packet.setSrcAddr(dst);
+		packet.setDestAddr(src);
+
+		// 仅仅交换地址数据顺序不需要重新计算校验和
+		_ipv4->sendPacket(packet);
+		return true;
 	}
 };
 
@@ -0,0 +1,72 @@
+#define LOG_TAG "PortAllocator"
+
+#include <stdlib.h>
+#include <string.h>
+#include "Base/Debug.h"
+#include "PortAllocator.h"
+
+namespace TransProxy {
+
+// 游标从随机位置开始，端口不容易被猜到
+PortAllocator::_Ports::_Ports(uint32_t ip) :
+		ip(ip), used(0), cursor(::random() % PORT_COUNT) {
+	::memset(bits, 0, sizeof(bits));
+}
+
+PortAllocator::_Ports* PortAllocator::_get(uint32_t ip) {
+	_Ports* ports = _ips.get(ip);
+	if (ports == NULL) {
+		ports = new _Ports(ip);
+		_ips.add(ports);
+	}
+	return ports;
+}
+
+uint16_t PortAllocator::acquire(uint32_t ip) {
+	_Ports* ports = _get(ip);
+	if (ports->used == PORT_COUNT)
+		return 0;
+	size_t i = ports->cursor;
+	for (;;) {
+		size_t w = i / 32;
+		uint32_t free = ~ports->bits[w] & (0xFFFFFFFF << (i % 32));
+		if (free) {
+			i = w * 32 + __builtin_ctz(free);
+			break;
+		}
+		i = (w + 1) % WORDS * 32;
+	}
+	ports->bits[i / 32] |= (uint32_t) 1 << (i % 32);
+	++ports->used;
+	ports->cursor = (i + 1) % PORT_COUNT;
+	return (uint16_t) (FIRST_PORT + i);
+}
+
+bool PortAllocator::reserve(uint32_t ip, uint16_t port) {
+	if (port < FIRST_PORT)
+		return true;
+	_Ports* ports = _get(ip);
+	size_t i = port - FIRST_PORT;
+	uint32_t bit = (uint32_t) 1 << (i % 32);
+	if (ports->bits[i / 32] & bit)
+		return false;
+	ports->bits[i / 32] |= bit;
+	++ports->used;
+	return true;
+}
+
+void PortAllocator::release(uint32_t ip, uint16_t port) {
+	if (port < FIRST_PORT)
+		return;
+	_Ports* ports = _ips.get(ip);
+	if (ports == NULL)
+		return;
+	size_t i = port - FIRST_PORT;
+	uint32_t bit = (uint32_t) 1 << (i % 32);
+	if (ports->bits[i / 32] & bit) {
+		ports->bits[i / 32] &= ~bit;
+		--ports->used;
+	}
+}
+
+}
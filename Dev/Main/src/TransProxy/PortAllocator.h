@@ -0,0 +1,48 @@
+#include <stddef.h>
+#include <stdint.h>
+#include "Base/Utils.h"
+
+#pragma once
+
+namespace TransProxy {
+
+// 用户态TCP的本地端口分配，每个本地IP一张1024~65535的位图。
+// 分配从轮转的游标往后找第一个空位，按32位一个字跳过占满的，均摊O(1)；
+// 游标只往前走，刚释放的端口要转一圈才会再被分出去
+class PortAllocator {
+	enum {
+		FIRST_PORT = 1024,
+		PORT_COUNT = 65536 - FIRST_PORT,
+		WORDS = PORT_COUNT / 32
+	};
+
+	struct _Ports: Utils::MapItem<uint32_t> {
+		uint32_t ip;
+		size_t used, cursor;
+		uint32_t bits[WORDS];
+		_Ports(uint32_t ip);
+		uint32_t getKey() const {
+			return ip;
+		}
+		Utils::String getKeyString() const {
+			return Utils::String::format("%x", ip);
+		}
+	};
+
+	Utils::Map<uint32_t, _Ports> _ips;
+
+	_Ports* _get(uint32_t ip);
+
+public:
+	virtual ~PortAllocator() {
+		_ips.clear();
+	}
+
+	// 分配一个空闲端口，没有时返回0
+	uint16_t acquire(uint32_t ip);
+	// 占用指定的端口（如监听端口），已被占用时返回false；1024以下的不归这里管，总是成功
+	bool reserve(uint32_t ip, uint16_t port);
+	void release(uint32_t ip, uint16_t port);
+};
+
+}
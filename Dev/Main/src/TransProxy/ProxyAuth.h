@@ -15,16 +15,18 @@ struct ProxyAuth {
 struct ProxyAuthListener {
 	virtual ~ProxyAuthListener() {
 	}
+	// final：这是最后一个请求，代理应答之后连接就通了，请求后面可以紧跟数据
 	virtual void sendAuthRequest(const void* data, size_t bytes,
-			size_t bufferSize) THROWS = 0;
+			size_t bufferSize, bool final) THROWS = 0;
 	virtual void commitAuthRequest(size_t bytes) THROWS = 0;
 };
 
 struct ProxyAuthBuilder {
 	virtual ~ProxyAuthBuilder() {
 	}
+	// greeted：连接已经做完了代理协议的问候，直接从请求开始
 	virtual ProxyAuth* createInstance(const char* hostname, uint16_t port,
-			ProxyAuthListener* listener) THROWS = 0;
+			ProxyAuthListener* listener, bool greeted = false) THROWS = 0;
 };
 
 }
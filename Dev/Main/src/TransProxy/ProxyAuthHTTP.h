@@ -24,7 +24,7 @@ public:
 	}
 	void sendAuthRequest() THROWS {
 		_listener->sendAuthRequest(_req.sz(), _req.length(),
-				sizeof(_response) - 1 - _responseBytes);
+				sizeof(_response) - 1 - _responseBytes, true);
 	}
 	int onAuthResponse(const void* data, size_t bytes) THROWS {
 		if (_responseBytes + bytes >= sizeof(_response)) {
@@ -48,7 +48,7 @@ public:
 
 	struct Builder: ProxyAuthBuilder {
 		ProxyAuth* createInstance(const char* hostname, uint16_t port,
-				ProxyAuthListener* listener) THROWS {
+				ProxyAuthListener* listener, bool /* greeted */) THROWS {
 			return new ProxyAuthHTTP(hostname, port, listener);
 		}
 	};
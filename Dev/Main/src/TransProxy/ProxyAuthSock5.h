@@ -15,8 +15,9 @@ class ProxyAuthSock5: public ProxyAuth {
 	size_t _responseBytes;
 public:
 	ProxyAuthSock5(const char* hostname, uint16_t port,
-			ProxyAuthListener* listener) :
-			_listener(listener), _req(::strlen(hostname) + 7), _state(1), _responseBytes(
+			ProxyAuthListener* listener, bool greeted = false) :
+			_listener(listener), _req(::strlen(hostname) + 7), _state(
+					greeted ? 2 : 1), _responseBytes(
 					0) {
 		uint8_t l = ::strlen(hostname);
 		_req.write(0, "\5\1\0\3", 4);
@@ -27,10 +28,10 @@ public:
 	void sendAuthRequest() THROWS {
 		if (_state == 1)
 			_listener->sendAuthRequest("\5\1", 3,
-					sizeof(_response) - _responseBytes);
+					sizeof(_response) - _responseBytes, false);
 		else if (_state == 2)
 			_listener->sendAuthRequest(_req.ptr(), _req.size(),
-					sizeof(_response) - _responseBytes);
+					sizeof(_response) - _responseBytes, true);
 	}
 	int onAuthResponse(const void* data, size_t bytes) THROWS {
 		if (_responseBytes + bytes > sizeof(_response)) {
@@ -72,8 +73,8 @@ public:
 
 	struct Builder: ProxyAuthBuilder {
 		ProxyAuth* createInstance(const char* hostname, uint16_t port,
-				ProxyAuthListener* listener) THROWS {
-			return new ProxyAuthSock5(hostname, port, listener);
+				ProxyAuthListener* listener, bool greeted) THROWS {
+			return new ProxyAuthSock5(hostname, port, listener, greeted);
 		}
 	};
 };
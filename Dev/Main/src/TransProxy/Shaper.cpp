@@ -0,0 +1,271 @@
+#define LOG_TAG "Shaper"
+
+#include <limits.h>
+#include <stddef.h>
+#include <string.h>
+#include "Base/Debug.h"
+#include "Base/Utils.h"
+#include "Shaper.h"
+
+namespace TransProxy {
+
+Shaper::Shaper(Mac* mac, Upstreams* upstreams, size_t clientRate,
+		size_t totalRate, size_t burst, size_t queueLimit) :
+		_mac(mac), _upstreams(upstreams), _clientRate(clientRate), _burst(
+				burst), _queueLimit(queueLimit), _ring(NULL), _activeCount(0), _timer(
+				"Shaper", this) {
+	Utils::Log::i("Shaper initializing...");
+	_total.init(totalRate, burst, _now());
+	::memset(_clients, 0, sizeof(_clients));
+}
+
+Shaper::Shaper(Shaper* first, Mac* mac) :
+		_mac(mac), _upstreams(first->_upstreams), _clientRate(
+				first->_clientRate), _burst(first->_burst), _queueLimit(
+				first->_queueLimit), _ring(NULL), _activeCount(0), _timer(
+				"Shaper", this) {
+	Utils::Log::i("Shaper queue initializing...");
+	_total.init(first->_total.rate, first->_burst, _now());
+	::memset(_clients, 0, sizeof(_clients));
+}
+
+Shaper::~Shaper() {
+	for (size_t i = 0; i < CLIENT_BUCKETS; ++i)
+		while (_clients[i]) {
+			_Client* c = _clients[i];
+			_clients[i] = c->next;
+			while (c->interactive.first)
+				delete[] (uint8_t*) c->interactive.pop();
+			while (c->bulk.first)
+				delete[] (uint8_t*) c->bulk.pop();
+			delete c;
+		}
+}
+
+Shaper::_Client* Shaper::_find(uint32_t ip) const {
+	for (_Client* c = _clients[ip % CLIENT_BUCKETS]; c; c = c->next)
+		if (c->ip == ip)
+			return c;
+	return NULL;
+}
+
+// 客户端只增不减，局域网里的客户端数有限
+Shaper::_Client* Shaper::_client(uint32_t ip, uint64_t now) {
+	_Client* c = _find(ip);
+	if (c)
+		return c;
+	c = new _Client();
+	c->nextActive = NULL;
+	c->ip = ip;
+	c->bucket.init(_clientRate, _burst, now);
+	c->deficit = 0;
+	c->active = false;
+	::memset(c->flows, 0, sizeof(c->flows));
+	::memset(c->bulkQueued, 0, sizeof(c->bulkQueued));
+	c->tick = (uint32_t) now;
+	c->tickBytes = 0;
+	c->rate = 0;
+	c->drops = 0;
+	_lock.lock();
+	c->next = _clients[ip % CLIENT_BUCKETS];
+	_clients[ip % CLIENT_BUCKETS] = c;
+	_lock.unlock();
+	return c;
+}
+
+// 每秒更新一次速率，并把各流的近期字节数减半
+void Shaper::_tick(_Client* c, uint64_t now) {
+	uint32_t elapsed = (uint32_t) now - c->tick;
+	if (elapsed < RATE_TICK)
+		return;
+	unsigned rate = (unsigned) ((uint64_t) c->tickBytes * 1000 / elapsed);
+	c->rate = elapsed >= 2 * RATE_TICK ? rate : (c->rate + rate) / 2;
+	c->tick = (uint32_t) now;
+	c->tickBytes = 0;
+	uint32_t ticks = elapsed / RATE_TICK;
+	for (size_t i = 0; i < FLOW_BUCKETS; ++i)
+		c->flows[i] = ticks >= 32 ? 0 : c->flows[i] >> ticks;
+}
+
+// 流按协议、源地址和两端端口散列，散列冲突的流合在一起算
+bool Shaper::_isInteractive(_Client* c, const uint8_t* packet, size_t bytes,
+		size_t* flow) {
+	size_t l = (packet[0] & 0x0F) * 4;
+	uint32_t h = *(const uint32_t*) (packet + 12) ^ packet[9];
+	if ((packet[9] == IPPROTO_TCP || packet[9] == IPPROTO_UDP)
+			&& bytes >= l + 4)
+		h ^= *(const uint32_t*) (packet + l);
+	h ^= h >> 16;
+	h *= 0x45D9F3B;
+	h ^= h >> 16;
+	*flow = h % FLOW_BUCKETS;
+	uint32_t& recent = c->flows[*flow];
+	bool interactive = c->bulkQueued[*flow] == 0
+			&& (bytes <= SMALL_PACKET || recent < NEW_FLOW_BYTES);
+	recent = recent > 0xFFFFFFFF - bytes ? 0xFFFFFFFF : recent + bytes;
+	return interactive;
+}
+
+Shaper::_Packet* Shaper::_popBulk(_Client* c) {
+	_Packet* p = c->bulk.pop();
+	--c->bulkQueued[p->flow];
+	return p;
+}
+
+// 积压超限时交互包挤掉最早的大流包，否则丢弃新来的包；队列空时总能放进一个
+void Shaper::_enqueue(_Client* c, size_t flow, bool interactive,
+		void* packet, size_t bytes, const Net::VnetHeader* vnet) {
+	size_t queued = c->interactive.bytes + c->bulk.bytes;
+	if (interactive)
+		while (queued + bytes > _queueLimit && c->bulk.first) {
+			_Packet* p = _popBulk(c);
+			queued -= p->bytes;
+			delete[] (uint8_t*) p;
+			++c->drops;
+		}
+	if (queued > 0 && queued + bytes > _queueLimit) {
+		++c->drops;
+		return;
+	}
+
+	_Packet* p = (_Packet*) new uint8_t[offsetof(_Packet, data) + bytes];
+	p->hasVnet = vnet != NULL;
+	if (vnet)
+		p->vnet = *vnet;
+	p->flow = flow;
+	p->bytes = bytes;
+	::memcpy(p->data, packet, bytes);
+	if (interactive) {
+		c->interactive.push(p);
+	} else {
+		c->bulk.push(p);
+		++c->bulkQueued[flow];
+	}
+
+	if (!c->active) {
+		c->active = true;
+		if (_ring) {
+			c->nextActive = _ring->nextActive;
+			_ring->nextActive = c;
+		} else {
+			c->nextActive = c;
+		}
+		_ring = c;
+		++_activeCount;
+	}
+}
+
+void Shaper::_transmit(_Client* c, void* packet, size_t bytes,
+		const Net::VnetHeader* vnet) THROWS {
+	c->bucket.take(bytes);
+	_total.take(bytes);
+	c->tickBytes += bytes;
+	_mac->sendPacket(packet, bytes, vnet);
+}
+
+// 按环轮转，每个有令牌的客户端每轮得一个QUANTUM的额度；
+// 转完一整圈都没有客户端有令牌，或总令牌用完，就等令牌补回再来
+void Shaper::_run() THROWS {
+	uint64_t now = _now();
+	_total.refill(now);
+	size_t idle = 0;
+	while (_ring && idle < _activeCount && _total.ready()) {
+		_Client* prev = _ring;
+		_Client* c = prev->nextActive;
+		c->bucket.refill(now);
+		_tick(c, now);
+		if (c->bucket.ready()) {
+			idle = 0;
+			c->deficit += QUANTUM;
+			while (c->deficit > 0 && c->bucket.ready() && _total.ready()
+					&& (c->interactive.first || c->bulk.first)) {
+				_Packet* p =
+						c->interactive.first ?
+								c->interactive.pop() : _popBulk(c);
+				c->deficit -= p->bytes;
+				TRY{
+					_transmit(c, p->data, p->bytes, p->hasVnet ? &p->vnet : NULL);
+				}CATCH(e){
+					delete[] (uint8_t*) p;
+					THROW(e);
+				}
+				delete[] (uint8_t*) p;
+			}
+			// 因令牌不够而没用完的额度最多留一个QUANTUM，否则限速的客户端
+			// 额度越攒越多，令牌一回来就能一口气压过别的客户端
+			if (c->deficit > QUANTUM)
+				c->deficit = QUANTUM;
+		} else {
+			++idle;
+		}
+		if (c->interactive.first == NULL && c->bulk.first == NULL) {
+			c->active = false;
+			c->deficit = 0;
+			if (c == prev)
+				_ring = NULL;
+			else
+				prev->nextActive = c->nextActive;
+			--_activeCount;
+		} else {
+			_ring = c;
+		}
+	}
+	if (_ring == NULL)
+		return;
+
+	unsigned wait = _total.wait();
+	if (wait == 0) {
+		wait = UINT_MAX;
+		_Client* c = _ring;
+		do {
+			c = c->nextActive;
+			wait = Utils::min(wait, c->bucket.wait());
+		} while (c != _ring);
+	}
+	_timer.setTimeout(wait > 0 ? wait : 1);
+}
+
+// 各项分别取值，彼此可能差一点，作统计用够了
+bool Shaper::getClientStats(uint32_t ip, ClientStats* stats) {
+	_lock.lock();
+	_Client* c = _find(ip);
+	if (c) {
+		uint32_t tick = __sync_fetch_and_add(&c->tick, 0);
+		unsigned rate = __sync_fetch_and_add(&c->rate, 0);
+		stats->rate = (uint32_t) _now() - tick >= 2 * RATE_TICK ? 0 : rate;
+		stats->queued = __sync_fetch_and_add(&c->interactive.bytes, 0)
+				+ __sync_fetch_and_add(&c->bulk.bytes, 0);
+		stats->drops = __sync_fetch_and_add(&c->drops, 0);
+	}
+	_lock.unlock();
+	return c != NULL;
+}
+
+void Shaper::sendPacket(void* packet, size_t bytes,
+		const Net::VnetHeader* vnet) THROWS {
+	const uint8_t* buf = (const uint8_t*) packet;
+	uint32_t dst = ntohl(*(const uint32_t*) (buf + 16));
+	if (!_isClient(dst)) {
+		_mac->sendPacket(packet, bytes, vnet);
+		return;
+	}
+
+	uint64_t now = _now();
+	_Client* c = _client(dst, now);
+	_tick(c, now);
+	size_t flow;
+	bool interactive = _isInteractive(c, buf, bytes, &flow);
+	c->bucket.refill(now);
+	_total.refill(now);
+	// 没有积压、令牌也够就直接发；限了总速率时别的客户端有积压也得排队，轮转才公平
+	if (!c->active && c->bucket.ready() && _total.ready()
+			&& (_total.rate == 0 || _ring == NULL)) {
+		_transmit(c, packet, bytes, vnet);
+		return;
+	}
+	_enqueue(c, flow, interactive, packet, bytes, vnet);
+	// 本轮处理完再统一调度，同一批里排进来的包一起发
+	_timer.post();
+}
+
+}
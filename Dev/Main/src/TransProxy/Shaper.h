@@ -0,0 +1,183 @@
+#include <stddef.h>
+#include <stdint.h>
+#include "Base/Debug.h"
+#include "Base/Mutex.h"
+#include "Base/Utils.h"
+#include "Net/Packet.h"
+#include "Mac.h"
+#include "Upstreams.h"
+
+#pragma once
+
+namespace TransProxy {
+
+// 出口整形，套在一个工作线程的Mac外面：发往局域网客户端的包按目的地址归到各客户端，
+// 每个客户端一个令牌桶限速，另有一个总令牌桶。超出的包按客户端排队，
+// 客户端之间按差额轮转（DRR）分享总速率；同一客户端内小包和新流的包先发。
+// 只由所属线程使用。客户端表的链接加锁，HTTP线程才能安全地查找客户端；
+// 给它读的统计（rate、tick、队列字节数、drops）都是字长，只由所属线程写，读时用__sync取值
+class Shaper: public Mac, Utils::TimerListener {
+public:
+	struct ClientStats {
+		unsigned rate; // 近期发送速率，字节/秒
+		size_t queued; // 积压的字节数
+		uint64_t drops; // 队列满丢弃的包数
+	};
+
+private:
+	enum {
+		CLIENT_BUCKETS = 64,
+		// 每个客户端的流散列到这么多格子里，各格子记近期的字节数，每秒减半
+		FLOW_BUCKETS = 16,
+		// 不超过这么大的包（ACK、DNS、按键）算交互流量
+		SMALL_PACKET = 256,
+		// 近期字节数不到这么多的流算新流，也算交互流量
+		NEW_FLOW_BYTES = 65536,
+		// DRR每轮给每个客户端的额度
+		QUANTUM = 1514,
+		RATE_TICK = 1000
+	};
+
+	struct _Packet {
+		_Packet* next;
+		size_t flow;
+		bool hasVnet;
+		Net::VnetHeader vnet;
+		size_t bytes;
+		uint8_t data[1];
+	};
+
+	struct _Queue {
+		_Packet *first, *last;
+		size_t bytes;
+		_Queue() :
+				first(NULL), last(NULL), bytes(0) {
+		}
+		void push(_Packet* packet) {
+			packet->next = NULL;
+			if (last)
+				last->next = packet;
+			else
+				first = packet;
+			last = packet;
+			bytes += packet->bytes;
+		}
+		_Packet* pop() {
+			_Packet* packet = first;
+			first = packet->next;
+			if (first == NULL)
+				last = NULL;
+			bytes -= packet->bytes;
+			return packet;
+		}
+	};
+
+	// 令牌以字节计，允许透支一个大包（GSO）后变成负数，等补回正数再发
+	struct _Bucket {
+		size_t rate, burst;
+		int64_t tokens;
+		uint64_t time;
+		void init(size_t rate_, size_t burst_, uint64_t now) {
+			rate = rate_;
+			burst = burst_;
+			tokens = burst_;
+			time = now;
+		}
+		void refill(uint64_t now) {
+			if (rate == 0 || now <= time)
+				return;
+			// 不足一个字节的先不算，留着时间差下次再补
+			int64_t add = (int64_t) ((now - time) * rate / 1000);
+			if (add == 0)
+				return;
+			tokens += add;
+			if (tokens > (int64_t) burst)
+				tokens = burst;
+			time = now;
+		}
+		bool ready() const {
+			return rate == 0 || tokens > 0;
+		}
+		void take(size_t bytes) {
+			if (rate)
+				tokens -= bytes;
+		}
+		// 补回到可发还要多少毫秒
+		unsigned wait() const {
+			return ready() ?
+					0 : (unsigned) ((1 - tokens) * 1000 / (int64_t) rate + 1);
+		}
+	};
+
+	struct _Client {
+		_Client* next;
+		_Client* nextActive;
+		uint32_t ip;
+		_Bucket bucket;
+		_Queue interactive, bulk;
+		long deficit;
+		bool active;
+		uint32_t flows[FLOW_BUCKETS];
+		// 各流在大流队列里排着的包数，有的话这个流的包都进大流队列，免得乱序
+		uint32_t bulkQueued[FLOW_BUCKETS];
+		// 上次更新速率的时刻，毫秒取低32位，只用来算间隔
+		uint32_t tick;
+		size_t tickBytes;
+		unsigned rate;
+		uint32_t drops;
+	};
+
+	Mac* _mac;
+	Upstreams* _upstreams;
+	size_t _clientRate, _burst, _queueLimit;
+	_Bucket _total;
+	Utils::Mutex _lock;
+	_Client* _clients[CLIENT_BUCKETS];
+	// 有积压的客户端连成环，_ring指向环尾，_ring->nextActive是下一个该服务的
+	_Client* _ring;
+	size_t _activeCount;
+	Utils::Timer _timer;
+
+	static uint64_t _now() {
+		return Utils::nanoTime() / 1000000;
+	}
+
+	bool _isClient(uint32_t ip) const {
+		return Net::IPv4::isLanIP(ip) && !_upstreams->contains(ip);
+	}
+	_Client* _find(uint32_t ip) const;
+	_Client* _client(uint32_t ip, uint64_t now);
+	void _tick(_Client* c, uint64_t now);
+	bool _isInteractive(_Client* c, const uint8_t* packet, size_t bytes,
+			size_t* flow);
+	_Packet* _popBulk(_Client* c);
+	void _enqueue(_Client* c, size_t flow, bool interactive, void* packet,
+			size_t bytes, const Net::VnetHeader* vnet);
+	void _transmit(_Client* c, void* packet, size_t bytes,
+			const Net::VnetHeader* vnet) THROWS;
+	void _run() THROWS;
+
+	// Utils::TimerListener
+	void onTimeout() THROWS {
+		_run();
+	}
+	void onTimerError(Utils::Exception* e) THROWS {
+		THROW(e);
+	}
+
+public:
+	// 速率为字节/秒，0为不限；burst为令牌桶深度，queueLimit为每个客户端最多积压的字节数
+	Shaper(Mac* mac, Upstreams* upstreams, size_t clientRate,
+			size_t totalRate, size_t burst, size_t queueLimit);
+	// 多队列模式下其他工作线程用的，限速参数同first
+	Shaper(Shaper* first, Mac* mac);
+	virtual ~Shaper();
+
+	bool getClientStats(uint32_t ip, ClientStats* stats);
+
+	// Mac
+	void sendPacket(void* packet, size_t bytes, const Net::VnetHeader* vnet)
+			THROWS;
+};
+
+}
@@ -35,6 +35,8 @@ private:
 		_Server(TCP* thiz, Net::IPv4::SockAddr addr,
 				Net::TcpServerListener* listener) :
 				_this(thiz), _addr(addr), _listener(listener), _id(1) {
+			// 监听的端口不再分给主动连接
+			_this->_ports.reserve(addr.ip, addr.port);
 			_this->_servers.add(this);
 			_ServerIP* serverIP = _this->_serverIPs.get(addr.ip);
 			if (serverIP)
@@ -43,6 +45,7 @@ private:
 				_this->_serverIPs.add(new _ServerIP(addr.ip));
 		}
 		~_Server() {
+			_this->_ports.release(_addr.ip, _addr.port);
 			_this->_servers.remove(this);
 			_ServerIP* serverIP = _this->_serverIPs.get(_addr.ip);
 			ASSERT(serverIP);
@@ -83,13 +86,17 @@ private:
 	};
 
 	IPv4* _ipv4;
+	size_t _sendBuffer, _recvBuffer;
+	PortAllocator _ports;
 	Utils::Map<uint32_t, _ServerIP> _serverIPs;
 	Utils::Map<Net::IPv4::SockAddr, _Server> _servers;
 	Utils::Map<Net::IPv4::SockAddrPair, TcpConnection> _connections;
 
 public:
-	TCP(IPv4* ipv4) :
-			_ipv4(ipv4) THROWS {
+	// sendBuffer、recvBuffer为每个连接收发缓冲区的上限，字节
+	TCP(IPv4* ipv4, size_t sendBuffer = 65536, size_t recvBuffer = 65536) :
+			IPv4Protocol(IPPROTO_TCP), _ipv4(ipv4), _sendBuffer(sendBuffer), _recvBuffer(
+					recvBuffer) THROWS {
 		Utils::Log::i("Protocol TCP initializing...");
 	}
 	virtual ~TCP() {
@@ -97,7 +104,7 @@ public:
 	}
 
 	// IPv4Protocol
-	void dispatchPacket(Net::IPv4::IpPacket& packet) THROWS;
+	bool dispatchTcpPacket(Net::IPv4::TcpPacket& packet) THROWS;
 
 	Factory* bind(uint32_t ip) {
 		return new _Factory(this, ip);
@@ -108,7 +115,10 @@ public:
 	}
 	Net::TcpConnection* open(uint32_t ip,
 			Net::TcpConnectionListener* listener) {
-		return new TcpConnection(&_connections, _ipv4, ip);
+		TcpConnection* conn = new TcpConnection(&_connections, _ipv4,
+				_sendBuffer, _recvBuffer, &_ports, ip);
+		conn->setListener(listener);
+		return conn;
 	}
 };
 
@@ -6,32 +6,61 @@
 
 namespace TransProxy {
 
-TcpConnection::TcpConnection(TcpConnections* conns, IPv4* ipv4, uint32_t ip) :
-		_conns(conns), _ipv4(ipv4), _serverListener(
+// 缓冲区成倍增长到放得下bytes，但不超过limit
+static void _reserve(Utils::RingBuffer* ring, size_t bytes, size_t limit) {
+	size_t size = ring->size();
+	if (bytes <= size)
+		return;
+	while (size < bytes)
+		size <<= 1;
+	ring->grow(Utils::min(size, limit));
+}
+
+TcpConnection::TcpConnection(TcpConnections* conns, IPv4* ipv4,
+		size_t sendBuffer, size_t recvBuffer, PortAllocator* ports, uint32_t ip) :
+		_conns(conns), _ipv4(ipv4), _ports(ports), _boundPort(0), _serverListener(
 		NULL), _listener(
-		NULL), _id(1), _remoteWindowSize(0), _state(STATE_CLOSED), _retryCount(
-				0), _localSeq(::random()), _remoteSeq(0), _needRecv(false), _needSend(
-				false), _canRecv(false), _canSend(false), _needAck(false), _timerListener2(
-				this), _timer1("ProtocolTcpConn1", this), _timer2(
-				"ProtocolTcpConn2", &_timerListener2) {
-	_addrs.remote.ip = ip;
-	_inRing = Utils::RingBuffer::alloc(1400);
-	_outRing = Utils::RingBuffer::alloc(1400);
+		NULL), _id(1), _state(STATE_CLOSED), _retryCount(0), _localSeq(
+				::random()), _remoteSeq(0), _sendBuffer(sendBuffer), _recvBuffer(
+				recvBuffer), _windowScale(true), _sendShift(0), _recvShift(0), _remoteWindow(
+				0), _sent(0), _sendMss(DEFAULT_MSS), _smallEnd(_localSeq), _srtt(
+				0), _rttvar(0), _rto(INITIAL_RTO), _rttTiming(false), _rttSeq(
+				0), _rttTime(0), _dupAcks(0), _timeouts(0), _recovering(false), _recover(0), _needRecv(
+				false), _needSend(false), _canRecv(false), _canSend(false), _needAck(
+				false), _ackSegments(0), _ackNow(false), _closing(false), _closeTime(0), _timerListener2(
+				this), _timerListener3(this), _timer1("ProtocolTcpConn1", this), _timer2(
+				"ProtocolTcpConn2", &_timerListener2), _timer3("ProtocolTcpConn3",
+				&_timerListener3) {
+	_addrs.local.ip = ip;
+	_inRing = Utils::RingBuffer::alloc(
+			Utils::min<size_t>(INITIAL_BUFFER, _recvBuffer));
+	_outRing = Utils::RingBuffer::alloc(
+			Utils::min<size_t>(INITIAL_BUFFER, _sendBuffer));
+	while (_recvShift < MAX_WINDOW_SCALE
+			&& (_recvBuffer >> _recvShift) > 0xFFFF)
+		++_recvShift;
 }
 
 TcpConnection::~TcpConnection() {
 	_conns->remove(this);
 	_timer1.clearTimeout();
 	_timer2.clearTimeout();
+	_timer3.clearTimeout();
+	if (_boundPort)
+		_ports->release(_addrs.local.ip, _boundPort);
 	delete _inRing;
 	delete _outRing;
 }
 
 void TcpConnection::sendPacket(int flags, size_t offset, size_t bytes,
 		const void* data) THROWS {
+	// 有数据的段都捎带ACK，攒着的延迟确认也就不用另发了
 	if (_needAck || bytes > 0) {
 		flags |= Net::IPv4::TcpPacket::FLAG_ACK;
 		_needAck = false;
+		_ackNow = false;
+		_ackSegments = 0;
+		_timer3.clearTimeout();
 	}
 	Net::IPv4::TcpPacketBuffer out;
 	out.setId(_id++);
@@ -42,7 +71,18 @@ void TcpConnection::sendPacket(int flags, size_t offset, size_t bytes,
 	out.setFlags(flags);
 	out.setSeq(_localSeq + offset);
 	out.setAck(_remoteSeq);
-	out.setWindowSize(_inRing->free());
+	if (flags & Net::IPv4::TcpPacket::FLAG_SYN) {
+		// SYN里带上MSS和窗口扩大选项，SYN本身的窗口不扩大
+		uint8_t options[8] = { 2, 4, LOCAL_MSS >> 8, LOCAL_MSS & 0xFF, 1, 3, 3,
+				(uint8_t) _recvShift };
+		out.setOptions(options, _windowScale ? 8 : 4);
+		out.setWindowSize(Utils::min<size_t>(_recvWindow(), 0xFFFF));
+	} else {
+		out.setWindowSize(
+				Utils::min<size_t>(
+						_recvWindow() >> (_windowScale ? _recvShift : 0),
+						0xFFFF));
+	}
 	if (bytes > 0)
 		out.write(0, data, bytes);
 	out.setDataSize(bytes);
@@ -51,17 +91,98 @@ void TcpConnection::sendPacket(int flags, size_t offset, size_t bytes,
 	_ipv4->sendPacket(out);
 }
 
+// 对方SYN里没带窗口扩大选项的，双方都不扩大
+void TcpConnection::_onSyn(Net::IPv4::TcpPacket& in) {
+	size_t mss = in.getMss();
+	_sendMss = mss ? Utils::min<size_t>(mss, LOCAL_MSS) : (size_t) DEFAULT_MSS;
+	int shift = in.getWindowScale();
+	if (shift < 0) {
+		_windowScale = false;
+		_recvShift = 0;
+	} else {
+		_sendShift = Utils::min(shift, (int) MAX_WINDOW_SCALE);
+	}
+}
+
+void TcpConnection::_startRtt(uint32_t seq) {
+	_rttTiming = true;
+	_rttSeq = seq;
+	_rttTime = Utils::nanoTime();
+}
+
+// RFC 6298：首个样本R时SRTT=R、RTTVAR=R/2，之后RTTVAR=3/4*RTTVAR+1/4*|SRTT-R|，
+// SRTT=7/8*SRTT+1/8*R，RTO=SRTT+4*RTTVAR。新样本同时取消超时退避
+void TcpConnection::_sampleRtt() {
+	_rttTiming = false;
+	unsigned rtt = (unsigned) Utils::min<uint64_t>(
+			(Utils::nanoTime() - _rttTime) / 1000, MAX_RTO);
+	if (rtt == 0)
+		rtt = 1;
+	if (_srtt == 0) {
+		_srtt = rtt;
+		_rttvar = rtt / 2;
+	} else {
+		unsigned delta = _srtt > rtt ? _srtt - rtt : rtt - _srtt;
+		_rttvar = (3 * _rttvar + delta) / 4;
+		_srtt = (7 * _srtt + rtt) / 8;
+	}
+	_rto = Utils::min<unsigned>(
+			Utils::max<unsigned>(_srtt + 4 * _rttvar, MIN_RTO), MAX_RTO);
+	Utils::Log::d("RTT %uus, SRTT %uus, RTO %uus", rtt, _srtt, _rto);
+}
+
+// 只重传开头第一个没被确认的段
+void TcpConnection::_retransmit() THROWS {
+	size_t l = Utils::min(_sent, _sendMss);
+	if (l == 0)
+		return;
+	uint8_t buf[LOCAL_MSS];
+	_outRing->peek(0, l, buf);
+	_rttTiming = false;
+	sendPacket(
+			l == _outRing->available() ? Net::IPv4::TcpPacket::FLAG_PSH : 0,
+			0, l, buf);
+}
+
+void TcpConnection::_enterRecovery() THROWS {
+	_recovering = true;
+	_recover = _localSeq + _sent;
+	_retransmit();
+	_timer2.setTimeout(_rto / 1000);
+}
+
 void TcpConnection::dispatchPacket(Net::IPv4::TcpPacket& in) THROWS {
 	Utils::Log::d("dispatchPacket %s", in.toString().sz());
-	_remoteWindowSize = in.getWindowSize();
+	size_t window = _remoteWindow;
+	_remoteWindow = in.hasFlags(Net::IPv4::TcpPacket::FLAG_SYN) ?
+			in.getWindowSize() :
+			(size_t) in.getWindowSize() << (_windowScale ? _sendShift : 0);
 	if (_state == STATE_LISTEN) {
 		THROW_IF(!in.hasFlags(Net::IPv4::TcpPacket::FLAG_SYN),
 				new Utils::Exception("LISTEN only accept SYN"));
 		_addrs.remote = Net::IPv4::SockAddr(in.getSrcAddr(), in.getSrcPort());
 		_remoteSeq = in.getSeq() + 1;
+		_onSyn(in);
 		_state = STATE_SYN_RECV;
 		_retryCount = 0;
-		_timer1.setTimeout(0);
+		_timer1.post();
+
+	} else if (_state == STATE_SYN_SENT) {
+		// 对方的初始序号这时才知道，不能按_remoteSeq比
+		if (in.hasFlags(Net::IPv4::TcpPacket::FLAG_SYN)
+				&& in.hasFlags(Net::IPv4::TcpPacket::FLAG_ACK)
+				&& in.getAck() == _localSeq + 1) {
+			++_localSeq;
+			_remoteSeq = in.getSeq() + 1;
+			_onSyn(in);
+			if (_rttTiming)
+				_sampleRtt();
+			sendPacket(Net::IPv4::TcpPacket::FLAG_ACK);
+			_state = STATE_ESTABLISHED;
+			Utils::Log::d("onConnected");
+			if (_listener)
+				_listener->onTcpConnected();
+		}
 
 	} else if (in.getSeq() == _remoteSeq) {
 		if (_state == STATE_LAST_ACK) {
@@ -69,7 +190,7 @@ void TcpConnection::dispatchPacket(Net::IPv4::TcpPacket& in) THROWS {
 					&& in.getAck() == _localSeq + 1) {
 				++_localSeq;
 				_state = STATE_CLOSED;
-				_timer1.setTimeout(0);
+				_timer1.post();
 			}
 
 		} else if (_state == STATE_FIN_WAIT_1) {
@@ -83,19 +204,19 @@ void TcpConnection::dispatchPacket(Net::IPv4::TcpPacket& in) THROWS {
 			} else if (fin) {
 				_state = STATE_CLOSING;
 				_retryCount = 0;
-				_timer1.setTimeout(0);
+				_timer1.post();
 			} else if (fin && ack) {
 				++_localSeq;
 				sendPacket(Net::IPv4::TcpPacket::FLAG_ACK);
 				_state = STATE_CLOSED;
-				_timer1.setTimeout(0);
+				_timer1.post();
 			}
 
 		} else if (_state == STATE_FIN_WAIT_2) {
 			if (in.hasFlags(Net::IPv4::TcpPacket::FLAG_FIN)) {
 				sendPacket(Net::IPv4::TcpPacket::FLAG_ACK);
 				_state = STATE_CLOSED;
-				_timer1.setTimeout(0);
+				_timer1.post();
 			}
 
 		} else if (_state == STATE_CLOSING) {
@@ -103,79 +224,121 @@ void TcpConnection::dispatchPacket(Net::IPv4::TcpPacket& in) THROWS {
 					&& in.getAck() == _localSeq + 1) {
 				++_localSeq;
 				_state = STATE_CLOSED;
-				_timer1.setTimeout(0);
+				_timer1.post();
 			}
 
 		} else if (in.hasFlags(Net::IPv4::TcpPacket::FLAG_FIN)) {
 			++_remoteSeq;
 			_state = STATE_LAST_ACK;
 			_retryCount = 0;
-			_timer1.setTimeout(0);
+			_timer1.post();
 
 		} else if (_state == STATE_SYN_RECV) {
 			if (in.hasFlags(Net::IPv4::TcpPacket::FLAG_ACK)
 					&& in.getAck() == _localSeq + 1) {
 				++_localSeq;
+				if (_rttTiming)
+					_sampleRtt();
 				_state = STATE_ESTABLISHED;
 				Utils::Log::d("onTcpServerConnected");
 				_listener = _serverListener->onTcpServerConnected(this);
 			}
 
-		} else if (_state == STATE_SYN_SENT) {
-			if (in.hasFlags(Net::IPv4::TcpPacket::FLAG_SYN)
-					&& in.hasFlags(Net::IPv4::TcpPacket::FLAG_ACK)
-					&& in.getAck() == _localSeq + 1) {
-				++_localSeq;
-				sendPacket(Net::IPv4::TcpPacket::FLAG_ACK);
-				_state = STATE_ESTABLISHED;
-				Utils::Log::d("onConnected");
-				_listener->onTcpConnected();
-			}
-
 		} else if (_state == STATE_ESTABLISHED) {
 			if (in.hasFlags(Net::IPv4::TcpPacket::FLAG_ACK)) {
 				size_t ack = in.getAck() - _localSeq;
-				if (ack > 0 && ack < (1 << 30)) {
+				if (ack > 0 && ack <= _outRing->available()) {
 					Utils::Log::d("ACK %u bytes", ack);
-					uint8_t buf[ack];
-					_outRing->read(buf, ack);
+					if (_rttTiming && (int32_t) (in.getAck() - _rttSeq) >= 0)
+						_sampleRtt();
+					_outRing->skip(ack);
 					_localSeq += ack;
-					if (_outRing->available() == 0) {
+					_sent = ack < _sent ? _sent - ack : 0;
+					_dupAcks = 0;
+					_timeouts = 0;
+					if (_recovering) {
+						if ((int32_t) (in.getAck() - _recover) >= 0)
+							_recovering = false;
+						else
+							_retransmit();
+					}
+					if (_outRing->available() > 0)
+						_timer2.setTimeout(_rto / 1000);
+					else
+						_timer2.clearTimeout();
+					if (_closing) {
+						if (_outRing->available() == 0) {
+							_closing = false;
+							_state = STATE_FIN_WAIT_1;
+							_retryCount = 0;
+							_timer1.post();
+							return;
+						}
+					} else if (_outRing->available() < _sendBuffer) {
 						_canSend = true;
 						if (_needSend)
-							_timer1.setTimeout(0);
+							_timer1.post();
+					}
+				} else if (ack == 0 && _sent == 0) {
+					// 零窗口探测有回应，对方还在，只是收不下
+					_timeouts = 0;
+				} else if (ack == 0 && _sent > 0 && in.getDataSize() == 0
+						&& !in.hasFlags(Net::IPv4::TcpPacket::FLAG_FIN)
+						&& _remoteWindow == window) {
+					// 重复ACK：对方收到了后面的段，开头那段丢了
+					if (++_dupAcks == DUP_ACK_THRESHOLD && !_recovering) {
+						Utils::Log::d("Fast retransmit");
+						_enterRecovery();
 					}
 				}
 			}
-			size_t bytes = Utils::min(in.getDataSize(), _inRing->free());
+			size_t bytes = Utils::min(in.getDataSize(), _recvWindow());
 			Utils::Log::d("Received %u bytes", bytes);
-			if (bytes != 0 && bytes <= _inRing->free()) {
+			if (bytes > 0) {
+				_reserve(_inRing, _inRing->available() + bytes, _recvBuffer);
 				_inRing->write(in.dataPtr(), bytes);
 				_remoteSeq += bytes;
 				if (in.hasFlags(Net::IPv4::TcpPacket::FLAG_PSH)
-						|| _inRing->free() == 0) {
+						|| _recvWindow() == 0) {
 					_canRecv = true;
 				}
-				_needAck = true;
-				_timer1.setTimeout(0);
 			}
+			// 窗口满了收不下的马上回ACK，让对方知道窗口为0
+			if (in.getDataSize() > 0)
+				_ack(bytes < in.getDataSize() || _recvWindow() == 0);
+			// 对方的确认和窗口可能放出了新的发送额度
+			if (_sent < _outRing->available())
+				_push();
 		}
+
+	} else if (_state == STATE_ESTABLISHED && in.getDataSize() > 0) {
+		// 乱序或重复的段不收，马上回ACK，对方攒够重复ACK就会快速重传
+		_ack(true);
 	}
 }
 
 void TcpConnection::onTimeout() THROWS {
 	if (_state == STATE_SYN_SENT) {
 		if (_retryCount++ < 3) {
+			if (_retryCount == 1)
+				_startRtt(_localSeq + 1);
+			else
+				_rttTiming = false;
 			sendPacket(Net::IPv4::TcpPacket::FLAG_SYN);
 			_timer1.setTimeout(3000);
 		} else {
 			sendPacket(Net::IPv4::TcpPacket::FLAG_RST);
 			_state = STATE_CLOSED;
-			_timer1.setTimeout(0);
+			_timer1.post();
 		}
 
 	} else if (_state == STATE_SYN_RECV) {
 		if (_retryCount++ < 3) {
+			// 握手也取一个RTT样本，重发过的不算
+			if (_retryCount == 1)
+				_startRtt(_localSeq + 1);
+			else
+				_rttTiming = false;
 			sendPacket(
 					Net::IPv4::TcpPacket::FLAG_SYN
 							| Net::IPv4::TcpPacket::FLAG_ACK);
@@ -183,18 +346,23 @@ void TcpConnection::onTimeout() THROWS {
 		} else {
 			sendPacket(Net::IPv4::TcpPacket::FLAG_RST);
 			_state = STATE_CLOSED;
-			_timer1.setTimeout(0);
+			_timer1.post();
 		}
 
 	} else if (_state == STATE_ESTABLISHED) {
-		if (_needRecv && _canRecv) {
+		if (_listener && _needRecv && _canRecv) {
 			_needRecv = false;
 			_listener->onTcpToRecv();
 		}
-		if (_needSend && _canSend) {
+		if (_listener && _needSend && _canSend) {
 			_needSend = false;
 			_listener->onTcpToSend();
 		}
+		// 应用这一轮send()的数据攒在一起发，收到的数据顺带确认
+		if (_state == STATE_ESTABLISHED && _sent < _outRing->available())
+			_push();
+		if (_state == STATE_ESTABLISHED && _needAck && _ackNow)
+			sendPacket(0);
 
 	} else if (_state == STATE_LAST_ACK) {
 		if (_retryCount++ < 3) {
@@ -205,7 +373,7 @@ void TcpConnection::onTimeout() THROWS {
 		} else {
 			sendPacket(Net::IPv4::TcpPacket::FLAG_RST);
 			_state = STATE_CLOSED;
-			_timer1.setTimeout(0);
+			_timer1.post();
 		}
 
 	} else if (_state == STATE_FIN_WAIT_1) {
@@ -217,13 +385,13 @@ void TcpConnection::onTimeout() THROWS {
 		} else {
 			sendPacket(Net::IPv4::TcpPacket::FLAG_RST);
 			_state = STATE_CLOSED;
-			_timer1.setTimeout(0);
+			_timer1.post();
 		}
 
 	} else if (_state == STATE_FIN_WAIT_2) {
 		sendPacket(Net::IPv4::TcpPacket::FLAG_RST);
 		_state = STATE_CLOSED;
-		_timer1.setTimeout(0);
+		_timer1.post();
 
 	} else if (_state == STATE_CLOSING) {
 		if (_retryCount++ < 3) {
@@ -231,7 +399,7 @@ void TcpConnection::onTimeout() THROWS {
 		} else {
 			sendPacket(Net::IPv4::TcpPacket::FLAG_RST);
 			_state = STATE_CLOSED;
-			_timer1.setTimeout(0);
+			_timer1.post();
 		}
 
 	} else if (_state == STATE_CLOSED) {
@@ -241,28 +409,94 @@ void TcpConnection::onTimeout() THROWS {
 	}
 }
 
-void TcpConnection::_send(size_t offset, size_t bytes) THROWS {
-	size_t l = Utils::min<size_t>(offset + bytes, _remoteWindowSize);
-	if (l > offset) {
-		l -= offset;
-		uint8_t buf[1024];
-		while (l > sizeof(buf)) {
-			_outRing->peek(offset, sizeof(buf), buf);
-			sendPacket(0, offset, sizeof(buf), buf);
-			offset += sizeof(buf);
-			l -= sizeof(buf);
-		}
-		_outRing->peek(offset, l, buf);
-		sendPacket(Net::IPv4::TcpPacket::FLAG_PSH, offset, l, buf);
+// 收到数据要回ACK：每攒两个段或者now为真时，在本轮事件处理完就回；
+// 否则最多等DELAYED_ACK毫秒，这期间有数据要发就捎带上
+void TcpConnection::_ack(bool now) {
+	_needAck = true;
+	if (now || ++_ackSegments >= 2) {
+		_ackNow = true;
+		_timer1.post();
+	} else if (!_timer3.isScheduled()) {
+		_timer3.setTimeout(DELAYED_ACK);
 	}
-	if (_needAck)
-		sendPacket(0);
 }
 
+void TcpConnection::_TimerListener3::onTimeout() THROWS {
+	if (_this->_state == STATE_ESTABLISHED && _this->_needAck)
+		_this->sendPacket(0);
+}
+
+// 对方窗口内还没发出的数据按MSS分段发出去，最后一段带PSH
+void TcpConnection::_push() THROWS {
+	size_t end = Utils::min(_outRing->available(), _remoteWindow);
+	uint8_t buf[LOCAL_MSS];
+	while (_sent < end) {
+		size_t l = Utils::min(end - _sent, _sendMss);
+		// 不满MSS的段等前一个小段确认了再发，这期间应用再写的数据会凑进来
+		if (l < _sendMss && (int32_t) (_smallEnd - _localSeq) > 0)
+			break;
+		_outRing->peek(_sent, l, buf);
+		if (!_rttTiming)
+			_startRtt(_localSeq + _sent + l);
+		sendPacket(
+				_sent + l == _outRing->available() ?
+						Net::IPv4::TcpPacket::FLAG_PSH : 0, _sent, l, buf);
+		_sent += l;
+		if (l < _sendMss)
+			_smallEnd = _localSeq + _sent;
+	}
+	// 对方窗口为0一个字节也没发出去时同样要挂上，到时发探测（持续定时器），
+	// 否则对方开窗的那个ACK丢了两边就一直干等
+	if ((_sent > 0 || _remoteWindow == 0) && _outRing->available() > 0
+			&& !_timer2.isScheduled())
+		_timer2.setTimeout(_rto / 1000);
+}
+
+// 超时只重传开头没被确认的那段，RTO加倍；什么都没发出去（对方窗口为0）时发1字节探测
 void TcpConnection::_TimerListener2::onTimeout() THROWS {
-	if (_this->_state == STATE_ESTABLISHED) {
-		_this->_send(0, _this->_outRing->available());
-		_this->_timer2.setTimeout(3000);
+	if (_this->_closing
+			&& Utils::nanoTime() - _this->_closeTime
+					>= CLOSE_LINGER * 1000000ULL) {
+		Utils::Log::w("%s: %u bytes unsent after close, reset",
+				_this->_addrs.toString().sz(),
+				(unsigned) _this->_outRing->available());
+		_this->_closing = false;
+		_this->sendPacket(Net::IPv4::TcpPacket::FLAG_RST);
+		_this->_state = STATE_CLOSED;
+		_this->_timer1.post();
+		return;
+	}
+	if (_this->_state == STATE_ESTABLISHED
+			&& _this->_outRing->available() > 0
+			&& ++_this->_timeouts > MAX_RETRANSMITS) {
+		Utils::Log::w("%s: no ACK after %d retransmits, reset",
+				_this->_addrs.toString().sz(), MAX_RETRANSMITS);
+		_this->sendPacket(Net::IPv4::TcpPacket::FLAG_RST);
+		_this->_state = STATE_CLOSED;
+		_this->_timer1.post();
+		// 关闭后的连接只等着释放，出错也不再通知；否则通知一次之后不再回调
+		Net::TcpConnectionListener* listener = _this->_listener;
+		_this->_listener = NULL;
+		if (listener)
+			listener->onTcpError(
+					new Utils::Exception("%s: retransmit timeout",
+							_this->_addrs.toString().sz()));
+		return;
+	}
+	if (_this->_state == STATE_ESTABLISHED
+			&& _this->_outRing->available() > 0) {
+		_this->_rto = Utils::min<unsigned>(_this->_rto * 2, MAX_RTO);
+		_this->_dupAcks = 0;
+		Utils::Log::d("Retransmit timeout, RTO %uus", _this->_rto);
+		if (_this->_sent == 0) {
+			uint8_t probe;
+			_this->_outRing->peek(0, 1, &probe);
+			_this->_rttTiming = false;
+			_this->sendPacket(0, 0, 1, &probe);
+			_this->_timer2.setTimeout(_this->_rto / 1000);
+		} else {
+			_this->_enterRecovery();
+		}
 	}
 }
 
@@ -280,29 +514,43 @@ void TcpConnection::accept(Net::IPv4::SockAddrPair addrs,
 void TcpConnection::connect(Net::IPv4::SockAddr addr) THROWS {
 	THROW_IF(_state != STATE_CLOSED,
 			new Utils::Exception("Connect at non-closed state"));
-	uint32_t ip = _addrs.remote.ip;
-	for (uint16_t port = 1024; port < 65536; ++port) {
-		Net::IPv4::SockAddrPair addrs(Net::IPv4::SockAddr(ip, port), addr);
-		if (_conns->get(addrs) == NULL) {
-			Utils::Log::d("connect %s", addrs.toString().sz());
-			_addrs = addrs;
-			_conns->add(this);
-			_state = STATE_SYN_SENT;
-			_retryCount = 0;
-			_timer1.setTimeout(0);
-			return;
-		}
-	}
-	THROW(new Utils::Exception("No free port to bind"));
+	THROW_IF(_ports == NULL,
+			new Utils::Exception("Connect without port allocator"));
+	uint16_t port = _ports->acquire(_addrs.local.ip);
+	THROW_IF(port == 0, new Utils::Exception("No free port to bind"));
+	_boundPort = port;
+	_addrs = Net::IPv4::SockAddrPair(addr,
+			Net::IPv4::SockAddr(_addrs.local.ip, port));
+	Utils::Log::d("connect %s", _addrs.toString().sz());
+	_conns->add(this);
+	_state = STATE_SYN_SENT;
+	_retryCount = 0;
+	_timer1.post();
 }
 
 void TcpConnection::close() THROWS {
 	_listener = NULL;
+	// 已经RST了或者还没连接，直接释放
+	if (_state == STATE_CLOSED) {
+		_timer1.post();
+		return;
+	}
+	if (_state == STATE_ESTABLISHED && _outRing->available() > 0) {
+		// 对方一直不确认或窗口一直为0时，靠重传定时器检查CLOSE_LINGER
+		if (!_closing) {
+			_closing = true;
+			_closeTime = Utils::nanoTime();
+		}
+		_canSend = false;
+		if (!_timer2.isScheduled())
+			_timer2.setTimeout(_rto / 1000);
+		return;
+	}
 	if (_state != STATE_FIN_WAIT_1 && _state != STATE_FIN_WAIT_2
 			&& _state != STATE_CLOSING) {
 		_state = STATE_FIN_WAIT_1;
 		_retryCount = 0;
-		_timer1.setTimeout(0);
+		_timer1.post();
 	}
 }
 
@@ -311,7 +559,7 @@ void TcpConnection::waitToRecv() {
 	if (_state == STATE_ESTABLISHED) {
 		_needRecv = true;
 		if (_canRecv)
-			_timer1.setTimeout(0);
+			_timer1.post();
 	}
 }
 
@@ -320,7 +568,7 @@ void TcpConnection::waitToSend() {
 	if (_state == STATE_ESTABLISHED) {
 		_needSend = true;
 		if (_canSend)
-			_timer1.setTimeout(0);
+			_timer1.post();
 	}
 }
 
@@ -339,9 +587,13 @@ size_t TcpConnection::recv(void* data, size_t bytes) THROWS {
 	Utils::Log::d("==> recv %u", bytes);
 	size_t r;
 	if (_state == STATE_ESTABLISHED) {
+		size_t window = _recvWindow();
 		r = _inRing->read(data, bytes);
 		if (_inRing->available() == 0)
 			_canRecv = false;
+		// 窗口从快关上重新打开时通告一下，免得对方干等
+		if (window < LOCAL_MSS && _recvWindow() >= LOCAL_MSS)
+			_ack(true);
 	} else {
 		r = 0;
 	}
@@ -353,15 +605,15 @@ size_t TcpConnection::recv(void* data, size_t bytes) THROWS {
 size_t TcpConnection::send(const void* data, size_t bytes) THROWS {
 	Utils::Log::d("==> send %u", bytes);
 	size_t r;
-	if (_state == STATE_ESTABLISHED) {
-		size_t offset = _outRing->available();
+	if (_state == STATE_ESTABLISHED && !_closing) {
+		bytes = Utils::min(bytes, _sendBuffer - _outRing->available());
+		_reserve(_outRing, _outRing->available() + bytes, _sendBuffer);
 		r = _outRing->write(data, bytes);
-		if (_outRing->free() == 0)
+		if (_outRing->available() == _sendBuffer)
 			_canSend = false;
-		if (r) {
-			_send(offset, r);
-			_timer2.setTimeout(3000);
-		}
+		// 不马上发，等本轮事件处理完，连续几次小的send()合成整段
+		if (r)
+			_timer1.post();
 	} else {
 		r = 0;
 	}
@@ -4,6 +4,7 @@
 #include "Net/TcpServer.h"
 #include "Net/TcpClient.h"
 #include "IPv4.h"
+#include "PortAllocator.h"
 
 #pragma once
 
@@ -28,17 +29,71 @@ class TcpConnection: public Net::TcpConnection, public Utils::MapItem<
 		STATE_TIME_WAIT
 	};
 
+	enum {
+		// 收发缓冲区从这么大开始，按需成倍增长到配置的上限
+		INITIAL_BUFFER = 4096,
+		// 在SYN里通告的MSS，TUN的MTU是1500；对方没带MSS选项时按RFC 1122的536
+		LOCAL_MSS = 1460,
+		DEFAULT_MSS = 536,
+		// 延迟确认最多等这么多毫秒
+		DELAYED_ACK = 40,
+		MAX_WINDOW_SCALE = 14,
+		// 重传超时的初值和上下限，微秒（RFC 6298，下限同Linux）
+		INITIAL_RTO = 1000000,
+		MIN_RTO = 200000,
+		MAX_RTO = 60000000,
+		// 收到这么多个重复ACK就快速重传
+		DUP_ACK_THRESHOLD = 3,
+		// 连续这么多次超时都没等到新的确认，就认为对方已经不在了
+		MAX_RETRANSMITS = 8,
+		// close()之后剩下的数据最多再送这么多毫秒，送不完就RST
+		CLOSE_LINGER = 60000
+	};
+
 	TcpConnections* _conns;
 	IPv4* _ipv4;
+	// 主动连接时从这里分配本地端口，_boundPort为分到的，释放时还回去
+	PortAllocator* _ports;
+	uint16_t _boundPort;
 	Net::IPv4::SockAddrPair _addrs;
 	Net::TcpServerListener* _serverListener;
 	Net::TcpConnectionListener* _listener;
-	uint16_t _id, _remoteWindowSize;
+	uint16_t _id;
 	_State _state;
 	int _retryCount;
 	uint32_t _localSeq, _remoteSeq;
 	Utils::RingBuffer *_inRing, *_outRing;
+	// 收发缓冲区的上限
+	size_t _sendBuffer, _recvBuffer;
+	// 窗口扩大（RFC 7323）：双方SYN里都带了选项才用，_sendShift是对方的，_recvShift是自己的
+	bool _windowScale;
+	int _sendShift, _recvShift;
+	// 对方通告的窗口（已还原成字节数），以及_outRing开头已经发出去的字节数
+	size_t _remoteWindow, _sent;
+	// 发出的段最多带多少数据，取对方SYN里的MSS
+	size_t _sendMss;
+	// Nagle（Minshall的变体）：不满MSS的段在前一个小段被确认之前不发，_smallEnd为其末尾序号
+	uint32_t _smallEnd;
+	// RTT估计（Jacobson/Karels），微秒，_srtt为0表示还没有样本
+	unsigned _srtt, _rttvar, _rto;
+	// 同一时间只给一个段计时，确认号越过_rttSeq时取样；计时的段重传过就作废（Karn算法）
+	bool _rttTiming;
+	uint32_t _rttSeq;
+	uint64_t _rttTime;
+	// 连续的重复ACK数；快速重传或超时重传后进入恢复，确认到_recover之前
+	// 每个部分确认都说明下一段也丢了，立即重传
+	int _dupAcks;
+	// 连续超时的次数，收到新的确认清零
+	int _timeouts;
+	bool _recovering;
+	uint32_t _recover;
 	bool _needRecv, _needSend, _canRecv, _canSend, _needAck;
+	// 延迟确认：攒了几个没确认的段，以及是否该在本轮事件处理完就回ACK
+	int _ackSegments;
+	bool _ackNow;
+	// 应用已经close()，但还有数据没被确认，等确认完再发FIN；_closeTime为close()的时刻
+	bool _closing;
+	uint64_t _closeTime;
 
 	struct _TimerListener2: Utils::TimerListener {
 		TcpConnection* _this;
@@ -52,11 +107,33 @@ class TcpConnection: public Net::TcpConnection, public Utils::MapItem<
 		}
 	} _timerListener2;
 
-	Utils::Timer _timer1, _timer2;
+	// 延迟确认到时
+	struct _TimerListener3: Utils::TimerListener {
+		TcpConnection* _this;
+		_TimerListener3(TcpConnection* thiz) :
+				_this(thiz) {
+		}
+		// Utils::TimerListener
+		void onTimeout() THROWS;
+		void onTimerError(Utils::Exception* e) THROWS {
+			THROW(e);
+		}
+	} _timerListener3;
 
+	Utils::Timer _timer1, _timer2, _timer3;
+
+	size_t _recvWindow() const {
+		return _recvBuffer - _inRing->available();
+	}
+	void _onSyn(Net::IPv4::TcpPacket& in);
 	void sendPacket(int flags, size_t offset = 0, size_t bytes = 0,
 			const void* data = NULL) THROWS;
-	void _send(size_t offset, size_t bytes) THROWS;
+	void _ack(bool now);
+	void _push() THROWS;
+	void _startRtt(uint32_t seq);
+	void _sampleRtt();
+	void _retransmit() THROWS;
+	void _enterRecovery() THROWS;
 
 	// Utils::TimerListener
 	void onTimeout() THROWS;
@@ -68,7 +145,10 @@ protected:
 	virtual ~TcpConnection();
 
 public:
-	TcpConnection(TcpConnections* conns, IPv4* ipv4, uint32_t ip = 0);
+	// sendBuffer、recvBuffer为收发缓冲区的上限，字节；
+	// 要主动connect()的须给出分配端口的ports和本地地址ip
+	TcpConnection(TcpConnections* conns, IPv4* ipv4, size_t sendBuffer,
+			size_t recvBuffer, PortAllocator* ports = NULL, uint32_t ip = 0);
 
 	void dispatchPacket(Net::IPv4::TcpPacket& packet) THROWS;
 
@@ -94,6 +174,14 @@ public:
 
 	void close() THROWS;
 
+	// 平滑RTT和当前的重传超时，微秒，调试用
+	unsigned getSrtt() const {
+		return _srtt;
+	}
+	unsigned getRto() const {
+		return _rto;
+	}
+
 	void waitToRecv();
 	void waitToSend();
 	size_t peek(void* data, size_t bytes) THROWS;
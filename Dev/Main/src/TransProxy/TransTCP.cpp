@@ -8,14 +8,6 @@
 
 namespace TransProxy {
 
-const Net::IPv4::SockAddrPair& TransTCP::_ConnectionByAddrPair::getKey() const {
-	return (*this)->_addrPair;
-}
-
-Net::IPv4::SockAddr TransTCP::_ConnectionByAgent::getKey() const {
-	return (*this)->_agent;
-}
-
 void TransTCP::_Connection::_sendPacket(_From from, int flags, uint32_t seq,
 		uint32_t ack, uint16_t windowSize, const void* data, size_t bytes)
 				THROWS {
@@ -40,9 +32,32 @@ void TransTCP::_Connection::_sendPacket(_From from, Net::IPv4::TcpPacket& out)
 		out.setSrcSockAddr(_addrPair.local);
 		out.setDestSockAddr(_addrPair.remote);
 	}
-	out.fillChecksum();
+	// 从offload模式TUN收上来的包（可能是GSO大包）把TCP校验和交给内核算
+	if (out.vnet())
+		out.fillPartialChecksum();
+	else
+		out.fillChecksum();
 	Utils::Log::d("_sendPacket %s", out.toString().sz());
-	_this->_ipv4->sendPacket(out);
+	_shard->_ipv4->sendPacket(out);
+}
+
+// 收到的包原样转出去，只改地址、序号和窗口
+void TransTCP::_Connection::_forwardPacket(_From from,
+		Net::IPv4::TcpPacket& packet, uint32_t seq, uint32_t ack,
+		uint16_t windowSize) THROWS {
+	if (packet.vnet()) {
+		packet.setSeq(seq);
+		packet.setAck(ack);
+		packet.setWindowSize(windowSize);
+		_sendPacket(from, packet);
+		return;
+	}
+	if (from == FROM_CLIENT)
+		packet.rewrite(_agent, _proxy, seq, ack, windowSize);
+	else
+		packet.rewrite(_addrPair.local, _addrPair.remote, seq, ack, windowSize);
+	Utils::Log::d("_forwardPacket %s", packet.toString().sz());
+	_shard->_ipv4->sendPacket(packet);
 }
 
 void TransTCP::_Connection::_transferData(_From from,
@@ -50,28 +65,39 @@ void TransTCP::_Connection::_transferData(_From from,
 	uint32_t seq = packet.getSeq();
 	uint32_t ack = packet.getAck();
 	bool ACK = packet.hasFlags(Net::IPv4::TcpPacket::FLAG_ACK);
+	if (packet.getDataSize() > 0)
+		_mark(from == FROM_CLIENT ?
+				LatencyStats::MARK_FIRST_UP : LatencyStats::MARK_FIRST_DOWN);
 	if (from == FROM_CLIENT) {
-		packet.setSeq(seq + _proxyOutTotal);
-		packet.setAck(ack + _proxyInTotal);
+		seq += _proxyOutTotal;
 		if (ACK) {
 			size_t downBytes = ack - _proxySeq - _downBytes;
 			if (downBytes > 0 && downBytes <= INT_MAX) {
 				_downBytes += downBytes;
-				_this->_totalDownBytes += downBytes;
+				_shard->_addBytes(0, downBytes);
 			}
 		}
+		ack += _proxyInTotal;
 	} else {
-		packet.setSeq(seq -= _proxyInTotal);
-		packet.setAck(ack -= _proxyOutTotal);
+		seq -= _proxyInTotal;
+		ack -= _proxyOutTotal;
 		if (ACK) {
 			size_t upBytes = ack - _clientSeq - _upBytes;
 			if (upBytes > 0 && upBytes <= INT_MAX) {
 				_upBytes += upBytes;
-				_this->_totalUpBytes += upBytes;
+				_shard->_addBytes(upBytes, 0);
 			}
 		}
 	}
-	_sendPacket(from, packet);
+	_forwardPacket(from, packet, seq, ack, packet.getWindowSize());
+}
+
+// 双方在SYN里报的MSS都压到代理那条路径能过的大小：
+// 客户端的报给代理，管代理发来的段；代理的报给客户端，管客户端发出的段
+void TransTCP::_Connection::_clampMss(Net::IPv4::TcpPacket& packet) {
+	if (_this->_pathMtu
+			&& packet.clampMss(_this->_pathMtu->getMss(_proxy.ip)))
+		_this->_pathMtu->onClamped();
 }
 
 void TransTCP::_Connection::_transferSYN1(_From from,
@@ -80,8 +106,18 @@ void TransTCP::_Connection::_transferSYN1(_From from,
 			&& packet.hasFlags(Net::IPv4::TcpPacket::FLAG_SYN)) {
 		_clientSeq = packet.getSeq() + 1;
 		_clientWindowSize = packet.getWindowSize();
-		packet.setWindowSize(0);
-		_sendPacket(from, packet);
+		_clampMss(packet);
+		_forwardPacket(from, packet, packet.getSeq(), packet.getAck(), 0);
+		if (_state == STATE_CLOSED) {
+			_stamp = Utils::nanoTime();
+			_mark(LatencyStats::MARK_SYN);
+			if (_this->_race) {
+				_synBytes = packet.packetSize();
+				_syn = new uint8_t[_synBytes];
+				::memcpy(_syn, packet.ptr(), _synBytes);
+				_raceTimer.setTimeout(_via->getRaceDelay(false));
+			}
+		}
 		_state = STATE_SYN_SENT;
 		_timer.setTimeout(3000);
 	}
@@ -93,8 +129,19 @@ void TransTCP::_Connection::_transferSYN2(_From from,
 			&& packet.hasFlags(Net::IPv4::TcpPacket::FLAG_ACK)
 			&& packet.getAck() == _clientSeq) {
 		_proxySeq = packet.getSeq() + 1;
-		packet.setWindowSize(0);
-		_sendPacket(from, packet);
+		_proxyAck = _clientSeq;
+		if (_state == STATE_SYN_SENT) {
+			_mark(LatencyStats::MARK_SYN_ACK);
+			_via->onConnected((Utils::nanoTime() - _stamp) / 1000);
+			// 原上游先回了SYN/ACK，只比握手的竞速就输了
+			if (_racer)
+				_stopRace();
+			_raceTimer.clearTimeout();
+		}
+		_clampMss(packet);
+		// 一般模式下客户端窗口为0，等代理应答之后才放开；乐观模式先开一个小窗口收下首批数据
+		_forwardPacket(from, packet, packet.getSeq(), packet.getAck(),
+				_this->_optimistic ? OPTIMISTIC_WINDOW : 0);
 		_state = STATE_SYN_RECEIVED;
 		_timer.setTimeout(3000);
 	}
@@ -104,19 +151,28 @@ void TransTCP::_Connection::_transferSYN3(_From from,
 		Net::IPv4::TcpPacket& packet) THROWS {
 	if (from == FROM_CLIENT && packet.hasFlags(Net::IPv4::TcpPacket::FLAG_ACK)
 			&& packet.getAck() == _proxySeq) {
-		packet.setWindowSize(0);
-		_sendPacket(from, packet);
-		_auth = _this->_authBuilder->createInstance(_hostname.sz(),
+		if (packet.getDataSize() > 0) {
+			// 握手的ACK带了数据：代理那边只转ACK，数据等请求发出后再跟上
+			_sendPacket(from, 0, packet.getSeq(), packet.getAck(), 0);
+			_bufferEarly(packet);
+		} else {
+			_forwardPacket(from, packet, packet.getSeq(), packet.getAck(), 0);
+		}
+		_auth = _via->getAuthBuilder()->createInstance(_hostname.sz(),
 				_addrPair.local.port, this);
+		_stamp = Utils::nanoTime();
 		_state = STATE_AUTH;
 		_retryCount = 0;
-		_timer.setTimeout(0);
+		_timer.post();
+		if (_syn && _racer == NULL)
+			_raceTimer.setTimeout(_via->getRaceDelay(true));
 	}
 }
 
 void TransTCP::_Connection::_observeFIN(_From from,
 		Net::IPv4::TcpPacket& packet) THROWS {
 	if (packet.hasFlags(Net::IPv4::TcpPacket::FLAG_FIN)) {
+		_mark(LatencyStats::MARK_FIN);
 		if (from == FROM_CLIENT)
 			_clientFin = true;
 		else
@@ -128,7 +184,13 @@ void TransTCP::_Connection::dispatchPacket(_From from,
 		Net::IPv4::TcpPacket& packet) THROWS {
 	Utils::Log::d("==> (%u) dispatchPacket %s", _state, packet.toString().sz());
 
-	if (_state == STATE_CLOSED) {
+	if (from == FROM_RACER) {
+		_raceDispatchPacket(packet);
+
+	} else if (from == FROM_PROXY && _handedOver) {
+		// 原上游那一路已经放弃了
+
+	} else if (_state == STATE_CLOSED) {
 		_transferSYN1(from, packet);
 
 	} else if (_state == STATE_SYN_SENT) {
@@ -148,7 +210,6 @@ void TransTCP::_Connection::dispatchPacket(_From from,
 		_transferData(from, packet);
 		_observeFIN(from, packet);
 
-		_timer.clearTimeout();
 		if (_clientFin && _proxyFin) {
 			_state = STATE_FIN_WAIT;
 			_timer.setTimeout(3000);
@@ -167,14 +228,59 @@ void TransTCP::_Connection::dispatchPacket(_From from,
 }
 
 void TransTCP::_Connection::_authSendRequest() THROWS {
+	_mark(LatencyStats::MARK_AUTH_SENT);
 	_auth->sendAuthRequest();
 }
 
 void TransTCP::_Connection::sendAuthRequest(const void* data, size_t bytes,
-		size_t bufferSize) THROWS {
+		size_t bufferSize, bool final) THROWS {
 	_sendPacket(FROM_CLIENT, Net::IPv4::TcpPacket::FLAG_PSH,
 			_clientSeq + _proxyOutTotal, _proxySeq + _proxyInTotal, bufferSize,
 			data, bytes);
+	if (final) {
+		_requested = true;
+		_requestEnd = _proxyOutTotal + bytes;
+		_authWindow = bufferSize;
+		// 重发请求时暂存的数据也一起重发
+		_sendEarly(0, _earlyBytes);
+	}
+}
+
+// 只收紧接着已暂存部分的数据，乱序的、超出窗口的丢掉让客户端重传
+void TransTCP::_Connection::_bufferEarly(Net::IPv4::TcpPacket& packet) THROWS {
+	size_t offset = packet.getSeq() - _clientSeq;
+	size_t bytes = packet.getDataSize();
+	if (offset > _earlyBytes || offset + bytes <= _earlyBytes
+			|| offset + bytes > OPTIMISTIC_WINDOW)
+		return;
+	_mark(LatencyStats::MARK_FIRST_UP);
+	if (_early == NULL)
+		_early = new uint8_t[OPTIMISTIC_WINDOW];
+	size_t begin = _earlyBytes;
+	::memcpy(_early + begin, (const uint8_t*) packet.dataPtr() + begin - offset,
+			offset + bytes - begin);
+	_earlyBytes = offset + bytes;
+	if (_requested)
+		_sendEarly(begin, _earlyBytes);
+	if (_racer && _racer->_requested)
+		_racer->_sendEarly(begin, _earlyBytes);
+}
+
+void TransTCP::_Connection::_sendEarly(size_t begin, size_t end) THROWS {
+	while (begin < end) {
+		size_t n = Utils::min(end - begin, (size_t) 1400);
+		_sendPacket(FROM_CLIENT, Net::IPv4::TcpPacket::FLAG_PSH,
+				_clientSeq + _requestEnd + begin, _proxySeq + _proxyInTotal,
+				_authWindow, _early + begin, n);
+		begin += n;
+	}
+}
+
+// 代理已经确认了的首批数据，换算到客户端的序号
+uint32_t TransTCP::_Connection::_clientAck() const {
+	if ((int32_t) (_proxyAck - _proxyOutTotal - _clientSeq) > 0)
+		return _proxyAck - _proxyOutTotal;
+	return _clientSeq;
 }
 
 void TransTCP::_Connection::commitAuthRequest(size_t bytes) {
@@ -184,31 +290,267 @@ void TransTCP::_Connection::commitAuthRequest(size_t bytes) {
 void TransTCP::_Connection::_authDispatchPacket(_From from,
 		Net::IPv4::TcpPacket& packet) THROWS {
 	Utils::Log::d("==> _authDispatchPacket");
-	if (from == FROM_PROXY && packet.getSeq() == _proxySeq + _proxyInTotal) {
+	if (from == FROM_CLIENT) {
+		if (_this->_optimistic && packet.getDataSize() > 0)
+			_bufferEarly(packet);
+	} else if (packet.getSeq() == _proxySeq + _proxyInTotal) {
+		if (packet.hasFlags(Net::IPv4::TcpPacket::FLAG_ACK))
+			_proxyAck = packet.getAck();
+		// 逐字节交给认证过程：乐观模式下应答后面可能紧跟着服务器的数据
+		const uint8_t* data = (const uint8_t*) packet.dataPtr();
 		size_t bytes = packet.getDataSize();
-		_proxyInTotal += bytes;
-		int r = _auth->onAuthResponse(packet.dataPtr(), bytes);
+		size_t used = 0;
+		int r = -1;
+		while (r < 0 && used < bytes) {
+			++_proxyInTotal;
+			r = _auth->onAuthResponse(data + used++, 1);
+		}
 		if (r >= 0) {
+			_mark(LatencyStats::MARK_AUTH_DONE);
 			delete _auth;
 			_auth = NULL;
 			if (r) {
-				_proxyWindowSize = packet.getWindowSize();
-				_state = STATE_ESTABLISHING;
-				_retryCount = 0;
-				_timer.setTimeout(0);
+				_via->onEstablished((Utils::nanoTime() - _stamp) / 1000);
+				_stopRace();
+				_authEstablished(packet, used);
 			} else {
 				Utils::Log::e("FAILED to connect %s --> %s:%u",
 						_addrPair.remote.toString().sz(), _hostname.sz(),
 						_addrPair.local.port);
-				_close();
+				_failOrHandOver();
 			}
 		}
 	}
 	Utils::Log::d("<== _authDispatchPacket");
 }
 
+// 代理应答完毕，packet中used之后的部分已是服务器的数据，转给客户端
+void TransTCP::_Connection::_authEstablished(Net::IPv4::TcpPacket& packet,
+		size_t used) THROWS {
+	_proxyWindowSize = packet.getWindowSize();
+	_state = STATE_ESTABLISHING;
+	_retryCount = 0;
+	_timer.post();
+	_raceTimer.clearTimeout();
+	const uint8_t* data = (const uint8_t*) packet.dataPtr();
+	size_t bytes = packet.getDataSize();
+	if (used < bytes)
+		_mark(LatencyStats::MARK_FIRST_DOWN);
+	for (size_t i = used, n; i < bytes; i += n) {
+		n = Utils::min(bytes - i, (size_t) 1400);
+		_sendPacket(FROM_PROXY, Net::IPv4::TcpPacket::FLAG_PSH,
+				_proxySeq + i - used, _clientAck(), _proxyWindowSize, data + i,
+				n);
+	}
+}
+
+void TransTCP::_Connection::_Racer::_send(int flags, uint32_t seq,
+		uint32_t ack, uint16_t windowSize, const void* data, size_t bytes)
+				THROWS {
+	Net::IPv4::TcpPacketBuffer out;
+	out.setFlags(flags | Net::IPv4::TcpPacket::FLAG_ACK);
+	out.setSeq(seq);
+	out.setAck(ack);
+	out.setWindowSize(windowSize);
+	if (bytes > 0) {
+		out.write(0, data, bytes);
+		out.setDataSize(bytes);
+	}
+	out.setSrcSockAddr(_agent);
+	out.setDestSockAddr(_proxy);
+	out.fillChecksum();
+	Utils::Log::d("_Racer::_send %s", out.toString().sz());
+	_conn->_shard->_ipv4->sendPacket(out);
+}
+
+// 用客户端SYN的副本，选项和ISN都与发给原上游的一样
+void TransTCP::_Connection::_Racer::_sendSYN() THROWS {
+	Net::IPv4::TcpPacket out(_conn->_syn, _conn->_synBytes);
+	out.setSrcSockAddr(_agent);
+	out.setDestSockAddr(_proxy);
+	out.setWindowSize(0);
+	out.fillChecksum();
+	_conn->_shard->_ipv4->sendPacket(out);
+}
+
+void TransTCP::_Connection::_Racer::_sendEarly(size_t begin, size_t end)
+		THROWS {
+	while (begin < end) {
+		size_t n = Utils::min(end - begin, (size_t) 1400);
+		_send(Net::IPv4::TcpPacket::FLAG_PSH,
+				_conn->_clientSeq + _requestEnd + begin, _seq + _inTotal,
+				_authWindow, _conn->_early + begin, n);
+		begin += n;
+	}
+}
+
+void TransTCP::_Connection::_Racer::sendAuthRequest(const void* data,
+		size_t bytes, size_t bufferSize, bool final) THROWS {
+	_send(Net::IPv4::TcpPacket::FLAG_PSH, _conn->_clientSeq + _outTotal,
+			_seq + _inTotal, bufferSize, data, bytes);
+	if (final) {
+		_requested = true;
+		_requestEnd = _outTotal + bytes;
+		_authWindow = bufferSize;
+		_sendEarly(0, _conn->_earlyBytes);
+	}
+}
+
+void TransTCP::_Connection::_RaceListener::onTimeout() THROWS {
+	_Racer* racer = _this->_racer;
+	if (racer == NULL) {
+		_this->_startRace();
+	} else if (racer->_retryCount++ < 3) {
+		if (!racer->_connected)
+			racer->_sendSYN();
+		else if (racer->_auth)
+			racer->_auth->sendAuthRequest();
+		_this->_raceTimer.setTimeout(RACE_RETRY);
+	}
+}
+
+// 只在等代理的阶段竞速，等客户端的阶段（SYN_RECEIVED）换上游也没用
+void TransTCP::_Connection::_startRace() THROWS {
+	if (_state != STATE_SYN_SENT && _state != STATE_AUTH)
+		return;
+	Upstream* via = _this->_upstreams->select(_via);
+	Net::IPv4::SockAddr agent;
+	if (via == NULL || !_shard->_allocAgentAddress(&agent, via->getAddr()))
+		return;
+	Utils::Log::i("Racing %s --> %s:%u via %s",
+			_addrPair.remote.toString().sz(), _hostname.sz(),
+			_addrPair.local.port, via->getURL());
+	_racer = new _Racer(this, agent, via, _state == STATE_SYN_SENT);
+	_shard->_addLeg(this, _racer->_proxy, agent);
+	via->onOpen();
+	via->onRace();
+	_racer->_sendSYN();
+	_raceTimer.setTimeout(RACE_RETRY);
+}
+
+void TransTCP::_Connection::_raceDispatchPacket(Net::IPv4::TcpPacket& packet)
+		THROWS {
+	_Racer* racer = _racer;
+	if (racer == NULL)
+		return;
+	if (packet.hasFlags(Net::IPv4::TcpPacket::FLAG_RST)) {
+		racer->_via->onFailed();
+		_dropRacer();
+		return;
+	}
+
+	if (!racer->_connected) {
+		if (!packet.hasFlags(
+				Net::IPv4::TcpPacket::FLAG_SYN | Net::IPv4::TcpPacket::FLAG_ACK)
+				|| packet.getAck() != _clientSeq)
+			return;
+		racer->_seq = packet.getSeq() + 1;
+		racer->_ack = _clientSeq;
+		if (racer->_synOnly && _state != STATE_SYN_SENT) {
+			_stopRace();
+			return;
+		}
+		if (racer->_synOnly) {
+			// 客户端还没见过任何SYN/ACK，换过去之后照常转发，
+			// 握手耗时由_transferSYN2()按竞速开始的时刻记到新上游上
+			_adoptRacer();
+			_transferSYN2(FROM_PROXY, packet);
+			return;
+		}
+		uint64_t now = Utils::nanoTime();
+		racer->_via->onConnected((now - racer->_stamp) / 1000);
+		racer->_stamp = now;
+		racer->_connected = true;
+		racer->_retryCount = 0;
+		racer->_send(0, _clientSeq, racer->_seq, 0);
+		racer->_auth = racer->_via->getAuthBuilder()->createInstance(
+				_hostname.sz(), _addrPair.local.port, racer);
+		racer->_auth->sendAuthRequest();
+		_raceTimer.setTimeout(RACE_RETRY);
+		return;
+	}
+
+	if (racer->_auth == NULL || packet.getSeq() != racer->_seq + racer->_inTotal)
+		return;
+	if (packet.hasFlags(Net::IPv4::TcpPacket::FLAG_ACK))
+		racer->_ack = packet.getAck();
+	const uint8_t* data = (const uint8_t*) packet.dataPtr();
+	size_t bytes = packet.getDataSize();
+	size_t used = 0;
+	int r = -1;
+	while (r < 0 && used < bytes) {
+		++racer->_inTotal;
+		r = racer->_auth->onAuthResponse(data + used++, 1);
+	}
+	if (r == 0) {
+		racer->_via->onFailed();
+		_stopRace();
+	} else if (r > 0 && _state != STATE_AUTH) {
+		_stopRace();
+	} else if (r > 0) {
+		_mark(LatencyStats::MARK_AUTH_DONE);
+		racer->_via->onEstablished(
+				(Utils::nanoTime() - racer->_stamp) / 1000);
+		_adoptRacer();
+		_authEstablished(packet, used);
+	}
+}
+
+// 竞速一方胜出：重置原上游那一路，之后的转发都改走竞速这一路
+void TransTCP::_Connection::_adoptRacer() THROWS {
+	_Racer* racer = _racer;
+	Utils::Log::i("Race won by %s for %s:%u", racer->_via->getURL(),
+			_hostname.sz(), _addrPair.local.port);
+	_sendPacket(FROM_CLIENT, Net::IPv4::TcpPacket::FLAG_RST,
+			_clientSeq + _proxyOutTotal, _proxySeq + _proxyInTotal, 0);
+	_shard->_removeLeg(_proxy, _agent);
+	_via->onClose();
+	_agent = racer->_agent;
+	_proxy = racer->_proxy;
+	_via = racer->_via;
+	_stamp = racer->_stamp;
+	if (!racer->_synOnly) {
+		// 客户端看到的仍是原上游的序号，差值并进_proxyInTotal里
+		_proxyInTotal = racer->_seq + racer->_inTotal - _proxySeq;
+		_proxyOutTotal = racer->_outTotal;
+		_proxyAck = racer->_ack;
+		_requestEnd = racer->_requestEnd;
+		_authWindow = racer->_authWindow;
+		_requested = racer->_requested;
+	}
+	if (_auth) {
+		delete _auth;
+		_auth = NULL;
+	}
+	_via->onRaceWon();
+	delete racer;
+	_racer = NULL;
+	_raceTimer.clearTimeout();
+	_handedOver = false;
+}
+
+// 竞速一方落败或连接要关了：重置那一路
+void TransTCP::_Connection::_stopRace() THROWS {
+	if (_racer == NULL)
+		return;
+	_racer->_send(Net::IPv4::TcpPacket::FLAG_RST,
+			_clientSeq + _racer->_outTotal, _racer->_seq + _racer->_inTotal,
+			0);
+	_dropRacer();
+}
+
+void TransTCP::_Connection::_dropRacer() {
+	if (_racer == NULL)
+		return;
+	_shard->_removeLeg(_racer->_proxy, _racer->_agent);
+	_racer->_via->onClose();
+	delete _racer;
+	_racer = NULL;
+	_raceTimer.clearTimeout();
+}
+
 void TransTCP::_Connection::_establishingSendRequest() THROWS {
-	_sendPacket(FROM_PROXY, 0, _proxySeq, _clientSeq, _proxyWindowSize);
+	_sendPacket(FROM_PROXY, 0, _proxySeq, _clientAck(), _proxyWindowSize);
 	_sendPacket(FROM_CLIENT, 0, _clientSeq + _proxyOutTotal,
 			_proxySeq + _proxyInTotal, _clientWindowSize);
 }
@@ -217,10 +559,12 @@ void TransTCP::_Connection::_establishingDispatchPacket(_From from,
 		Net::IPv4::TcpPacket& packet) THROWS {
 	Utils::Log::i("Connected %s --> %s:%u", _addrPair.remote.toString().sz(),
 			_hostname.sz(), _addrPair.local.port);
+	_mark(LatencyStats::MARK_ESTABLISHED);
 	_state = STATE_ESTABLISHED;
 }
 
 void TransTCP::_Connection::_closingSendRequest() THROWS {
+	_stopRace();
 	if (!_clientFin)
 		_sendPacket(FROM_PROXY, Net::IPv4::TcpPacket::FLAG_FIN, _proxySeq,
 				_clientSeq, _proxyWindowSize);
@@ -249,12 +593,39 @@ void TransTCP::_Connection::_closingDispatchPacket(_From from,
 void TransTCP::_Connection::_close() {
 	_state = STATE_CLOSING;
 	_retryCount = 0;
-	_timer.setTimeout(0);
+	_timer.post();
+}
+
+// 代理没连上或拒绝了请求，记到所用上游的失败次数上；
+// 已经交给竞速的，原上游在交出时记过了，这次算竞速那一路的
+void TransTCP::_Connection::_fail() {
+	if (!_handedOver)
+		_via->onFailed();
+	else if (_racer)
+		_racer->_via->onFailed();
+	_close();
+}
+
+// 原上游那一路失败或超时而竞速还在进行：不关连接，交给竞速一方，再给它一轮超时的时间
+bool TransTCP::_Connection::_handOver() {
+	if (_racer == NULL || _handedOver)
+		return false;
+	Utils::Log::i("Handing %s:%u over to %s", _hostname.sz(),
+			_addrPair.local.port, _racer->_via->getURL());
+	_handedOver = true;
+	_via->onFailed();
+	_timer.setTimeout(3000);
+	return true;
+}
+
+void TransTCP::_Connection::_failOrHandOver() {
+	if (!_handOver())
+		_fail();
 }
 
 void TransTCP::_Connection::_closed() {
 	_state = STATE_CLOSED;
-	_timer.setTimeout(0);
+	_timer.post();
 }
 
 void TransTCP::_Connection::_try(void (_Connection::*fn)(),
@@ -269,13 +640,17 @@ void TransTCP::_Connection::_try(void (_Connection::*fn)(),
 
 void TransTCP::_Connection::onTimeout() THROWS {
 	if (_state == STATE_SYN_SENT) {
-		_close();
+		_failOrHandOver();
 
 	} else if (_state == STATE_SYN_RECEIVED) {
 		_close();
 
 	} else if (_state == STATE_AUTH) {
-		_try(&_Connection::_authSendRequest, &_Connection::_close);
+		if (_handedOver)
+			_fail();
+		else
+			_try(&_Connection::_authSendRequest,
+					&_Connection::_failOrHandOver);
 
 	} else if (_state == STATE_ESTABLISHING) {
 		_try(&_Connection::_establishingSendRequest, &_Connection::_close);
@@ -297,51 +672,131 @@ void TransTCP::_Connection::onTimeout() THROWS {
 	}
 }
 
-Net::IPv4::SockAddr TransTCP::_allocAgentAddress() {
-	if (_agentAddr.port++ == AGENT_PORT_MAX) {
-		_agentAddr.port = AGENT_PORT_MIN;
-		++_agentAddr.ip;
-	}
-	return _agentAddr;
+void TransTCP::_Shard::_add(_Connection* conn) {
+	_lock.lock();
+	_flows.put(conn->_addrPair, conn);
+	_flows.put(Net::IPv4::SockAddrPair(conn->_proxy, conn->_agent), conn);
+	_lock.unlock();
+	_this->_countConnection();
 }
 
-void TransTCP::dispatchPacket(Net::IPv4::IpPacket& packet) THROWS {
-	if (Net::IPv4::TcpPacket::isValid(packet)) {
-		Net::IPv4::TcpPacket in = packet;
-		Net::IPv4::SockAddr src(in.getSrcAddr(), in.getSrcPort());
-		Net::IPv4::SockAddr dst(in.getDestAddr(), in.getDestPort());
-		Net::IPv4::SockAddrPair addr(src, dst);
+void TransTCP::_Shard::_add(_Splice* splice) {
+	_lock.lock();
+	_splices.put(splice->_addrPair, splice);
+	_lock.unlock();
+	_this->_countConnection();
+}
 
-		_Connection* conn;
-		const char* hostname;
+void TransTCP::_Shard::_remove(_Splice* splice) {
+	_lock.lock();
+	_splices.remove(splice->_addrPair);
+	_lock.unlock();
+	__sync_sub_and_fetch(&_this->_connCount, 1);
+}
 
-		if ((conn = *_addrPairMap.get(addr))) {
-			conn->dispatchPacket(_Connection::FROM_CLIENT, in);
+void TransTCP::_Shard::_addLeg(_Connection* conn,
+		const Net::IPv4::SockAddr& proxy, const Net::IPv4::SockAddr& agent) {
+	_lock.lock();
+	_flows.put(Net::IPv4::SockAddrPair(proxy, agent), conn);
+	_lock.unlock();
+}
+
+void TransTCP::_Shard::_removeLeg(const Net::IPv4::SockAddr& proxy,
+		const Net::IPv4::SockAddr& agent) {
+	_lock.lock();
+	_flows.remove(Net::IPv4::SockAddrPair(proxy, agent));
+	_lock.unlock();
+	_agents.free(agent);
+}
+
+void TransTCP::_Shard::_remove(_Connection* conn) {
+	_lock.lock();
+	_flows.remove(conn->_addrPair);
+	_flows.remove(Net::IPv4::SockAddrPair(conn->_proxy, conn->_agent));
+	_lock.unlock();
+	_agents.free(conn->_agent);
+	__sync_sub_and_fetch(&_this->_connCount, 1);
+}
+
+// 地址池只含端口号模分片数等于本分片序号的地址，见getShardOfAgent()
+bool TransTCP::_Shard::_allocAgentAddress(Net::IPv4::SockAddr* agent,
+		const Net::IPv4::SockAddr& proxy) {
+	for (uint32_t tries = _agents.getCapacity(); tries > 0; --tries) {
+		if (!_agents.alloc(agent))
+			return false;
+		if (_flows.get(Net::IPv4::SockAddrPair(proxy, *agent)) == NULL)
+			return true;
+		// 正常不会发生：地址仍被别的连接占用，放回隔离队列再试下一个
+		Utils::Log::w("Agent address %s is still in use!",
+				agent->toString().sz());
+		_agents.free(*agent);
+	}
+	return false;
+}
+
+void TransTCP::_Shard::_reset(Net::IPv4::TcpPacket& in) THROWS {
+	in.setFlags(Net::IPv4::TcpPacket::FLAG_RST);
+	uint32_t srcAddr = in.getSrcAddr();
+	uint32_t dstAddr = in.getDestAddr();
+	uint16_t srcPort = in.getSrcPort();
+	uint16_t dstPort = in.getDestPort();
+	in.setSrcAddr(dstAddr);
+	in.setDestAddr(srcAddr);
+	in.setSrcPort(dstPort);
+	in.setDestPort(srcPort);
+	_ipv4->sendPacket(in);
+}
+
+// 已有的流，或者发往虚拟IP的包（包括要回RST的）都算认领
+bool TransTCP::_Shard::dispatchTcpPacket(Net::IPv4::TcpPacket& in) THROWS {
+	Net::IPv4::SockAddr src(in.getSrcAddr(), in.getSrcPort());
+	Net::IPv4::SockAddr dst(in.getDestAddr(), in.getDestPort());
+	Net::IPv4::SockAddrPair addr(src, dst);
 
-		} else if ((conn = *_agentMap.get(addr.local))) {
-			conn->dispatchPacket(_Connection::FROM_PROXY, in);
+	_Connection* conn;
+	TcpConnection* term;
+	const char* hostname;
 
-		} else if ((hostname = _domainResolver->ddns(addr.local.ip))) {
+	if (_this->_splice) {
+		if ((term = _terminated.get(addr))) {
+			term->dispatchPacket(in);
+		} else if ((hostname = _this->_domainResolver->ddns(addr.local.ip))) {
 			if (in.hasFlags(Net::IPv4::TcpPacket::FLAG_SYN)
-					&& !in.hasFlags(Net::IPv4::TcpPacket::FLAG_ACK)) {
-				conn = new _Connection(this, addr.remote, addr.local,
-						_allocAgentAddress(), _proxy, hostname);
-				_maxConnCount = Utils::max(_maxConnCount, _addrPairMap.size());
-				conn->dispatchPacket(_Connection::FROM_CLIENT, in);
-			} else {
-				in.setFlags(Net::IPv4::TcpPacket::FLAG_RST);
-				uint32_t srcAddr = in.getSrcAddr();
-				uint32_t dstAddr = in.getDestAddr();
-				uint16_t srcPort = in.getSrcPort();
-				uint16_t dstPort = in.getDestPort();
-				in.setSrcAddr(dstAddr);
-				in.setDestAddr(srcAddr);
-				in.setSrcPort(dstPort);
-				in.setDestPort(srcPort);
-				_ipv4->sendPacket(in);
-			}
+					&& !in.hasFlags(Net::IPv4::TcpPacket::FLAG_ACK))
+				(new _Splice(this, addr, hostname))->dispatchPacket(in);
+			else
+				_reset(in);
+		} else {
+			return false;
 		}
+
+	} else if ((conn = _flows.get(addr))) {
+		conn->dispatchPacket(
+				conn->_addrPair == addr ? _Connection::FROM_CLIENT :
+				addr.local == conn->_agent ?
+						_Connection::FROM_PROXY : _Connection::FROM_RACER, in);
+
+	} else if ((hostname = _this->_domainResolver->ddns(addr.local.ip))) {
+		Net::IPv4::SockAddr agent;
+		Upstream* via;
+		if (!in.hasFlags(Net::IPv4::TcpPacket::FLAG_SYN)
+				|| in.hasFlags(Net::IPv4::TcpPacket::FLAG_ACK)) {
+			_reset(in);
+		} else if (!_allocAgentAddress(&agent,
+				(via = _this->_upstreams->select())->getAddr())) {
+			Utils::Log::w("Agent addresses exhausted, refused %s --> %s:%u",
+					addr.remote.toString().sz(), hostname, addr.local.port);
+			_reset(in);
+		} else {
+			conn = new _Connection(this, addr.remote, addr.local, agent, via,
+					hostname);
+			conn->dispatchPacket(_Connection::FROM_CLIENT, in);
+		}
+
+	} else {
+		return false;
 	}
+	return true;
 }
 
 class IpSetItem: public Utils::MapItem<uint32_t> {
@@ -376,63 +831,208 @@ bool TransTCP::onHttpRequest(Net::HttpRequest& request,
 				ips.add(new IpSetItem(client));
 			}
 		}
-		for (_ConnectionByAddrPair* item = _addrPairMap.min(); item; item =
-				_addrPairMap.bigger(item)) {
-			uint32_t ip = (*item)->_addrPair.remote.ip;
-			if (!ips.get(ip))
-				ips.add(new IpSetItem(ip));
+		for (size_t i = 0; i < _shardCount; ++i) {
+			_Shard* shard = _shards[i];
+			shard->_lock.lock();
+			size_t n;
+			const FlowTable<_Connection>::Entry* flows = shard->_flows.ordered(
+					&n);
+			for (size_t j = 0; j < n; ++j)
+				if (flows[j].key == flows[j].value->_addrPair) {
+					uint32_t ip = flows[j].key.remote.ip;
+					if (!ips.get(ip))
+						ips.add(new IpSetItem(ip));
+				}
+			const FlowTable<_Splice>::Entry* splices = shard->_splices.ordered(
+					&n);
+			for (size_t j = 0; j < n; ++j) {
+				uint32_t ip = splices[j].key.remote.ip;
+				if (!ips.get(ip))
+					ips.add(new IpSetItem(ip));
+			}
+			shard->_lock.unlock();
 		}
 
 		Utils::JSONArray* clients = new Utils::JSONArray();
-		for (IpSetItem* item = ips.min(); item; item = ips.bigger(item))
+		Utils::JSONArray* rates = new Utils::JSONArray();
+		for (IpSetItem* item = ips.min(); item; item = ips.bigger(item)) {
 			clients->put(Net::IPv4::ntoa(*item));
+			Shaper::ClientStats stats;
+			rates->put(
+					_getClientStats(*item, &stats) ?
+							(Utils::formatSize(stats.rate) + "/s").sz() : "");
+		}
 
 		Utils::JSONArray* conns = new Utils::JSONArray();
-		for (_ConnectionByAddrPair* item = _addrPairMap.min(); item; item =
-				_addrPairMap.bigger(item))
-			if ((*item)->_addrPair.remote.ip == client) {
-				Utils::JSONObject* conn = new Utils::JSONObject();
-				conns->put(conn);
-
-				Utils::String server = Utils::String::format("%s:%u",
-						(*item)->_hostname.sz(), (*item)->_addrPair.local.port);
-				conn->put("Server", server.sz());
-
-				conn->put("UpBytes", Utils::formatSize((*item)->_upBytes).sz());
-				conn->put("DownBytes",
-						Utils::formatSize((*item)->_downBytes).sz());
-
-				unsigned t = ::time(NULL) - (*item)->_time;
-				conn->put("ConnTime", Utils::formatTimeSpan(t).sz());
-
-				if ((*item)->_state == _Connection::STATE_SYN_SENT
-						|| (*item)->_state == _Connection::STATE_SYN_RECEIVED) {
-					conn->put("State", "Connecting");
-				} else if ((*item)->_state == _Connection::STATE_AUTH) {
-					conn->put("State", "Authorizing");
-				} else if ((*item)->_state == _Connection::STATE_ESTABLISHING
-						|| (*item)->_state == _Connection::STATE_ESTABLISHED) {
-					conn->put("State", "Connected");
-				} else if ((*item)->_state == _Connection::STATE_FIN_WAIT
-						|| (*item)->_state == _Connection::STATE_CLOSING) {
-					conn->put("State", "Closing");
-				} else if ((*item)->_state == _Connection::STATE_CLOSED) {
-					conn->put("State", "Closed");
-				} else {
-					Utils::String st = Utils::String::format("%u",
-							(*item)->_state);
-					conn->put("State", st.sz());
+		for (size_t i = 0; i < _shardCount; ++i) {
+			_Shard* shard = _shards[i];
+			shard->_lock.lock();
+			size_t n;
+			const FlowTable<_Connection>::Entry* flows = shard->_flows.ordered(
+					&n);
+			for (size_t j = 0; j < n; ++j) {
+				_Connection* item = flows[j].value;
+				if (flows[j].key == item->_addrPair
+						&& item->_addrPair.remote.ip == client) {
+					Utils::JSONObject* conn = new Utils::JSONObject();
+					conns->put(conn);
+
+					Utils::String server = Utils::String::format("%s:%u",
+							item->_hostname.sz(), item->_addrPair.local.port);
+					conn->put("Server", server.sz());
+					conn->put("Proxy", item->_via->getURL());
+
+					conn->put("UpBytes", Utils::formatSize(item->_upBytes).sz());
+					conn->put("DownBytes",
+							Utils::formatSize(item->_downBytes).sz());
+
+					unsigned t = ::time(NULL) - item->_time;
+					conn->put("ConnTime", Utils::formatTimeSpan(t).sz());
+
+					if (item->_state == _Connection::STATE_SYN_SENT
+							|| item->_state == _Connection::STATE_SYN_RECEIVED) {
+						conn->put("State", "Connecting");
+					} else if (item->_state == _Connection::STATE_AUTH) {
+						conn->put("State", "Authorizing");
+					} else if (item->_state == _Connection::STATE_ESTABLISHING
+							|| item->_state == _Connection::STATE_ESTABLISHED) {
+						conn->put("State", "Connected");
+					} else if (item->_state == _Connection::STATE_FIN_WAIT
+							|| item->_state == _Connection::STATE_CLOSING) {
+						conn->put("State", "Closing");
+					} else if (item->_state == _Connection::STATE_CLOSED) {
+						conn->put("State", "Closed");
+					} else {
+						Utils::String st = Utils::String::format("%u",
+								item->_state);
+						conn->put("State", st.sz());
+					}
 				}
 			}
+			const FlowTable<_Splice>::Entry* splices = shard->_splices.ordered(
+					&n);
+			for (size_t j = 0; j < n; ++j) {
+				_Splice* item = splices[j].value;
+				if (item->_addrPair.remote.ip == client) {
+					Utils::JSONObject* conn = new Utils::JSONObject();
+					conns->put(conn);
+
+					Utils::String server = Utils::String::format("%s:%u",
+							item->_hostname.sz(), item->_addrPair.local.port);
+					conn->put("Server", server.sz());
+					conn->put("Proxy", item->_via->getURL());
+					conn->put("UpBytes",
+							Utils::formatSize(item->_up._bytes).sz());
+					conn->put("DownBytes",
+							Utils::formatSize(item->_down._bytes).sz());
+					unsigned t = ::time(NULL) - item->_time;
+					conn->put("ConnTime", Utils::formatTimeSpan(t).sz());
+					conn->put("State", item->_stateName());
+					if (item->_clientSrtt) {
+						Utils::String rtt = Utils::String::format(
+								"%.1fms/%ums", item->_clientSrtt / 1000.0,
+								item->_clientRto / 1000);
+						conn->put("Rtt", rtt.sz());
+					}
+				}
+			}
+			shard->_lock.unlock();
+		}
 
 		response.put("Status", 0);
 		response.put("Message", "OK");
 		response.put("Clients", clients);
+		response.put("ClientRates", rates);
 		response.put("CurrentClient", Net::IPv4::ntoa(client));
+		Shaper::ClientStats stats;
+		if (_getClientStats(client, &stats)) {
+			response.put("Rate", (Utils::formatSize(stats.rate) + "/s").sz());
+			response.put("Queued", Utils::formatSize(stats.queued).sz());
+			response.put("Drops", (long long) stats.drops);
+		}
 		response.put("Connections", conns);
 		return true;
 	}
+	if (path == "/latency.json") {
+		Utils::JSONArray* upstreams = new Utils::JSONArray();
+		for (size_t i = 0; i < _upstreams->getCount(); ++i) {
+			Upstream* upstream = _upstreams->get(i);
+			Utils::JSONObject* item = new Utils::JSONObject();
+			item->put("URL", upstream->getURL());
+			upstream->getLatencyStats().toJSON(item);
+			upstreams->put(item);
+		}
+		Utils::JSONArray* ports = new Utils::JSONArray();
+		_portLatencyStats.toJSON(ports);
+		response.put("Status", 0);
+		response.put("Message", "OK");
+		response.put("Upstreams", upstreams);
+		response.put("Ports", ports);
+		return true;
+	}
 	return HttpService::onHttpRequest(request, response);
 }
 
+bool TransTCP::_getClientStats(uint32_t client, Shaper::ClientStats* stats) {
+	bool found = false;
+	stats->rate = 0;
+	stats->queued = 0;
+	stats->drops = 0;
+	for (size_t i = 0; i < _shardCount; ++i) {
+		Shaper::ClientStats s;
+		if (_shards[i]->_shaper
+				&& _shards[i]->_shaper->getClientStats(client, &s)) {
+			stats->rate += s.rate;
+			stats->queued += s.queued;
+			stats->drops += s.drops;
+			found = true;
+		}
+	}
+	return found;
+}
+
+// 各状态的连接数在加锁遍历连接表时现数，不在热路径上维护
+void TransTCP::writeMetrics(Utils::MetricsWriter& out) {
+	static const char* const NAT_STATES[] = { "closed", "syn_sent",
+			"syn_received", "auth", "establishing", "established", "fin_wait",
+			"closing" };
+	static const char* const SPLICE_STATES[] = { "connecting", "auth",
+			"established", "closing" };
+	size_t nat[sizeof(NAT_STATES) / sizeof(NAT_STATES[0])] = { 0 };
+	size_t splice[sizeof(SPLICE_STATES) / sizeof(SPLICE_STATES[0])] = { 0 };
+	for (size_t i = 0; i < _shardCount; ++i) {
+		_Shard* shard = _shards[i];
+		shard->_lock.lock();
+		size_t n;
+		const FlowTable<_Connection>::Entry* flows = shard->_flows.ordered(&n);
+		for (size_t j = 0; j < n; ++j)
+			if (flows[j].key == flows[j].value->_addrPair)
+				++nat[flows[j].value->_state];
+		const FlowTable<_Splice>::Entry* splices = shard->_splices.ordered(&n);
+		for (size_t j = 0; j < n; ++j)
+			++splice[splices[j].value->_state];
+		shard->_lock.unlock();
+	}
+	const char* const * names = _splice ? SPLICE_STATES : NAT_STATES;
+	const size_t* counts = _splice ? splice : nat;
+	size_t states = _splice ?
+			sizeof(SPLICE_STATES) / sizeof(SPLICE_STATES[0]) :
+			sizeof(NAT_STATES) / sizeof(NAT_STATES[0]);
+	for (size_t i = 0; i < states; ++i)
+		out.gauge("transproxy_tcp_flows", "Proxied TCP flows by state",
+				counts[i], Utils::MetricsWriter::label("state", names[i]));
+
+	out.counter("transproxy_tcp_up_bytes_total",
+			"Bytes relayed from clients to upstreams", getTotalUpBytes());
+	out.counter("transproxy_tcp_down_bytes_total",
+			"Bytes relayed from upstreams to clients", getTotalDownBytes());
+	out.gauge("transproxy_tcp_agent_addresses_in_use",
+			"Agent addresses currently bound to flows", getAgentPoolInUse());
+	out.gauge("transproxy_tcp_agent_addresses_quarantined",
+			"Released agent addresses waiting out TIME_WAIT",
+			getAgentPoolQuarantined());
+	_portLatencyStats.writeMetrics(out, "transproxy_port_stage_seconds",
+			"Connection lifecycle stage durations by destination port");
+}
+
 }
@@ -1,54 +1,51 @@
 #include <string.h>
 #include <time.h>
 #include "Base/Debug.h"
+#include "Base/Metrics.h"
+#include "Base/Mutex.h"
 #include "Base/Utils.h"
+#include "AgentPool.h"
 #include "DomainResolver.h"
+#include "FlowTable.h"
+#include "LatencyStats.h"
 #include "TcpConnection.h"
+#include "Upstreams.h"
 #include "ProxyAuth.h"
-#include "ProxyAuthHTTP.h"
-#include "ProxyAuthSock5.h"
 #include "HTTP.h"
 #include "IPv4.h"
+#include "PathMTU.h"
+#include "Shaper.h"
 
 #pragma once
 
 namespace TransProxy {
 
-class TransTCP: public IPv4Protocol,
-		public HttpService,
-		public DomainResolver::Rules {
+class TransTCP: public HttpService,
+		public DomainResolver::Rules,
+		public Utils::MetricsSource {
 	struct _Connection;
+	struct _Splice;
+	struct _Shard;
 
 	enum {
 		AGENT_PORT_MIN = 1025, AGENT_PORT_MAX = 65500
 	};
-
-	struct _ConnectionByAddrPair: Utils::MapItemPtr<
-			const Net::IPv4::SockAddrPair&, _Connection> {
-		_ConnectionByAddrPair(_Connection* p) :
-				Utils::MapItemPtr<const Net::IPv4::SockAddrPair&, _Connection>(
-						p) {
-		}
-		const Net::IPv4::SockAddrPair& getKey() const;
-		Utils::String getKeyString() const {
-			return getKey().toString();
-		}
-	};
-
-	struct _ConnectionByAgent: Utils::MapItemPtr<Net::IPv4::SockAddr,
-			_Connection> {
-		_ConnectionByAgent(_Connection* p) :
-				Utils::MapItemPtr<Net::IPv4::SockAddr, _Connection>(p) {
-		}
-		Net::IPv4::SockAddr getKey() const;
-		Utils::String getKeyString() const {
-			return getKey().toString();
-		}
+	// 释放的agent地址隔离这么多秒再复用，保证代理那边的TIME_WAIT已经结束
+	enum {
+		AGENT_QUARANTINE = 120
 	};
 
 	struct _Connection: Utils::TimerListener, ProxyAuthListener {
+		// 乐观模式下握手时给客户端开的窗口，也是代理应答前最多暂存的首批数据
+		enum {
+			OPTIMISTIC_WINDOW = 4096
+		};
+		// 竞速一方发出的SYN和请求没有回应时的重发间隔
+		enum {
+			RACE_RETRY = 1000
+		};
 		enum _From {
-			FROM_CLIENT, FROM_PROXY
+			FROM_CLIENT, FROM_PROXY, FROM_RACER
 		};
 		enum _State {
 			STATE_CLOSED,
@@ -60,13 +57,66 @@ class TransTCP: public IPv4Protocol,
 			STATE_FIN_WAIT,
 			STATE_CLOSING
 		};
+		// 竞速：原上游迟迟没有进展时，用新的agent地址和客户端的ISN同另一个上游握手。
+		// 原上游还没回SYN/ACK时（_synOnly），胜出的SYN/ACK直接转给客户端；
+		// 否则由这里独自完成握手和代理请求，胜出后把序号差并进_proxyInTotal
+		struct _Racer: ProxyAuthListener {
+			_Connection* _conn;
+			Net::IPv4::SockAddr _agent, _proxy;
+			Upstream* _via;
+			bool _synOnly, _connected, _requested;
+			int _retryCount;
+			uint32_t _seq, _ack;
+			size_t _inTotal, _outTotal, _requestEnd;
+			uint16_t _authWindow;
+			ProxyAuth* _auth;
+			uint64_t _stamp;
+
+			_Racer(_Connection* conn, Net::IPv4::SockAddr agent, Upstream* via,
+					bool synOnly) :
+					_conn(conn), _agent(agent), _proxy(via->getAddr()), _via(
+							via), _synOnly(synOnly), _connected(false), _requested(
+							false), _retryCount(0), _seq(0), _ack(0), _inTotal(
+							0), _outTotal(0), _requestEnd(0), _authWindow(0), _auth(
+							NULL), _stamp(Utils::nanoTime()) {
+			}
+			~_Racer() {
+				if (_auth)
+					delete _auth;
+			}
+
+			void _send(int flags, uint32_t seq, uint32_t ack,
+					uint16_t windowSize, const void* data = NULL,
+					size_t bytes = 0) THROWS;
+			void _sendSYN() THROWS;
+			void _sendEarly(size_t begin, size_t end) THROWS;
+
+			// ProxyAuthListener
+			void sendAuthRequest(const void* data, size_t bytes,
+					size_t bufferSize, bool final) THROWS;
+			void commitAuthRequest(size_t bytes) {
+				_outTotal += bytes;
+			}
+		};
+
+		struct _RaceListener: Utils::TimerListener {
+			_Connection* _this;
+			_RaceListener(_Connection* thiz) :
+					_this(thiz) {
+			}
+			void onTimeout() THROWS;
+			void onTimerError(Utils::Exception* e) THROWS {
+				THROW(e);
+			}
+		} _raceListener;
+
 		TransTCP* _this;
+		_Shard* _shard;
 		time_t _time;
 		Net::IPv4::SockAddrPair _addrPair;
 		Net::IPv4::SockAddr _agent, _proxy;
+		Upstream* _via;
 		Utils::String _hostname;
-		_ConnectionByAddrPair _addrPairItem;
-		_ConnectionByAgent _agentItem;
 		Utils::Timer _timer;
 		_State _state;
 		int _retryCount;
@@ -75,32 +125,66 @@ class TransTCP: public IPv4Protocol,
 		ProxyAuth* _auth;
 		size_t _proxyOutTotal, _proxyInTotal, _upBytes, _downBytes;
 		bool _clientEstablished, _proxyEstablished, _clientFin, _proxyFin;
+		// 乐观模式：客户端在代理应答之前发来的数据，跟在最后一个代理请求后面发出
+		uint8_t* _early;
+		size_t _earlyBytes, _requestEnd;
+		uint32_t _proxyAck;
+		uint16_t _authWindow;
+		bool _requested;
+		// 上一次状态变化的时刻（纳秒），用来测量握手和代理请求的耗时
+		uint64_t _stamp;
+		// 生命周期各时刻，见LatencyStats::Mark
+		uint64_t _marks[LatencyStats::MARK_COUNT];
+		// 竞速用：客户端SYN的副本（带着它的TCP选项），进行中的竞速
+		uint8_t* _syn;
+		size_t _synBytes;
+		_Racer* _racer;
+		Utils::Timer _raceTimer;
+		// 原上游那一路已失败或超时，连接交给了还在进行的竞速，之后原上游的包都不理
+		bool _handedOver;
 
-		_Connection(TransTCP* thiz, Net::IPv4::SockAddr client,
+		_Connection(_Shard* shard, Net::IPv4::SockAddr client,
 				Net::IPv4::SockAddr server, Net::IPv4::SockAddr agent,
-				Net::IPv4::SockAddr proxy, const char* hostname) :
-				_this(thiz), _time(::time(NULL)), _addrPair(client, server), _agent(
-						agent), _proxy(proxy), _hostname(hostname), _addrPairItem(
-						this), _agentItem(this), _timer("TransProxyConnection",
+				Upstream* via, const char* hostname) :
+				_raceListener(this), _this(shard->_this), _shard(shard), _time(::time(NULL)), _addrPair(client, server), _agent(
+						agent), _proxy(via->getAddr()), _via(via), _hostname(hostname), _timer("TransProxyConnection",
 						this), _state(STATE_CLOSED), _retryCount(0), _clientSeq(
 						0), _proxySeq(0), _clientWindowSize(0), _proxyWindowSize(
 						0), _auth(NULL), _proxyOutTotal(0), _proxyInTotal(0), _upBytes(
 						0), _downBytes(0), _clientEstablished(false), _proxyEstablished(
-						false), _clientFin(false), _proxyFin(false) {
-			_this->_addrPairMap.add(&_addrPairItem);
-			_this->_agentMap.add(&_agentItem);
+						false), _clientFin(false), _proxyFin(false), _early(NULL), _earlyBytes(
+						0), _requestEnd(0), _proxyAck(0), _authWindow(0), _requested(
+						false), _stamp(0), _syn(NULL), _synBytes(0), _racer(NULL), _raceTimer(
+						"TransProxyRace", &_raceListener), _handedOver(false) {
+			::memset(_marks, 0, sizeof(_marks));
+			_shard->_add(this);
+			_via->onOpen();
 		}
 		~_Connection() {
-			_this->_addrPairMap.remove(&_addrPairItem);
-			_this->_agentMap.remove(&_agentItem);
+			_mark(LatencyStats::MARK_CLOSED);
+			_this->_recordLatency(_via, _addrPair.local.port, _marks);
+			_shard->_remove(this);
+			_via->onClose();
 			if (_auth)
 				delete _auth;
+			if (_early)
+				delete[] _early;
+			_dropRacer();
+			if (_syn)
+				delete[] _syn;
+		}
+
+		void _mark(LatencyStats::Mark m) {
+			LatencyStats::mark(_marks, m);
 		}
 
 		void _sendPacket(_From from, int flags, uint32_t seq, uint32_t ack,
 				uint16_t windowSize, const void* data = NULL, size_t bytes = 0)
 						THROWS;
 		void _sendPacket(_From from, Net::IPv4::TcpPacket& packet) THROWS;
+		void _clampMss(Net::IPv4::TcpPacket& packet);
+		void _forwardPacket(_From from, Net::IPv4::TcpPacket& packet,
+				uint32_t seq, uint32_t ack, uint16_t windowSize) THROWS;
 
 		void _transferData(_From from, Net::IPv4::TcpPacket& packet) THROWS;
 		void _transferSYN1(_From from, Net::IPv4::TcpPacket& packet) THROWS;
@@ -112,6 +196,20 @@ class TransTCP: public IPv4Protocol,
 		void _authSendRequest() THROWS;
 		void _authDispatchPacket(_From from, Net::IPv4::TcpPacket& packet)
 				THROWS;
+		void _bufferEarly(Net::IPv4::TcpPacket& packet) THROWS;
+		void _sendEarly(size_t begin, size_t end) THROWS;
+		uint32_t _clientAck() const;
+
+		void _authEstablished(Net::IPv4::TcpPacket& packet, size_t used)
+				THROWS;
+
+		void _startRace() THROWS;
+		void _raceDispatchPacket(Net::IPv4::TcpPacket& packet) THROWS;
+		void _adoptRacer() THROWS;
+		void _stopRace() THROWS;
+		void _dropRacer();
+		bool _handOver();
+		void _failOrHandOver();
 
 		void _establishingSendRequest() THROWS;
 		void _establishingDispatchPacket(_From from,
@@ -125,6 +223,7 @@ class TransTCP: public IPv4Protocol,
 				THROWS;
 		void _close();
 		void _closed();
+		void _fail();
 
 		// Utils::TimerListener
 		void onTimeout() THROWS;
@@ -133,79 +232,409 @@ class TransTCP: public IPv4Protocol,
 		}
 
 		// TransProxyAuthListener
-		void sendAuthRequest(const void* data, size_t bytes, size_t bufferSize)
-				THROWS;
+		void sendAuthRequest(const void* data, size_t bytes, size_t bufferSize,
+				bool final) THROWS;
 		void commitAuthRequest(size_t bytes);
 	};
 
+	// splice引擎：客户端的TCP在本机用户态协议栈上终结，另开一个内核socket连代理，
+	// 两边之间按批搬运数据。广域网一侧因此用上内核的拥塞控制和大socket缓冲
+	struct _Splice: Net::TcpServerListener, ProxyAuthListener,
+			Utils::TimerListener {
+		enum {
+			PIPE_BUFFER = 16384
+		};
+		enum _State {
+			STATE_CONNECTING, STATE_AUTH, STATE_ESTABLISHED, STATE_CLOSING
+		};
+
+		// 单向搬运：从_from读一批，全部写进_to之后再读下一批
+		struct _Pipe {
+			Net::TcpConnection *_from, *_to;
+			uint8_t* _buf;
+			size_t _head, _tail;
+			uint64_t _bytes;
+			bool _eof;
+			_Pipe() :
+					_from(NULL), _to(NULL), _buf(new uint8_t[PIPE_BUFFER]), _head(
+							0), _tail(0), _bytes(0), _eof(false) {
+			}
+			~_Pipe() {
+				delete[] _buf;
+			}
+			bool pump(bool readable) THROWS;
+		};
+
+		struct _ClientListener: Net::TcpConnectionListener {
+			_Splice* _this;
+			_ClientListener(_Splice* thiz) :
+					_this(thiz) {
+			}
+			void onTcpConnected() THROWS {
+			}
+			void onTcpDisconnected() THROWS;
+			void onTcpToRecv() THROWS;
+			void onTcpToSend() THROWS;
+			void onTcpError(Utils::Exception* e) THROWS;
+		} _clientListener;
+
+		struct _ProxyListener: Net::TcpConnectionListener {
+			_Splice* _this;
+			_ProxyListener(_Splice* thiz) :
+					_this(thiz) {
+			}
+			void onTcpConnected() THROWS;
+			void onTcpDisconnected() THROWS;
+			void onTcpToRecv() THROWS;
+			void onTcpToSend() THROWS;
+			void onTcpError(Utils::Exception* e) THROWS;
+		} _proxyListener;
+
+		// 竞速：原上游迟迟没有完成认证时另开一条连接到别的上游，先完成的一方胜出
+		struct _Racer: Net::TcpConnectionListener, ProxyAuthListener {
+			_Splice* _this;
+			Upstream* _via;
+			Net::TcpConnection* _conn;
+			ProxyAuth* _auth;
+			uint64_t _stamp;
+			_Racer(_Splice* thiz, Upstream* via) :
+					_this(thiz), _via(via), _conn(NULL), _auth(NULL), _stamp(
+							Utils::nanoTime()) {
+			}
+			~_Racer() {
+				if (_auth)
+					delete _auth;
+			}
+
+			// Net::TcpConnectionListener
+			void onTcpConnected() THROWS;
+			void onTcpDisconnected() THROWS;
+			void onTcpToRecv() THROWS;
+			void onTcpToSend() THROWS {
+			}
+			void onTcpError(Utils::Exception* e) THROWS;
+
+			// ProxyAuthListener
+			void sendAuthRequest(const void* data, size_t bytes,
+					size_t bufferSize, bool final) THROWS;
+			void commitAuthRequest(size_t /* bytes */) {
+			}
+		};
+
+		struct _RaceListener: Utils::TimerListener {
+			_Splice* _this;
+			_RaceListener(_Splice* thiz) :
+					_this(thiz) {
+			}
+			void onTimeout() THROWS {
+				_this->_startRace();
+			}
+			void onTimerError(Utils::Exception* e) THROWS {
+				THROW(e);
+			}
+		} _raceListener;
+
+		TransTCP* _this;
+		_Shard* _shard;
+		time_t _time;
+		Net::IPv4::SockAddrPair _addrPair;
+		Utils::String _hostname;
+		Upstream* _via;
+		uint64_t _stamp;
+		TcpConnection* _client;
+		// 客户端连接最近的平滑RTT和重传超时，微秒；连接可能在别的线程释放，
+		// 由所属线程抄一份给tcpconn.json看
+		unsigned _clientSrtt, _clientRto;
+		Net::TcpConnection* _upstream;
+		ProxyAuth* _auth;
+		_Pipe _up, _down;
+		_State _state;
+		bool _clientReady, _pooled, _requested;
+		Utils::Timer _timer;
+		uint64_t _marks[LatencyStats::MARK_COUNT];
+		_Racer* _racer;
+		Utils::Timer _raceTimer;
+		// 原上游的连接已失败并关掉，等竞速那条连接完成认证
+		bool _handedOver;
+
+		_Splice(_Shard* shard, Net::IPv4::SockAddrPair addrPair,
+				const char* hostname) THROWS;
+		~_Splice();
+
+		void dispatchPacket(Net::IPv4::TcpPacket& packet) THROWS;
+
+		void _mark(LatencyStats::Mark m) {
+			LatencyStats::mark(_marks, m);
+		}
+		void _connectUpstream() THROWS;
+		bool _retryUnpooled() THROWS;
+		void _onAuthResponse() THROWS;
+		void _authEstablished() THROWS;
+		void _startRace() THROWS;
+		void _adoptRacer() THROWS;
+		void _stopRace();
+		bool _handOver();
+		void _start() THROWS;
+		void _pumpUp(bool readable) THROWS;
+		void _pumpDown(bool readable) THROWS;
+		const char* _stateName() const;
+		void _close();
+		void _fail();
+
+		// Net::TcpServerListener
+		Net::TcpConnectionListener* onTcpServerConnected(
+				Net::TcpConnection* conn) THROWS;
+		void onTcpServerError(Utils::Exception* e) THROWS;
+
+		// ProxyAuthListener
+		void sendAuthRequest(const void* data, size_t bytes, size_t bufferSize,
+				bool final) THROWS;
+		void commitAuthRequest(size_t /* bytes */) {
+		}
+
+		// Utils::TimerListener
+		void onTimeout() THROWS;
+		void onTimerError(Utils::Exception* e) THROWS {
+			THROW(e);
+		}
+	};
+
+	// 每个工作线程一个分片，连接的两个方向都落在同一分片上：
+	// 客户端方向按四元组散列选分片，分片只分配端口号模分片数等于自己序号的agent地址，
+	// 于是代理方向按agent端口就能找回同一分片。连接表只由所属线程修改，
+	// 加锁仅为了让HTTP线程能安全地遍历
+	struct _Shard: IPv4Protocol {
+		TransTCP* _this;
+		size_t _index;
+		IPv4* _ipv4;
+		Shaper* _shaper;
+		AgentPool _agents;
+		Utils::Mutex _lock;
+		// 每个连接占两项：客户端方向键为(client, server)，代理方向键为(proxy, agent)
+		FlowTable<_Connection> _flows;
+		// splice引擎：按客户端四元组登记的会话，以及本机终结的客户端TCP连接
+		FlowTable<_Splice> _splices;
+		TcpConnections _terminated;
+		// 32位目标上64位的累加不是原子的，HTTP线程读到的可能是一半，读写都加_statsLock
+		Utils::Mutex _statsLock;
+		uint64_t _totalUpBytes, _totalDownBytes;
+
+		_Shard(TransTCP* thiz, size_t index) :
+				IPv4Protocol(IPPROTO_TCP), _this(thiz), _index(index), _ipv4(NULL), _shaper(NULL), _agents(
+						thiz->_agentIpMin, thiz->_agentIpMax, AGENT_PORT_MIN,
+						AGENT_PORT_MAX, thiz->_shardCount, index, AGENT_QUARANTINE), _totalUpBytes(
+						0), _totalDownBytes(0) {
+		}
+
+		void _addBytes(uint64_t up, uint64_t down) {
+			_statsLock.lock();
+			_totalUpBytes += up;
+			_totalDownBytes += down;
+			_statsLock.unlock();
+		}
+		void _add(_Connection* conn);
+		void _remove(_Connection* conn);
+		void _add(_Splice* splice);
+		void _remove(_Splice* splice);
+		// 竞速时一个连接在代理方向多出的一路
+		void _addLeg(_Connection* conn, const Net::IPv4::SockAddr& proxy,
+				const Net::IPv4::SockAddr& agent);
+		void _removeLeg(const Net::IPv4::SockAddr& proxy,
+				const Net::IPv4::SockAddr& agent);
+		bool _allocAgentAddress(Net::IPv4::SockAddr* agent,
+				const Net::IPv4::SockAddr& proxy);
+		void _reset(Net::IPv4::TcpPacket& packet) THROWS;
+
+		// IPv4Protocol
+		bool dispatchTcpPacket(Net::IPv4::TcpPacket& packet) THROWS;
+	};
+
 	friend struct _Connection;
+	friend struct _Splice;
+	friend struct _Shard;
 
-	IPv4* _ipv4;
-	Net::IPv4::SockAddr _agentAddr;
+	uint32_t _agentIpMin, _agentIpMax;
 	DomainResolver* _domainResolver;
-	Net::IPv4::SockAddr _proxy;
-	ProxyAuthBuilder* _authBuilder;
-	Utils::Map<const Net::IPv4::SockAddrPair&, _ConnectionByAddrPair> _addrPairMap;
-	Utils::Map<Net::IPv4::SockAddr, _ConnectionByAgent> _agentMap;
-	uint64_t _totalUpBytes, _totalDownBytes;
-	size_t _maxConnCount;
+	Upstreams* _upstreams;
+	PathMTU* _pathMtu;
+	// splice引擎终结客户端TCP时收发缓冲区的上限
+	size_t _clientSendBuffer, _clientRecvBuffer;
+	_Shard** _shards;
+	size_t _shardCount;
+	bool _splice, _optimistic, _race;
+	size_t _connCount, _maxConnCount;
+	PortLatencyStats _portLatencyStats;
 
-	Net::IPv4::SockAddr _allocAgentAddress();
+	// 各分片线程都会增减连接数，峰值用CAS更新，免得较小的值覆盖掉较大的
+	void _countConnection() {
+		size_t n = __sync_add_and_fetch(&_connCount, 1);
+		size_t max;
+		while (n > (max = _maxConnCount)
+				&& !__sync_bool_compare_and_swap(&_maxConnCount, max, n))
+			;
+	}
+
+	void _recordLatency(Upstream* via, uint16_t port, const uint64_t* marks) {
+		via->getLatencyStats().record(marks);
+		_portLatencyStats.record(port, marks);
+	}
+	// 客户端在各分片出口整形上的统计之和，没有整形时返回false
+	bool _getClientStats(uint32_t client, Shaper::ClientStats* stats);
 
 public:
-	TransTCP(IPv4* ipv4, const char* agentIpBase,
-			DomainResolver* domainResolver, const char* proxy,
-			const char* clientIP) :
-			_ipv4(ipv4), _agentAddr(Net::IPv4::aton(agentIpBase),
-					AGENT_PORT_MIN - 1), _domainResolver(domainResolver), _totalUpBytes(
-					0), _totalDownBytes(0), _maxConnCount(0) THROWS {
+	TransTCP(const char* agentMin, const char* agentMax,
+			DomainResolver* domainResolver, Upstreams* upstreams,
+			size_t shardCount = 1, bool splice = false, size_t upstreamPool = 0,
+			bool optimistic = false, bool race = false) :
+			_agentIpMin(Net::IPv4::aton(agentMin)), _agentIpMax(
+					Net::IPv4::aton(agentMax)), _domainResolver(
+					domainResolver), _upstreams(upstreams), _pathMtu(NULL), _clientSendBuffer(
+					65536), _clientRecvBuffer(65536), _shardCount(
+					shardCount), _splice(splice), _optimistic(optimistic), _race(
+					race && upstreams->getCount() > 1), _connCount(
+					0), _maxConnCount(0) THROWS {
 		Utils::Log::i("TransTCP initializing...");
-		const char* p = ::strstr(proxy, "://");
-		THROW_IF(p == NULL, new Utils::Exception("Invalid proxy url!"));
-		_proxy = Net::IPv4::SockAddr(p + 3);
-		if (::strncmp(proxy, "http://", 7) == 0) {
-			_authBuilder = new ProxyAuthHTTP::Builder();
-		} else if (::strncmp(proxy, "sock://", 7) == 0
-				|| ::strncmp(proxy, "socks://", 8) == 0
-				|| ::strncmp(proxy, "sock5://", 8) == 0) {
-			_authBuilder = new ProxyAuthSock5::Builder();
-		} else {
-			THROW(new Utils::Exception("Only HTTP or SOCK5 proxy supported!"));
-		}
-		if ((_proxy.ip >> 24) == 127)
-			_proxy.ip = Net::IPv4::aton(clientIP);
+		_shards = new _Shard*[_shardCount];
+		for (size_t i = 0; i < _shardCount; ++i)
+			_shards[i] = new _Shard(this, i);
+		// 只有SOCKS5有可以提前做掉的问候，HTTP代理的CONNECT本身就是第一个请求
+		if (_splice && upstreamPool > 0)
+			for (size_t i = 0; i < _upstreams->getCount(); ++i)
+				if (_upstreams->get(i)->isSock5())
+					_upstreams->get(i)->createPools(_shardCount,
+							(upstreamPool + _shardCount - 1) / _shardCount);
 	}
 	virtual ~TransTCP() {
 		Utils::Log::e("~TransTCP");
 	}
 
+	// 把第index个分片绑定到所在工作线程的IPv4（及其出口整形）上，
+	// 返回值交给该IPv4的addProtocol()
+	IPv4Protocol* bindShard(size_t index, IPv4* ipv4, Shaper* shaper = NULL) {
+		_shards[index]->_ipv4 = ipv4;
+		_shards[index]->_shaper = shaper;
+		return _shards[index];
+	}
+	// 设了就按到代理的路径MTU压小握手里的MSS，要在收包之前设好
+	void setPathMTU(PathMTU* pathMtu) {
+		_pathMtu = pathMtu;
+	}
+	// splice引擎里客户端连接收发缓冲区的上限，要在收包之前设好
+	void setClientBuffers(size_t sendBuffer, size_t recvBuffer) {
+		_clientSendBuffer = sendBuffer;
+		_clientRecvBuffer = recvBuffer;
+	}
+	size_t getShardCount() const {
+		return _shardCount;
+	}
+	// 客户端方向的包（客户端->VIP）该由哪个分片处理：只按客户端IP分，
+	// 同一客户端的连接都在一个分片上，限速的令牌桶也就只在一处
+	size_t getShardOfClient(const Net::IPv4::SockAddrPair& addr) const {
+		if (_shardCount == 1)
+			return 0;
+		uint32_t h = addr.remote.ip;
+		h ^= h >> 16;
+		h *= 0x45D9F3B;
+		h ^= h >> 16;
+		return h % _shardCount;
+	}
+	// 代理方向的包（代理->agent）该由哪个分片处理
+	size_t getShardOfAgent(const Net::IPv4::SockAddr& agent) const {
+		return agent.port % _shardCount;
+	}
+
 	size_t getConnectionCount() const {
-		return _addrPairMap.size();
+		return _connCount;
 	}
 	size_t getMaxConnectionCount() const {
 		return _maxConnCount;
 	}
+	// 各分片的计数由各自线程累加，这里读到的可能略有滞后
 	uint64_t getTotalUpBytes() const {
-		return _totalUpBytes;
+		uint64_t n = 0;
+		for (size_t i = 0; i < _shardCount; ++i) {
+			_shards[i]->_statsLock.lock();
+			n += _shards[i]->_totalUpBytes;
+			_shards[i]->_statsLock.unlock();
+		}
+		return n;
 	}
 	uint64_t getTotalDownBytes() const {
-		return _totalDownBytes;
+		uint64_t n = 0;
+		for (size_t i = 0; i < _shardCount; ++i) {
+			_shards[i]->_statsLock.lock();
+			n += _shards[i]->_totalDownBytes;
+			_shards[i]->_statsLock.unlock();
+		}
+		return n;
 	}
 
-	// IPv4Protocol
-	void dispatchPacket(Net::IPv4::IpPacket& packet) THROWS;
+	// agent地址池，各分片合计
+	uint64_t getAgentPoolCapacity() const {
+		uint64_t n = 0;
+		for (size_t i = 0; i < _shardCount; ++i)
+			n += _shards[i]->_agents.getCapacity();
+		return n;
+	}
+	uint64_t getAgentPoolInUse() const {
+		uint64_t n = 0;
+		for (size_t i = 0; i < _shardCount; ++i)
+			n += _shards[i]->_agents.getInUse();
+		return n;
+	}
+	uint64_t getAgentPoolQuarantined() const {
+		uint64_t n = 0;
+		for (size_t i = 0; i < _shardCount; ++i)
+			n += _shards[i]->_agents.getQuarantined();
+		return n;
+	}
+	uint64_t getAgentPoolFailures() const {
+		uint64_t n = 0;
+		for (size_t i = 0; i < _shardCount; ++i)
+			n += _shards[i]->_agents.getFailures();
+		return n;
+	}
+
+	// 预热的上游连接池，各上游、各分片合计
+	uint64_t getUpstreamPoolIdle() const {
+		uint64_t n = 0;
+		for (size_t i = 0; i < _upstreams->getCount(); ++i)
+			for (size_t j = 0; j < _shardCount; ++j)
+				if (_upstreams->get(i)->getPool(j))
+					n += _upstreams->get(i)->getPool(j)->getIdle();
+		return n;
+	}
+	uint64_t getUpstreamPoolHits() const {
+		uint64_t n = 0;
+		for (size_t i = 0; i < _upstreams->getCount(); ++i)
+			for (size_t j = 0; j < _shardCount; ++j)
+				if (_upstreams->get(i)->getPool(j))
+					n += _upstreams->get(i)->getPool(j)->getHits();
+		return n;
+	}
+	uint64_t getUpstreamPoolMisses() const {
+		uint64_t n = 0;
+		for (size_t i = 0; i < _upstreams->getCount(); ++i)
+			for (size_t j = 0; j < _shardCount; ++j)
+				if (_upstreams->get(i)->getPool(j))
+					n += _upstreams->get(i)->getPool(j)->getMisses();
+		return n;
+	}
 
 	// DomainResolver::Rules
 	bool acceptProxy(uint32_t client, const char* hostname) const {
 		return false;
 	}
 	bool denyProxy(uint32_t client, const char* hostname) const {
-		return client == _proxy.ip;
+		return _upstreams->contains(client);
 	}
 
 	// HttpService
 	bool onHttpRequest(Net::HttpRequest& request, Utils::JSONObject& response)
 			THROWS;
+
+	// Utils::MetricsSource
+	void writeMetrics(Utils::MetricsWriter& out);
 };
 
 }
@@ -0,0 +1,525 @@
+#define LOG_TAG  "TransTCP"
+
+#include "Base/Debug.h"
+#include "Base/Utils.h"
+#include "Net/SocketConnection.h"
+#include "TransTCP.h"
+
+namespace TransProxy {
+
+// 返回false表示这个方向已经结束：_from关闭且缓冲里的数据都已写出
+bool TransTCP::_Splice::_Pipe::pump(bool readable) THROWS {
+	for (;;) {
+		if (_head < _tail) {
+			size_t n = _to->send(_buf + _head, _tail - _head);
+			_head += n;
+			_bytes += n;
+			if (_head < _tail) {
+				_to->waitToSend();
+				return true;
+			}
+		}
+		_head = _tail = 0;
+		if (_eof)
+			return false;
+		size_t n = _from->recv(_buf, PIPE_BUFFER);
+		if (n == 0) {
+			// 刚报告可读却一个字节也读不到，说明对端已经关闭
+			if (readable) {
+				_eof = true;
+				return false;
+			}
+			_from->waitToRecv();
+			return true;
+		}
+		readable = false;
+		_tail = n;
+	}
+}
+
+void TransTCP::_Splice::_ClientListener::onTcpDisconnected() THROWS {
+	_this->_mark(LatencyStats::MARK_FIN);
+	_this->_client = NULL;
+	_this->_up._eof = true;
+	if (_this->_state == STATE_ESTABLISHED)
+		_this->_pumpUp(false);
+	else
+		_this->_close();
+}
+
+void TransTCP::_Splice::_ClientListener::onTcpToRecv() THROWS {
+	_this->_pumpUp(true);
+}
+
+void TransTCP::_Splice::_ClientListener::onTcpToSend() THROWS {
+	_this->_pumpDown(false);
+}
+
+void TransTCP::_Splice::_ClientListener::onTcpError(Utils::Exception* e)
+		THROWS {
+	e->print();
+	delete e;
+	_this->_close();
+}
+
+void TransTCP::_Splice::_ProxyListener::onTcpConnected() THROWS {
+	uint64_t now = Utils::nanoTime();
+	if (!_this->_pooled) {
+		_this->_mark(LatencyStats::MARK_SYN_ACK);
+		_this->_via->onConnected((now - _this->_stamp) / 1000);
+	}
+	_this->_stamp = now;
+	_this->_mark(LatencyStats::MARK_AUTH_SENT);
+	_this->_state = STATE_AUTH;
+	if (_this->_this->_race && _this->_racer == NULL)
+		_this->_raceTimer.setTimeout(_this->_via->getRaceDelay(true));
+	_this->_auth = _this->_via->getAuthBuilder()->createInstance(
+			_this->_hostname.sz(), _this->_addrPair.local.port, _this,
+			_this->_pooled);
+	if (_this->_pooled) {
+		// 池里的连接可能已被代理重置，发送失败就换新连接
+		bool failed = false;
+		TRY{
+			_this->_auth->sendAuthRequest();
+		}CATCH(e){
+			e->print();
+			failed = true;
+		}
+		if (failed) {
+			if (!_this->_retryUnpooled())
+				_this->_close();
+			return;
+		}
+	} else {
+		_this->_auth->sendAuthRequest();
+	}
+	if (_this->_state == STATE_AUTH)
+		_this->_upstream->waitToRecv();
+}
+
+// 代理发来FIN时socket里可能还有没读完的数据，当作可读处理，
+// 一直读到recv()返回0才算结束，免得丢掉下载的尾巴
+void TransTCP::_Splice::_ProxyListener::onTcpDisconnected() THROWS {
+	if (_this->_state == STATE_ESTABLISHED && _this->_client) {
+		_this->_pumpDown(true);
+	} else if (!_this->_retryUnpooled() && !_this->_handOver()) {
+		_this->_close();
+	}
+}
+
+void TransTCP::_Splice::_ProxyListener::onTcpToRecv() THROWS {
+	if (_this->_state == STATE_AUTH)
+		_this->_onAuthResponse();
+	else
+		_this->_pumpDown(true);
+}
+
+void TransTCP::_Splice::_ProxyListener::onTcpToSend() THROWS {
+	// 从池里取来的连接早已连上，第一次可写时照常开始认证
+	if (_this->_state == STATE_CONNECTING)
+		onTcpConnected();
+	else
+		_this->_pumpUp(false);
+}
+
+void TransTCP::_Splice::_ProxyListener::onTcpError(Utils::Exception* e)
+		THROWS {
+	e->print();
+	delete e;
+	if (!_this->_retryUnpooled() && !_this->_handOver())
+		_this->_close();
+}
+
+void TransTCP::_Splice::_Racer::onTcpConnected() THROWS {
+	uint64_t now = Utils::nanoTime();
+	_via->onConnected((now - _stamp) / 1000);
+	_stamp = now;
+	_auth = _via->getAuthBuilder()->createInstance(_this->_hostname.sz(),
+			_this->_addrPair.local.port, this);
+	_auth->sendAuthRequest();
+	_conn->waitToRecv();
+}
+
+void TransTCP::_Splice::_Racer::onTcpDisconnected() THROWS {
+	_via->onFailed();
+	_this->_stopRace();
+}
+
+void TransTCP::_Splice::_Racer::onTcpToRecv() THROWS {
+	uint8_t buf[1024];
+	size_t n = _conn->peek(buf, sizeof(buf));
+	if (n == 0 || _auth == NULL) {
+		_via->onFailed();
+		_this->_stopRace();
+		return;
+	}
+	size_t used = 0;
+	int r = -1;
+	while (r < 0 && used < n)
+		r = _auth->onAuthResponse(buf + used++, 1);
+	_conn->recv(buf, used);
+	if (r < 0) {
+		_conn->waitToRecv();
+	} else if (r == 0) {
+		_via->onFailed();
+		_this->_stopRace();
+	} else {
+		_via->onEstablished((Utils::nanoTime() - _stamp) / 1000);
+		_this->_mark(LatencyStats::MARK_AUTH_DONE);
+		_this->_adoptRacer();
+	}
+}
+
+void TransTCP::_Splice::_Racer::onTcpError(Utils::Exception* e) THROWS {
+	e->print();
+	delete e;
+	_via->onFailed();
+	_this->_stopRace();
+}
+
+// 发不出去的请求不用管，连接出错时会收到onTcpError()或onTcpDisconnected()
+void TransTCP::_Splice::_Racer::sendAuthRequest(const void* data,
+		size_t bytes, size_t /* bufferSize */, bool /* final */) THROWS {
+	_conn->send(data, bytes);
+}
+
+TransTCP::_Splice::_Splice(_Shard* shard, Net::IPv4::SockAddrPair addrPair,
+		const char* hostname) :
+		_clientListener(this), _proxyListener(this), _raceListener(this), _this(
+				shard->_this), _shard(
+				shard), _time(::time(NULL)), _addrPair(addrPair), _hostname(
+				hostname), _via(shard->_this->_upstreams->select()), _stamp(0), _client(
+				NULL), _clientSrtt(0), _clientRto(0), _upstream(NULL), _auth(NULL), _state(
+				STATE_CONNECTING), _clientReady(false), _pooled(false), _requested(
+				false), _timer("TransProxySplice", this), _racer(NULL), _raceTimer(
+				"TransProxyRace", &_raceListener), _handedOver(false) THROWS {
+	::memset(_marks, 0, sizeof(_marks));
+	_mark(LatencyStats::MARK_SYN);
+	UpstreamPool* pool = _via->getPool(_shard->_index);
+	if (pool)
+		_upstream = pool->acquire(&_proxyListener);
+	if (_upstream) {
+		_pooled = true;
+		_up._to = _down._from = _upstream;
+		_upstream->waitToSend();
+	} else {
+		_connectUpstream();
+	}
+	_client = new TcpConnection(&_shard->_terminated, _shard->_ipv4,
+			_this->_clientSendBuffer, _this->_clientRecvBuffer);
+	_client->accept(_addrPair, this);
+	_up._from = _down._to = _client;
+	_shard->_add(this);
+	_via->onOpen();
+	_timer.setTimeout(10000);
+	// 池里的连接已经连上，只剩代理请求这一段可比
+	if (_this->_race)
+		_raceTimer.setTimeout(_via->getRaceDelay(_pooled));
+}
+
+TransTCP::_Splice::~_Splice() {
+	_mark(LatencyStats::MARK_CLOSED);
+	_this->_recordLatency(_via, _addrPair.local.port, _marks);
+	_shard->_remove(this);
+	_via->onClose();
+	if (_auth)
+		delete _auth;
+}
+
+void TransTCP::_Splice::dispatchPacket(Net::IPv4::TcpPacket& packet) THROWS {
+	_client->dispatchPacket(packet);
+}
+
+void TransTCP::_Splice::_connectUpstream() THROWS {
+	_upstream = new Net::SocketConnection(&_proxyListener);
+	_stamp = Utils::nanoTime();
+	_upstream->connect(_via->getAddr());
+	_up._to = _down._from = _upstream;
+}
+
+// 池里的连接可能在闲置时已被代理关掉，还没建立就断了的换一条新连接重来
+bool TransTCP::_Splice::_retryUnpooled() THROWS {
+	// 乐观模式下已经写进旧连接的客户端数据找不回来了，只能放弃
+	if (!_pooled || _state == STATE_ESTABLISHED || _state == STATE_CLOSING
+			|| _up._bytes > 0)
+		return false;
+	Utils::Log::w("Pooled upstream for %s:%u is stale, reconnecting",
+			_hostname.sz(), _addrPair.local.port);
+	_pooled = false;
+	if (_auth) {
+		delete _auth;
+		_auth = NULL;
+	}
+	_upstream->close();
+	_state = STATE_CONNECTING;
+	_requested = false;
+	_connectUpstream();
+	return true;
+}
+
+void TransTCP::_Splice::_onAuthResponse() THROWS {
+	uint8_t buf[1024];
+	size_t n = _upstream->peek(buf, sizeof(buf));
+	if (n == 0) {
+		if (_retryUnpooled())
+			return;
+		Utils::Log::e("Proxy closed while connecting %s --> %s:%u",
+				_addrPair.remote.toString().sz(), _hostname.sz(),
+				_addrPair.local.port);
+		if (!_handOver())
+			_fail();
+		return;
+	}
+
+	// 逐字节交给认证过程，握手应答后面紧跟的数据原样留在socket里
+	size_t used = 0;
+	int r = -1;
+	while (r < 0 && used < n && _state == STATE_AUTH)
+		r = _auth->onAuthResponse(buf + used++, 1);
+	if (_state != STATE_AUTH)
+		return;
+	_upstream->recv(buf, used);
+
+	if (r < 0) {
+		_upstream->waitToRecv();
+		return;
+	}
+	_mark(LatencyStats::MARK_AUTH_DONE);
+	delete _auth;
+	_auth = NULL;
+	if (r == 0) {
+		Utils::Log::e("FAILED to connect %s --> %s:%u",
+				_addrPair.remote.toString().sz(), _hostname.sz(),
+				_addrPair.local.port);
+		if (!_handOver())
+			_fail();
+		return;
+	}
+	_via->onEstablished((Utils::nanoTime() - _stamp) / 1000);
+	_stopRace();
+	_authEstablished();
+}
+
+void TransTCP::_Splice::_authEstablished() THROWS {
+	_state = STATE_ESTABLISHED;
+	// 客户端那边还没握手完成就让超时继续计着
+	if (_clientReady) {
+		_timer.clearTimeout();
+		_start();
+	}
+}
+
+// 乐观模式下客户端数据已经写进原上游的就不能再换了
+void TransTCP::_Splice::_startRace() THROWS {
+	if ((_state != STATE_CONNECTING && _state != STATE_AUTH) || _racer
+			|| _up._bytes > 0)
+		return;
+	Upstream* via = _this->_upstreams->select(_via);
+	if (via == NULL)
+		return;
+	Utils::Log::i("Racing %s --> %s:%u via %s",
+			_addrPair.remote.toString().sz(), _hostname.sz(),
+			_addrPair.local.port, via->getURL());
+	_racer = new _Racer(this, via);
+	via->onOpen();
+	via->onRace();
+	bool failed = false;
+	TRY{
+		_racer->_conn = new Net::SocketConnection(_racer);
+		_racer->_conn->connect(via->getAddr());
+	}CATCH(e){
+		e->print();
+		failed = true;
+	}
+	if (failed)
+		_stopRace();
+}
+
+// 竞速一方完成了认证：关掉原上游的连接，之后都走竞速这条
+void TransTCP::_Splice::_adoptRacer() THROWS {
+	_Racer* racer = _racer;
+	if ((_state != STATE_CONNECTING && _state != STATE_AUTH)
+			|| _up._bytes > 0) {
+		_stopRace();
+		return;
+	}
+	Utils::Log::i("Race won by %s for %s:%u", racer->_via->getURL(),
+			_hostname.sz(), _addrPair.local.port);
+	if (_upstream)
+		_upstream->close();
+	if (_auth) {
+		delete _auth;
+		_auth = NULL;
+	}
+	_via->onClose();
+	_via = racer->_via;
+	_via->onRaceWon();
+	_upstream = racer->_conn;
+	_upstream->setListener(&_proxyListener);
+	_up._to = _down._from = _upstream;
+	_pooled = false;
+	_handedOver = false;
+	_racer = NULL;
+	delete racer;
+	_raceTimer.clearTimeout();
+	_authEstablished();
+}
+
+void TransTCP::_Splice::_stopRace() {
+	_raceTimer.clearTimeout();
+	if (_racer == NULL)
+		return;
+	if (_racer->_conn)
+		_racer->_conn->close();
+	_racer->_via->onClose();
+	delete _racer;
+	_racer = NULL;
+}
+
+// 原上游的连接失败而竞速还在进行：关掉原连接，把会话交给竞速一方，再给它一轮超时的时间
+bool TransTCP::_Splice::_handOver() {
+	if (_racer == NULL || _handedOver || _state == STATE_ESTABLISHED
+			|| _state == STATE_CLOSING || _up._bytes > 0)
+		return false;
+	Utils::Log::i("Handing %s:%u over to %s", _hostname.sz(),
+			_addrPair.local.port, _racer->_via->getURL());
+	_handedOver = true;
+	_via->onFailed();
+	if (_auth) {
+		delete _auth;
+		_auth = NULL;
+	}
+	_upstream->close();
+	_upstream = _up._to = _down._from = NULL;
+	_requested = false;
+	_timer.setTimeout(3000);
+	return true;
+}
+
+void TransTCP::_Splice::_start() THROWS {
+	Utils::Log::i("Spliced %s --> %s:%u", _addrPair.remote.toString().sz(),
+			_hostname.sz(), _addrPair.local.port);
+	_mark(LatencyStats::MARK_ESTABLISHED);
+	_pumpUp(false);
+	_pumpDown(false);
+}
+
+void TransTCP::_Splice::_pumpUp(bool readable) THROWS {
+	// 乐观模式下请求一发出，客户端的数据就可以跟上去
+	if ((_state != STATE_ESTABLISHED && !(_state == STATE_AUTH && _requested))
+			|| !_clientReady || _down._eof)
+		return;
+	if (_client) {
+		_clientSrtt = _client->getSrtt();
+		_clientRto = _client->getRto();
+	}
+	uint64_t bytes = _up._bytes;
+	bool alive = _up.pump(readable);
+	if (_up._bytes > bytes)
+		_shard->_addBytes(_up._bytes - bytes, 0);
+	if (_up._bytes > bytes)
+		_mark(LatencyStats::MARK_FIRST_UP);
+	if (_up._eof)
+		_mark(LatencyStats::MARK_FIN);
+	if (!alive)
+		_close();
+}
+
+void TransTCP::_Splice::_pumpDown(bool readable) THROWS {
+	if (_state != STATE_ESTABLISHED || !_clientReady || _client == NULL)
+		return;
+	_clientSrtt = _client->getSrtt();
+	_clientRto = _client->getRto();
+	uint64_t bytes = _down._bytes;
+	bool alive = _down.pump(readable);
+	if (_down._bytes > bytes)
+		_shard->_addBytes(0, _down._bytes - bytes);
+	if (_down._bytes > bytes)
+		_mark(LatencyStats::MARK_FIRST_DOWN);
+	if (_down._eof)
+		_mark(LatencyStats::MARK_FIN);
+	if (!alive)
+		_close();
+}
+
+void TransTCP::_Splice::_close() {
+	if (_state == STATE_CLOSING)
+		return;
+	_state = STATE_CLOSING;
+	_stopRace();
+	// 用户态的客户端连接自己完成挥手后释放，内核socket直接关掉
+	if (_client) {
+		_client->close();
+		_client = NULL;
+	}
+	if (_upstream) {
+		_upstream->close();
+		_upstream = NULL;
+	}
+	_timer.post();
+}
+
+// 已经交给竞速的，原上游在交出时记过失败了，这次算竞速那一路的
+void TransTCP::_Splice::_fail() {
+	if (!_handedOver)
+		_via->onFailed();
+	else if (_racer)
+		_racer->_via->onFailed();
+	_close();
+}
+
+const char* TransTCP::_Splice::_stateName() const {
+	if (_state == STATE_CONNECTING)
+		return "Connecting";
+	if (_state == STATE_AUTH)
+		return "Authorizing";
+	if (_state == STATE_ESTABLISHED)
+		return _clientReady ? "Connected" : "Connecting";
+	return "Closing";
+}
+
+Net::TcpConnectionListener* TransTCP::_Splice::onTcpServerConnected(
+		Net::TcpConnection* conn) THROWS {
+	_clientReady = true;
+	if (_state == STATE_ESTABLISHED)
+		_timer.post();
+	else if (_state == STATE_AUTH && _requested)
+		conn->waitToRecv();
+	return &_clientListener;
+}
+
+void TransTCP::_Splice::onTcpServerError(Utils::Exception* e) THROWS {
+	THROW(e);
+}
+
+void TransTCP::_Splice::sendAuthRequest(const void* data, size_t bytes,
+		size_t /* bufferSize */, bool final) THROWS {
+	if (_upstream->send(data, bytes) < bytes) {
+		Utils::Log::e("FAILED to send proxy request for %s:%u",
+				_hostname.sz(), _addrPair.local.port);
+		_close();
+	} else if (final && _this->_optimistic) {
+		_requested = true;
+		_pumpUp(false);
+	}
+}
+
+void TransTCP::_Splice::onTimeout() THROWS {
+	if (_state == STATE_CLOSING) {
+		delete this;
+	} else if (_state == STATE_ESTABLISHED && _clientReady) {
+		// 客户端连接刚建立：等onTcpServerConnected返回、监听者就位之后再开始搬运
+		_start();
+	} else {
+		Utils::Log::e("Timeout connecting %s --> %s:%u",
+				_addrPair.remote.toString().sz(), _hostname.sz(),
+				_addrPair.local.port);
+		// 客户端一直没完成握手的不怪上游
+		if (_state == STATE_ESTABLISHED)
+			_close();
+		else if (!_handOver())
+			_fail();
+	}
+}
+
+}
@@ -12,24 +12,39 @@ class TunMac: public Mac, Net::TunListener {
 	Net::Tun _tun;
 
 	// Net::TunListener
-	void onTunReceived(void* packet, size_t bytes) THROWS {
-		Mac::dispatchPacket(packet, bytes);
+	void onTunReceived(void* packet, size_t bytes, Net::VnetHeader* vnet)
+			THROWS {
+		Mac::dispatchPacket(packet, bytes, vnet);
 	}
 	void onTunError(Utils::Exception* e) THROWS {
 		THROW(e);
 	}
 
 public:
-	TunMac(const char* ip, const char* mask) :
-			_tun(Net::IPv4::aton(ip), Net::IPv4::aton(mask), this) THROWS {
+	TunMac(const char* ip, const char* mask, size_t batchSize, bool offload,
+			bool multiQueue, size_t txQueue, Net::Tun::TxDrop txDrop) :
+			_tun(Net::IPv4::aton(ip), Net::IPv4::aton(mask), this, batchSize,
+					offload, multiQueue, txQueue, txDrop) THROWS {
 		Utils::Log::i("TUN MAC initializing...");
 	}
+	// 多队列模式下其他工作线程用的TUN队列
+	TunMac(TunMac* first) :
+			_tun(first->_tun.getName(), this, first->_tun.getBatchSize(),
+					first->_tun.isOffload(), first->_tun.getTxQueueSize(),
+					first->_tun.getTxDrop()) THROWS {
+		Utils::Log::i("TUN MAC queue initializing...");
+	}
 	virtual ~TunMac() {
 		Utils::Log::e("~TunMac");
 	}
 
-	void sendPacket(void* packet, size_t bytes) THROWS {
-		_tun.send(packet, bytes);
+	void sendPacket(void* packet, size_t bytes, const Net::VnetHeader* vnet)
+			THROWS {
+		_tun.send(packet, bytes, vnet);
+	}
+
+	const Net::Tun& getTun() const {
+		return _tun;
 	}
 };
 
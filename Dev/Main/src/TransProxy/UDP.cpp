@@ -18,16 +18,15 @@ void UDP::_Socket::send(Net::IPv4::SockAddr addr, const void* data,
 	_this->_ipv4->sendPacket(out);
 }
 
-void UDP::dispatchPacket(Net::IPv4::IpPacket& packet) THROWS {
-	if (Net::IPv4::UdpPacket::isValid(packet)) {
-		Net::IPv4::UdpPacket in = packet;
-		Net::IPv4::SockAddr dst(in.getDestAddr(), in.getDestPort());
-		_Socket* socket = _sockets.get(dst);
-		if (socket) {
-			Net::IPv4::SockAddr src(in.getSrcAddr(), in.getSrcPort());
-			socket->_listener->onReceived(src, in.dataPtr(), in.getDataSize());
-		}
-	}
+bool UDP::dispatchPacket(Net::IPv4::IpPacket& packet) THROWS {
+	Net::IPv4::UdpPacket in = packet;
+	Net::IPv4::SockAddr dst(in.getDestAddr(), in.getDestPort());
+	_Socket* socket = _sockets.get(dst);
+	if (socket == NULL)
+		return false;
+	Net::IPv4::SockAddr src(in.getSrcAddr(), in.getSrcPort());
+	socket->_listener->onReceived(src, in.dataPtr(), in.getDataSize());
+	return true;
 }
 
 }
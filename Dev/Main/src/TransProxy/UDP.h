@@ -43,7 +43,7 @@ class UDP: public IPv4Protocol {
 
 public:
 	UDP(IPv4* ipv4) :
-			_ipv4(ipv4) THROWS {
+			IPv4Protocol(IPPROTO_UDP), _ipv4(ipv4) THROWS {
 		Utils::Log::i("Protocol UDP initializing...");
 	}
 	virtual ~UDP() {
@@ -51,7 +51,7 @@ public:
 	}
 
 	// IPv4Protocol
-	void dispatchPacket(Net::IPv4::IpPacket& packet) THROWS;
+	bool dispatchPacket(Net::IPv4::IpPacket& packet) THROWS;
 
 	Net::UdpPeer* bind(Net::IPv4::SockAddr addr,
 			Net::UdpPeerListener* listener) {
@@ -0,0 +1,167 @@
+#define LOG_TAG "UpstreamPool"
+
+#include "Base/Debug.h"
+#include "Base/Utils.h"
+#include "Net/SocketConnection.h"
+#include "UpstreamPool.h"
+
+namespace TransProxy {
+
+void UpstreamPool::_Entry::onTcpConnected() THROWS {
+	// SOCKS5问候（RFC 1928）：版本5，1种认证方法，无需认证
+	if (_conn->send("\5\1\0", 3) < 3) {
+		_pool->_discard(this);
+		return;
+	}
+	_conn->waitToRecv();
+}
+
+void UpstreamPool::_Entry::onTcpDisconnected() THROWS {
+	_pool->_discard(this);
+}
+
+void UpstreamPool::_Entry::onTcpToRecv() THROWS {
+	// 闲置时代理不该发来任何东西，可读就是关闭或出错了
+	if (_ready) {
+		_pool->_discard(this);
+		return;
+	}
+	size_t n = _conn->recv(_response + _responseBytes,
+			sizeof(_response) - _responseBytes);
+	if (n == 0) {
+		_pool->_discard(this);
+		return;
+	}
+	_responseBytes += n;
+	if (_responseBytes < sizeof(_response)) {
+		_conn->waitToRecv();
+	} else if (_response[0] != 5 || _response[1] != 0) {
+		Utils::Log::e("SOCKS5 proxy refused greeting");
+		_pool->_discard(this);
+	} else {
+		_pool->_onReady(this);
+		_conn->waitToRecv();
+	}
+}
+
+void UpstreamPool::_Entry::onTcpError(Utils::Exception* e) THROWS {
+	e->print();
+	delete e;
+	_pool->_discard(this);
+}
+
+UpstreamPool::UpstreamPool(Net::IPv4::SockAddr proxy, size_t max) :
+		_proxy(proxy), _max(max), _idleCount(0), _pending(0), _arrivals(0), _rate(
+				0), _warmup(0), _hits(0), _misses(0), _running(false), _timer(
+				"UpstreamPool", this) {
+	_idle = new _Entry*[_max];
+}
+
+UpstreamPool::~UpstreamPool() {
+	_close(_idleCount);
+	delete[] _idle;
+}
+
+// 一个维护周期加上预热一条连接的时间里预计会来的新连接数
+size_t UpstreamPool::_target() const {
+	uint64_t n = ((uint64_t) _rate * (TICK + _warmup) + 256 * 1000 - 1)
+			/ (256 * 1000);
+	return (size_t) Utils::min(n, (uint64_t) _max);
+}
+
+void UpstreamPool::_refill() {
+	size_t target = _target();
+	while (_idleCount + _pending < target) {
+		bool failed = false;
+		TRY{
+			_Entry* entry = new _Entry(this);
+			entry->_start = Utils::nanoTime() / 1000000;
+			entry->_conn = new Net::SocketConnection(entry);
+			entry->_conn->connect(_proxy);
+			++_pending;
+		}CATCH(e){
+			e->print();
+			failed = true;
+		}
+		if (failed)
+			break;
+	}
+}
+
+void UpstreamPool::_onReady(_Entry* entry) {
+	--_pending;
+	entry->_ready = ::time(NULL);
+	unsigned ms = (unsigned) (Utils::nanoTime() / 1000000 - entry->_start);
+	_warmup = _warmup ? (_warmup * 7 + ms) / 8 : ms;
+	_idle[_idleCount++] = entry;
+}
+
+void UpstreamPool::_discard(_Entry* entry) {
+	if (entry->_ready) {
+		size_t i = 0;
+		while (_idle[i] != entry)
+			++i;
+		for (--_idleCount; i < _idleCount; ++i)
+			_idle[i] = _idle[i + 1];
+	} else {
+		--_pending;
+	}
+	entry->_conn->close();
+	delete entry;
+}
+
+// 关掉最旧的count条闲置连接
+void UpstreamPool::_close(size_t count) {
+	for (size_t i = 0; i < count; ++i) {
+		_idle[i]->_conn->close();
+		delete _idle[i];
+	}
+	_idleCount -= count;
+	for (size_t i = 0; i < _idleCount; ++i)
+		_idle[i] = _idle[i + count];
+}
+
+Net::TcpConnection* UpstreamPool::acquire(
+		Net::TcpConnectionListener* listener) {
+	++_arrivals;
+	Net::TcpConnection* conn = NULL;
+	if (_idleCount > 0) {
+		_Entry* entry = _idle[--_idleCount];
+		conn = entry->_conn;
+		conn->setListener(listener);
+		delete entry;
+		++_hits;
+	} else {
+		++_misses;
+	}
+	// 刚开始有流量时速率还是0，先按一个周期一条算，让池子尽快有货
+	if (_rate == 0)
+		_rate = 256;
+	_refill();
+	if (!_running) {
+		_running = true;
+		_timer.setTimeout(TICK);
+	}
+	return conn;
+}
+
+void UpstreamPool::onTimeout() THROWS {
+	_rate = (_rate * 3 + _arrivals * 256) / 4;
+	_arrivals = 0;
+	size_t target = _target();
+	time_t now = ::time(NULL);
+	size_t n = 0;
+	while (n < _idleCount
+			&& (_idleCount - n > target
+					|| now - _idle[n]->_ready >= IDLE_TIMEOUT))
+		++n;
+	_close(n);
+	_refill();
+	// 没有流量也没有连接了就停下，下次取用时再启动
+	if (_rate > 0 || _idleCount > 0 || _pending > 0)
+		_timer.setTimeout(TICK);
+	else
+		_running = false;
+}
+
+}
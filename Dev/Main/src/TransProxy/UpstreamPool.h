@@ -0,0 +1,85 @@
+#include <stdint.h>
+#include <time.h>
+#include "Base/Debug.h"
+#include "Base/Utils.h"
+#include "Net/IPv4.h"
+#include "Net/TcpConnection.h"
+
+#pragma once
+
+namespace TransProxy {
+
+// 预热的SOCKS5上游连接池：提前连好代理并做完"\5\1\0"问候，新连接取一条直接发CONNECT，
+// 省掉TCP握手和问候两个来回。池的目标大小按最近新建连接的速率估算，
+// 每秒补足一次，取走一条时也立即补；闲置过久或超出目标的连接关掉。
+// 不是线程安全的，由所属的TransTCP分片在自己的工作线程里使用
+class UpstreamPool: Utils::TimerListener {
+	enum {
+		TICK = 1000, // 维护周期，毫秒
+		IDLE_TIMEOUT = 30 // 闲置连接保留的秒数，要赶在代理那边的空闲超时之前
+	};
+
+	struct _Entry: Net::TcpConnectionListener {
+		UpstreamPool* _pool;
+		Net::TcpConnection* _conn;
+		uint64_t _start;
+		time_t _ready; // 0表示问候还没完成
+		uint8_t _response[2];
+		size_t _responseBytes;
+
+		_Entry(UpstreamPool* pool) :
+				_pool(pool), _conn(NULL), _start(0), _ready(0), _responseBytes(
+						0) {
+		}
+
+		// Net::TcpConnectionListener
+		void onTcpConnected() THROWS;
+		void onTcpDisconnected() THROWS;
+		void onTcpToRecv() THROWS;
+		void onTcpToSend() THROWS {
+		}
+		void onTcpError(Utils::Exception* e) THROWS;
+	};
+
+	Net::IPv4::SockAddr _proxy;
+	size_t _max;
+	// 已就绪的连接按完成问候的先后排列：取用最新的，淘汰最旧的
+	_Entry** _idle;
+	size_t _idleCount, _pending;
+	// 每秒新建连接数（×256）和预热一条连接的耗时（毫秒），都是指数滑动平均
+	unsigned _arrivals, _rate, _warmup;
+	uint64_t _hits, _misses;
+	bool _running;
+	Utils::Timer _timer;
+
+	size_t _target() const;
+	void _refill();
+	void _onReady(_Entry* entry);
+	void _discard(_Entry* entry);
+	void _close(size_t count);
+
+	// Utils::TimerListener
+	void onTimeout() THROWS;
+	void onTimerError(Utils::Exception* e) THROWS {
+		THROW(e);
+	}
+
+public:
+	UpstreamPool(Net::IPv4::SockAddr proxy, size_t max);
+	virtual ~UpstreamPool();
+
+	// 取一条做完问候的连接，之后它的事件交给listener；池里没有时返回NULL
+	Net::TcpConnection* acquire(Net::TcpConnectionListener* listener);
+
+	size_t getIdle() const {
+		return _idleCount;
+	}
+	uint64_t getHits() const {
+		return _hits;
+	}
+	uint64_t getMisses() const {
+		return _misses;
+	}
+};
+
+}
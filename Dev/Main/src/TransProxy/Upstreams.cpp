@@ -0,0 +1,278 @@
+#define LOG_TAG "Upstreams"
+
+#include <stdlib.h>
+#include <string.h>
+#include "Base/Debug.h"
+#include "Base/Utils.h"
+#include "Net/SocketConnection.h"
+#include "ProxyAuthHTTP.h"
+#include "ProxyAuthSock5.h"
+#include "Upstreams.h"
+
+namespace TransProxy {
+
+Upstream::Upstream(const char* url, const char* clientIP) :
+		_url(url), _authBuilder(NULL), _sock5(false), _weight(1), _active(0), _total(
+				0), _failures(0), _races(0), _raceWins(0), _consecutiveFailures(
+				0), _connectTime(0), _requestTime(0), _connectDev(0), _requestDev(
+				0), _connectSamples(0), _requestSamples(0), _healthy(true), _pools(
+				NULL) THROWS {
+	const char* p = ::strstr(url, "://");
+	THROW_IF(p == NULL, new Utils::Exception("Invalid proxy url '%s'!", url));
+	if (::strncmp(url, "http://", 7) == 0) {
+		_authBuilder = new ProxyAuthHTTP::Builder();
+	} else if (::strncmp(url, "sock://", 7) == 0
+			|| ::strncmp(url, "socks://", 8) == 0
+			|| ::strncmp(url, "sock5://", 8) == 0
+			|| ::strncmp(url, "socks5://", 9) == 0) {
+		_authBuilder = new ProxyAuthSock5::Builder();
+		_sock5 = true;
+	} else {
+		THROW(new Utils::Exception("Only HTTP or SOCK5 proxy supported!"));
+	}
+	const char* q = ::strchr(p + 3, '?');
+	_addr = Net::IPv4::SockAddr(
+			q ? Utils::String(p + 3, q - p - 3).sz() : p + 3);
+	if (q && ::strncmp(q + 1, "weight=", 7) == 0) {
+		int weight = ::atoi(q + 8);
+		_weight = weight < 1 ? 1 : weight;
+	}
+	if ((_addr.ip >> 24) == 127)
+		_addr.ip = Net::IPv4::aton(clientIP);
+}
+
+Upstream::~Upstream() {
+	delete _authBuilder;
+	if (_pools)
+		delete[] _pools;
+}
+
+void Upstream::createPools(size_t shardCount, size_t size) {
+	_pools = new UpstreamPool*[shardCount];
+	for (size_t i = 0; i < shardCount; ++i)
+		_pools[i] = new UpstreamPool(_addr, size);
+}
+
+// 均值加4倍平均偏差，同TCP估算RTO的办法；还没有样本时取上限
+unsigned Upstream::getRaceDelay(bool request) const {
+	if ((request ? _requestSamples : _connectSamples) == 0)
+		return RACE_DELAY_MAX;
+	unsigned ms = (request ?
+			_requestTime + 4 * _requestDev : _connectTime + 4 * _connectDev)
+			/ 1000;
+	if (ms < RACE_DELAY_MIN)
+		return RACE_DELAY_MIN;
+	if (ms > RACE_DELAY_MAX)
+		return RACE_DELAY_MAX;
+	return ms;
+}
+
+void Upstream::toJSON(Utils::JSONObject* json) const {
+	json->put("URL", _url.sz());
+	json->put("Healthy", _healthy);
+	json->put("Weight", (int) _weight);
+	json->put("Active", (long long) _active);
+	json->put("Total", (long long) _total);
+	json->put("Failures", (long long) _failures);
+	json->put("Races", (long long) _races);
+	json->put("RaceWins", (long long) _raceWins);
+	json->put("ConnectTime", _connectTime / 1000.0);
+	json->put("RequestTime", _requestTime / 1000.0);
+	json->put("Latency", getLatency() / 1000.0);
+}
+
+void Upstreams::_Probe::start() THROWS {
+	_responseBytes = 0;
+	_start = Utils::nanoTime();
+	_conn = new Net::SocketConnection(this);
+	_conn->connect(_upstream->_addr);
+}
+
+void Upstreams::_Probe::finish(bool ok) {
+	if (_conn) {
+		_conn->close();
+		_conn = NULL;
+	}
+	if (ok) {
+		_upstream->_consecutiveFailures = 0;
+		_upstream->_healthy = true;
+	} else {
+		// 和真实连接的失败一样计数，连续MAX_FAILURES次才算挂了
+		bool healthy = _upstream->_healthy;
+		_upstream->onFailed();
+		if (healthy && !_upstream->_healthy)
+			Utils::Log::w("Upstream %s is down", _upstream->_url.sz());
+	}
+}
+
+void Upstreams::_Probe::onTcpConnected() THROWS {
+	_upstream->onConnected((Utils::nanoTime() - _start) / 1000);
+	if (!_upstream->_sock5) {
+		finish(true);
+	} else if (_conn->send("\5\1\0", 3) < 3) {
+		finish(false);
+	} else {
+		_conn->waitToRecv();
+	}
+}
+
+void Upstreams::_Probe::onTcpToRecv() THROWS {
+	size_t n = _conn->recv(_response + _responseBytes,
+			sizeof(_response) - _responseBytes);
+	_responseBytes += n;
+	if (n == 0)
+		finish(false);
+	else if (_responseBytes < sizeof(_response))
+		_conn->waitToRecv();
+	else
+		finish(_response[0] == 5 && _response[1] == 0);
+}
+
+Upstreams::Upstreams(const char* urls, const char* clientIP,
+		const char* policy) :
+		_list(NULL), _probes(NULL), _count(0), _policy(
+				::strcmp(policy, "leastconn") == 0 ?
+						POLICY_LEAST_CONN : POLICY_LATENCY), _next(0), _timer(
+				"Upstreams", this) THROWS {
+	static const char* SEPARATORS = " \t,;";
+	size_t n = 0;
+	for (const char* p = urls + ::strspn(urls, SEPARATORS); *p;
+			p += ::strcspn(p, SEPARATORS), p += ::strspn(p, SEPARATORS))
+		++n;
+	THROW_IF(n == 0, new Utils::Exception("No proxy configured!"));
+	_list = new Upstream*[n];
+	_probes = new _Probe*[n];
+	for (const char* p = urls + ::strspn(urls, SEPARATORS); *p;
+			p += ::strspn(p, SEPARATORS)) {
+		size_t l = ::strcspn(p, SEPARATORS);
+		Utils::String url(p, l);
+		_list[_count] = new Upstream(url.sz(), clientIP);
+		_probes[_count] = new _Probe(_list[_count]);
+		++_count;
+		Utils::Log::i("Upstream proxy %s", url.sz());
+		p += l;
+	}
+}
+
+Upstreams::~Upstreams() {
+	for (size_t i = 0; i < _count; ++i) {
+		delete _probes[i];
+		delete _list[i];
+	}
+	delete[] _probes;
+	delete[] _list;
+}
+
+// 优先在可用的上游里挑，都不可用时在全部里挑；条件相同的轮流用
+Upstream* Upstreams::select(const Upstream* exclude) {
+	if (_count == 1)
+		return exclude == _list[0] ? NULL : _list[0];
+	bool anyHealthy = false;
+	for (size_t i = 0; i < _count && !anyHealthy; ++i)
+		anyHealthy = _list[i] != exclude && _list[i]->_healthy;
+	size_t start = __sync_fetch_and_add(&_next, 1);
+	Upstream* best = NULL;
+	for (size_t i = 0; i < _count; ++i) {
+		Upstream* u = _list[(start + i) % _count];
+		if (u == exclude || (anyHealthy && !u->_healthy))
+			continue;
+		if (best == NULL)
+			best = u;
+		else if (_policy == POLICY_LEAST_CONN ?
+				(uint64_t) u->_active * best->_weight
+						< (uint64_t) best->_active * u->_weight :
+				u->getLatency() < best->getLatency())
+			best = u;
+	}
+	return best;
+}
+
+void Upstreams::startProbing() {
+	_timer.post();
+}
+
+void Upstreams::onTimeout() THROWS {
+	for (size_t i = 0; i < _count; ++i) {
+		_Probe* probe = _probes[i];
+		// 上一轮还没结束，算作超时
+		if (probe->_conn)
+			probe->finish(false);
+		bool failed = false;
+		TRY{
+			probe->start();
+		}CATCH(e){
+			e->print();
+			failed = true;
+		}
+		if (failed) {
+			probe->_conn = NULL;
+			probe->finish(false);
+		}
+	}
+	_timer.setTimeout(PROBE_INTERVAL);
+}
+
+bool Upstreams::onHttpRequest(Net::HttpRequest& request,
+		Utils::JSONObject& response) THROWS {
+	Utils::String path = request.getPath();
+	if (path == "/upstreams.json") {
+		Utils::JSONArray* list = new Utils::JSONArray();
+		for (size_t i = 0; i < _count; ++i) {
+			Utils::JSONObject* item = new Utils::JSONObject();
+			_list[i]->toJSON(item);
+			list->put(item);
+		}
+		response.put("Status", 0);
+		response.put("Message", "OK");
+		response.put("Policy",
+				_policy == POLICY_LEAST_CONN ? "leastconn" : "latency");
+		response.put("Upstreams", list);
+		return true;
+	}
+	return HttpService::onHttpRequest(request, response);
+}
+
+void Upstreams::writeMetrics(Utils::MetricsWriter& out) {
+	Utils::String* labels = new Utils::String[_count];
+	for (size_t i = 0; i < _count; ++i)
+		labels[i] = Utils::MetricsWriter::label("upstream", _list[i]->getURL());
+	for (size_t i = 0; i < _count; ++i)
+		out.gauge("transproxy_upstream_healthy",
+				"Whether the upstream proxy is considered usable",
+				_list[i]->_healthy, labels[i]);
+	for (size_t i = 0; i < _count; ++i)
+		out.gauge("transproxy_upstream_active_connections",
+				"Connections currently through the upstream",
+				_list[i]->_active, labels[i]);
+	for (size_t i = 0; i < _count; ++i)
+		out.counter("transproxy_upstream_connections_total",
+				"Connections opened through the upstream", _list[i]->_total,
+				labels[i]);
+	for (size_t i = 0; i < _count; ++i)
+		out.counter("transproxy_upstream_failures_total",
+				"Connections the upstream failed to set up",
+				_list[i]->_failures, labels[i]);
+	for (size_t i = 0; i < _count; ++i)
+		out.counter("transproxy_upstream_races_total",
+				"Races the upstream took part in", _list[i]->_races,
+				labels[i]);
+	for (size_t i = 0; i < _count; ++i)
+		out.counter("transproxy_upstream_race_wins_total",
+				"Races the upstream won", _list[i]->_raceWins, labels[i]);
+	for (size_t i = 0; i < _count; ++i)
+		out.gauge("transproxy_upstream_connect_seconds",
+				"Smoothed TCP handshake time to the upstream",
+				_list[i]->_connectTime / 1e6, labels[i]);
+	for (size_t i = 0; i < _count; ++i)
+		out.gauge("transproxy_upstream_request_seconds",
+				"Smoothed proxy request (CONNECT) time",
+				_list[i]->_requestTime / 1e6, labels[i]);
+	for (size_t i = 0; i < _count; ++i)
+		_list[i]->_latencyStats.writeMetrics(out,
+				"transproxy_upstream_stage_seconds",
+				"Connection lifecycle stage durations by upstream",
+				labels[i]);
+	delete[] labels;
+}
+
+}
@@ -0,0 +1,223 @@
+#include <stdint.h>
+#include "Base/Debug.h"
+#include "Base/Metrics.h"
+#include "Base/Utils.h"
+#include "Net/IPv4.h"
+#include "Net/TcpConnection.h"
+#include "HTTP.h"
+#include "LatencyStats.h"
+#include "ProxyAuth.h"
+#include "UpstreamPool.h"
+
+#pragma once
+
+namespace TransProxy {
+
+// 一个上游代理：地址、认证方式，以及各分片共同累计的统计。
+// 计数用原子操作，延迟的滑动平均允许各线程偶尔互相覆盖
+class Upstream {
+	friend class Upstreams;
+
+	enum {
+		// 连续失败这么多次就认为不可用，直到探测或连接重新成功
+		MAX_FAILURES = 3
+	};
+	// 竞速前等待时间的上下限，毫秒
+	enum {
+		RACE_DELAY_MIN = 100, RACE_DELAY_MAX = 2000
+	};
+
+	Utils::String _url;
+	Net::IPv4::SockAddr _addr;
+	ProxyAuthBuilder* _authBuilder;
+	bool _sock5;
+	unsigned _weight;
+	// 32位目标上没有64位原子操作，计数用字长
+	size_t _active, _total, _failures, _races, _raceWins;
+	unsigned _consecutiveFailures;
+	// TCP握手和代理请求（CONNECT）各自的耗时及其平均偏差，微秒，指数滑动平均
+	unsigned _connectTime, _requestTime, _connectDev, _requestDev;
+	uint64_t _connectSamples, _requestSamples;
+	bool _healthy;
+	// 预热的连接池，每分片一个，只有splice引擎连SOCKS5代理时才有
+	UpstreamPool** _pools;
+	LatencyStats _latencyStats;
+
+	static void _average(unsigned* avg, unsigned* dev, uint64_t* samples,
+			uint64_t us) {
+		unsigned v = (unsigned) Utils::min(us, (uint64_t) 0xFFFFFFFF);
+		if ((*samples)++ == 0) {
+			*avg = v;
+			*dev = v / 2;
+			return;
+		}
+		unsigned err = v > *avg ? v - *avg : *avg - v;
+		*dev = (unsigned) (((uint64_t) *dev * 3 + err) / 4);
+		*avg = (unsigned) (((uint64_t) *avg * 7 + v) / 8);
+	}
+
+public:
+	// url形如 sock5://1.2.3.4:1080 或 http://1.2.3.4:8080，可带?weight=N
+	Upstream(const char* url, const char* clientIP) THROWS;
+	virtual ~Upstream();
+
+	void createPools(size_t shardCount, size_t size);
+	UpstreamPool* getPool(size_t shard) const {
+		return _pools ? _pools[shard] : NULL;
+	}
+
+	const char* getURL() const {
+		return _url.sz();
+	}
+	Net::IPv4::SockAddr getAddr() const {
+		return _addr;
+	}
+	ProxyAuthBuilder* getAuthBuilder() const {
+		return _authBuilder;
+	}
+	bool isSock5() const {
+		return _sock5;
+	}
+	unsigned getWeight() const {
+		return _weight;
+	}
+	size_t getActive() const {
+		return _active;
+	}
+	bool isHealthy() const {
+		return _healthy;
+	}
+	// 没有样本时为0，选上游时会优先试它
+	unsigned getLatency() const {
+		return _connectTime + _requestTime;
+	}
+	// 等TCP握手（request为false）或代理请求多久还没完成就该找别的上游竞速，毫秒
+	unsigned getRaceDelay(bool request) const;
+	// 经由这个上游的连接在各阶段的耗时分布
+	LatencyStats& getLatencyStats() {
+		return _latencyStats;
+	}
+
+	// 以下由各分片的连接在状态变化时调用
+	void onOpen() {
+		__sync_add_and_fetch(&_active, 1);
+		__sync_add_and_fetch(&_total, 1);
+	}
+	void onClose() {
+		__sync_sub_and_fetch(&_active, 1);
+	}
+	void onConnected(uint64_t us) {
+		_average(&_connectTime, &_connectDev, &_connectSamples, us);
+	}
+	void onEstablished(uint64_t us) {
+		_average(&_requestTime, &_requestDev, &_requestSamples, us);
+		_consecutiveFailures = 0;
+		_healthy = true;
+	}
+	void onFailed() {
+		__sync_add_and_fetch(&_failures, 1);
+		if (++_consecutiveFailures >= MAX_FAILURES)
+			_healthy = false;
+	}
+	// 作为竞速的一方开始连接、以及最终胜出
+	void onRace() {
+		__sync_add_and_fetch(&_races, 1);
+	}
+	void onRaceWon() {
+		__sync_add_and_fetch(&_raceWins, 1);
+	}
+
+	void toJSON(Utils::JSONObject* json) const;
+};
+
+// 上游代理列表：按策略给新连接挑选上游，并在主线程里定时探测各上游是否可用
+class Upstreams: public HttpService,
+		public Utils::MetricsSource,
+		Utils::TimerListener {
+public:
+	enum Policy {
+		POLICY_LATENCY, POLICY_LEAST_CONN
+	};
+
+private:
+	enum {
+		PROBE_INTERVAL = 10000 // 探测周期，毫秒，上一轮没完成的探测算作超时
+	};
+
+	// 探测：TCP连上即算可用，SOCKS5代理还要完成问候
+	struct _Probe: Net::TcpConnectionListener {
+		Upstream* _upstream;
+		Net::TcpConnection* _conn;
+		uint64_t _start;
+		uint8_t _response[2];
+		size_t _responseBytes;
+
+		_Probe(Upstream* upstream) :
+				_upstream(upstream), _conn(NULL), _start(0), _responseBytes(0) {
+		}
+
+		void start() THROWS;
+		void finish(bool ok);
+
+		// Net::TcpConnectionListener
+		void onTcpConnected() THROWS;
+		void onTcpDisconnected() THROWS {
+			finish(false);
+		}
+		void onTcpToRecv() THROWS;
+		void onTcpToSend() THROWS {
+		}
+		void onTcpError(Utils::Exception* e) THROWS {
+			e->print();
+			delete e;
+			finish(false);
+		}
+	};
+
+	Upstream** _list;
+	_Probe** _probes;
+	size_t _count;
+	Policy _policy;
+	size_t _next;
+	Utils::Timer _timer;
+
+	// Utils::TimerListener
+	void onTimeout() THROWS;
+	void onTimerError(Utils::Exception* e) THROWS {
+		THROW(e);
+	}
+
+public:
+	// urls为空格或逗号分隔的代理列表；policy为"latency"或"leastconn"
+	Upstreams(const char* urls, const char* clientIP, const char* policy)
+			THROWS;
+	virtual ~Upstreams();
+
+	size_t getCount() const {
+		return _count;
+	}
+	Upstream* get(size_t index) const {
+		return _list[index];
+	}
+	bool contains(uint32_t ip) const {
+		for (size_t i = 0; i < _count; ++i)
+			if (_list[i]->_addr.ip == ip)
+				return true;
+		return false;
+	}
+
+	// 给新连接挑一个上游，可在任何工作线程调用。
+	// exclude不为NULL时挑除它之外的，用于竞速，没有别的上游时返回NULL
+	Upstream* select(const Upstream* exclude = NULL);
+	// 在当前线程开始定时探测
+	void startProbing();
+
+	// HttpService
+	bool onHttpRequest(Net::HttpRequest& request, Utils::JSONObject& response)
+			THROWS;
+
+	// Utils::MetricsSource
+	void writeMetrics(Utils::MetricsWriter& out);
+};
+
+}
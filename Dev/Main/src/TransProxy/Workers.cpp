@@ -0,0 +1,314 @@
+#define LOG_TAG "Workers"
+
+#include <errno.h>
+#include <stddef.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include "Base/Debug.h"
+#include "Base/Utils.h"
+#include "Workers.h"
+
+namespace TransProxy {
+
+Workers::_Worker::_Worker(Workers* workers, size_t index, TunMac* mac,
+		Shaper* shaper, IPv4* ipv4) :
+		_workers(workers), _index(index), _mac(mac), _shaper(shaper), _ipv4(
+				ipv4), _thread(NULL), _first(
+				NULL), _last(NULL), _selector(-1), _steered(0) THROWS {
+	int r = ::pthread_spin_init(&_lock, 0);
+	THROW_IF(r != 0, new Utils::Exception("FAILED to init spin lock"));
+
+	_event = ::eventfd(0, EFD_NONBLOCK);
+	THROW_IF(_event == -1,
+			new Utils::Exception("FAILED to create eventfd, errno=%d", errno));
+}
+
+Workers::_Worker::~_Worker() {
+	::close(_event);
+	::pthread_spin_destroy(&_lock);
+}
+
+void Workers::_Worker::_attach() THROWS {
+	_mac->addProtocol(this);
+	_selector = Utils::Looper::myLooper()->attachFD(_event, this);
+	Utils::Looper::myLooper()->waitToRead(_selector);
+}
+
+void* Workers::_Worker::threadProc(Utils::Thread* /* thread */,
+		int /* param_i */, void* /* param_p */) {
+	Utils::Looper::prepare();
+	TunMac* mac = new TunMac(_workers->_workers[0]->_mac);
+	Mac* egress = mac;
+	if (_workers->_workers[0]->_shaper)
+		egress = _shaper = new Shaper(_workers->_workers[0]->_shaper, mac);
+	IPv4* ipv4 = new IPv4(egress);
+	ipv4->addProtocol(_workers->_transTCP->bindShard(_index, ipv4, _shaper));
+	::pthread_spin_lock(&_lock);
+	_mac = mac;
+	_ipv4 = ipv4;
+	::pthread_spin_unlock(&_lock);
+	_attach();
+	Utils::Log::i("Worker #%u running...", _index);
+	Utils::Looper::loop();
+	return NULL;
+}
+
+const Net::Tun* Workers::_Worker::_getTun() const {
+	::pthread_spin_lock(&_lock);
+	TunMac* mac = _mac;
+	::pthread_spin_unlock(&_lock);
+	return mac ? &mac->getTun() : NULL;
+}
+
+IPv4* Workers::_Worker::_getIPv4() const {
+	::pthread_spin_lock(&_lock);
+	IPv4* ipv4 = _ipv4;
+	::pthread_spin_unlock(&_lock);
+	return ipv4;
+}
+
+uint64_t Workers::_Worker::_getSteered() const {
+	::pthread_spin_lock(&_lock);
+	uint64_t n = _steered;
+	::pthread_spin_unlock(&_lock);
+	return n;
+}
+
+void Workers::_Worker::_post(const void* packet, size_t bytes,
+		const Net::VnetHeader* vnet) {
+	_Parcel* parcel = (_Parcel*) new uint8_t[offsetof(_Parcel, data) + bytes];
+	parcel->next = NULL;
+	parcel->hasVnet = vnet != NULL;
+	if (vnet)
+		parcel->vnet = *vnet;
+	parcel->bytes = bytes;
+	::memcpy(parcel->data, packet, bytes);
+
+	::pthread_spin_lock(&_lock);
+	bool wake = _first == NULL;
+	if (_last)
+		_last->next = parcel;
+	else
+		_first = parcel;
+	_last = parcel;
+	::pthread_spin_unlock(&_lock);
+
+	// 队列由空变非空时才需要唤醒，对方取走整条链之前不会再写eventfd
+	if (wake) {
+		uint64_t count = 1;
+		ssize_t r = ::write(_event, &count, sizeof(count));
+		if (r != sizeof(count))
+			Utils::Log::w("FAILED to wake worker #%u, errno=%d", _index, errno);
+	}
+}
+
+void Workers::_Worker::dispatchPacket(void* packet, size_t bytes,
+		Net::VnetHeader* vnet) THROWS {
+	size_t owner = _workers->_ownerOf((const uint8_t*) packet, bytes);
+	if (owner == _index) {
+		_ipv4->dispatchPacket(packet, bytes, vnet);
+	} else {
+		::pthread_spin_lock(&_lock);
+		++_steered;
+		::pthread_spin_unlock(&_lock);
+		_workers->_workers[owner]->_post(packet, bytes, vnet);
+	}
+}
+
+void Workers::_Worker::onFDToRead() THROWS {
+	uint64_t count;
+	::read(_event, &count, sizeof(count));
+	Utils::Looper::myLooper()->waitToRead(_selector);
+
+	::pthread_spin_lock(&_lock);
+	_Parcel* parcel = _first;
+	_first = _last = NULL;
+	::pthread_spin_unlock(&_lock);
+
+	while (parcel) {
+		_Parcel* next = parcel->next;
+		TRY{
+			_ipv4->dispatchPacket(parcel->data, parcel->bytes,
+					parcel->hasVnet ? &parcel->vnet : NULL);
+		}CATCH(e){
+			delete[] (uint8_t*) parcel;
+			for (parcel = next; parcel; parcel = next) {
+				next = parcel->next;
+				delete[] (uint8_t*) parcel;
+			}
+			THROW(e);
+		}
+		delete[] (uint8_t*) parcel;
+		parcel = next;
+	}
+}
+
+Workers::Workers(size_t count, TunMac* mac, Shaper* shaper, IPv4* ipv4,
+		TransTCP* transTCP, const char* vipMin, const char* vipMax,
+		const char* agentMin, const char* agentMax) :
+		_transTCP(transTCP), _vipMin(Net::IPv4::aton(vipMin)), _vipMax(
+				Net::IPv4::aton(vipMax)), _agentMin(Net::IPv4::aton(agentMin)), _agentMax(
+				Net::IPv4::aton(agentMax)), _count(count) THROWS {
+	Utils::Log::i("Workers initializing...");
+
+	// 先把所有工作线程的收件箱建好再启动线程，转交时对方一定已经存在
+	_workers = new _Worker*[_count];
+	_workers[0] = new _Worker(this, 0, mac, shaper, ipv4);
+	for (size_t i = 1; i < _count; ++i)
+		_workers[i] = new _Worker(this, i, NULL, NULL, NULL);
+
+	_workers[0]->_attach();
+	for (size_t i = 1; i < _count; ++i) {
+		_workers[i]->_thread = new Utils::Thread(_workers[i]);
+		_workers[i]->_thread->detach();
+	}
+	Utils::Log::i("%u workers started.", _count);
+}
+
+size_t Workers::_ownerOf(const uint8_t* packet, size_t bytes) const {
+	if (_count == 1 || bytes < 20 || (packet[0] >> 4) != 4
+			|| packet[9] != IPPROTO_TCP)
+		return 0;
+	size_t l = (packet[0] & 0x0F) * 4;
+	if (bytes < l + 4)
+		return 0;
+	Net::IPv4::SockAddr src(ntohl(*(uint32_t*) (packet + 12)),
+			ntohs(*(uint16_t*) (packet + l)));
+	Net::IPv4::SockAddr dst(ntohl(*(uint32_t*) (packet + 16)),
+			ntohs(*(uint16_t*) (packet + l + 2)));
+
+	// 代理 -> agent
+	if (dst.ip >= _agentMin && dst.ip <= _agentMax)
+		return _transTCP->getShardOfAgent(dst);
+
+	// 客户端 -> VIP或公网地址，其余（如本机HTTP服务）都归主线程
+	if ((dst.ip >= _vipMin && dst.ip <= _vipMax) || !Net::IPv4::isLanIP(dst.ip))
+		return _transTCP->getShardOfClient(Net::IPv4::SockAddrPair(src, dst));
+	return 0;
+}
+
+uint64_t Workers::getTunRxPackets() const {
+	uint64_t n = 0;
+	for (size_t i = 0; i < _count; ++i) {
+		const Net::Tun* tun = _workers[i]->_getTun();
+		if (tun)
+			n += tun->getRxPackets();
+	}
+	return n;
+}
+
+uint64_t Workers::getTunRxBatches() const {
+	uint64_t n = 0;
+	for (size_t i = 0; i < _count; ++i) {
+		const Net::Tun* tun = _workers[i]->_getTun();
+		if (tun)
+			n += tun->getRxBatches();
+	}
+	return n;
+}
+
+uint64_t Workers::getTunTxPackets() const {
+	uint64_t n = 0;
+	for (size_t i = 0; i < _count; ++i) {
+		const Net::Tun* tun = _workers[i]->_getTun();
+		if (tun)
+			n += tun->getTxPackets();
+	}
+	return n;
+}
+
+uint64_t Workers::getTunTxQueued() const {
+	uint64_t n = 0;
+	for (size_t i = 0; i < _count; ++i) {
+		const Net::Tun* tun = _workers[i]->_getTun();
+		if (tun)
+			n += tun->getTxQueued();
+	}
+	return n;
+}
+
+uint64_t Workers::getTunTxDrops() const {
+	uint64_t n = 0;
+	for (size_t i = 0; i < _count; ++i) {
+		const Net::Tun* tun = _workers[i]->_getTun();
+		if (tun)
+			n += tun->getTxDrops() + tun->getTxErrors();
+	}
+	return n;
+}
+
+uint64_t Workers::getSteeredPackets() const {
+	uint64_t n = 0;
+	for (size_t i = 0; i < _count; ++i)
+		n += _workers[i]->_getSteered();
+	return n;
+}
+
+void Workers::writeMetrics(Utils::MetricsWriter& out) {
+	static const struct {
+		const char* name;
+		const char* help;
+		uint64_t (Net::Tun::*get)() const;
+	} TUN_METRICS[] = {
+			{ "transproxy_tun_rx_packets_total", "Packets read from TUN",
+					&Net::Tun::getRxPackets },
+			{ "transproxy_tun_rx_bytes_total", "Bytes read from TUN",
+					&Net::Tun::getRxBytes },
+			{ "transproxy_tun_rx_batches_total",
+					"TUN wakeups that read at least one packet",
+					&Net::Tun::getRxBatches },
+			{ "transproxy_tun_tx_packets_total", "Packets written to TUN",
+					&Net::Tun::getTxPackets },
+			{ "transproxy_tun_tx_bytes_total", "Bytes written to TUN",
+					&Net::Tun::getTxBytes },
+			{ "transproxy_tun_tx_deferred_total",
+					"Packets queued because TUN was not writable",
+					&Net::Tun::getTxDeferred },
+			{ "transproxy_tun_tx_drops_total",
+					"Packets dropped because the TUN send queue was full",
+					&Net::Tun::getTxDrops },
+			{ "transproxy_tun_tx_errors_total",
+					"Packets dropped on TUN write errors",
+					&Net::Tun::getTxErrors } };
+	for (size_t m = 0; m < sizeof(TUN_METRICS) / sizeof(TUN_METRICS[0]); ++m)
+		for (size_t i = 0; i < _count; ++i) {
+			const Net::Tun* tun = _workers[i]->_getTun();
+			if (tun)
+				out.counter(TUN_METRICS[m].name, TUN_METRICS[m].help,
+						(tun->*TUN_METRICS[m].get)(),
+						Utils::MetricsWriter::label("worker", i));
+		}
+
+	for (size_t i = 0; i < _count; ++i) {
+		const Net::Tun* tun = _workers[i]->_getTun();
+		if (tun)
+			out.gauge("transproxy_tun_tx_queued",
+					"Packets waiting in the TUN send queue",
+					tun->getTxQueued(),
+					Utils::MetricsWriter::label("worker", i));
+	}
+
+	for (size_t i = 0; i < _count; ++i)
+		out.counter("transproxy_steered_packets_total",
+				"Packets handed over to the owning worker",
+				_workers[i]->_getSteered(),
+				Utils::MetricsWriter::label("worker", i));
+
+	// 只列出出现过的协议
+	for (size_t i = 0; i < _count; ++i) {
+		IPv4* ipv4 = _workers[i]->_getIPv4();
+		if (ipv4 == NULL)
+			continue;
+		for (unsigned proto = 0; proto < 256; ++proto) {
+			uint64_t n = ipv4->getDispatched(proto);
+			if (n == 0)
+				continue;
+			Utils::String labels = Utils::MetricsWriter::label("worker", i)
+					+ "," + Utils::MetricsWriter::label("protocol", proto).sz();
+			out.counter("transproxy_ipv4_dispatched_packets_total",
+					"IPv4 packets dispatched by protocol number", n, labels);
+		}
+	}
+}
+
+}
@@ -0,0 +1,111 @@
+#include <pthread.h>
+#include <stdint.h>
+#include "Base/Debug.h"
+#include "Base/Metrics.h"
+#include "Base/Thread.h"
+#include "Base/Utils.h"
+#include "Mac.h"
+#include "IPv4.h"
+#include "Shaper.h"
+#include "TunMac.h"
+#include "TransTCP.h"
+
+#pragma once
+
+namespace TransProxy {
+
+// 多队列TUN的工作线程组：每个工作线程一个TUN队列、一个Looper、一个IPv4和一个TransTCP分片。
+// 0号就是主线程，ICMP、UDP和发往本机服务的TCP都只在它上面处理。
+// 内核按流把包散到各个队列，读到不归本线程处理的包就转交给所属线程
+class Workers: public Utils::MetricsSource {
+	class _Worker: public MacProtocol, Utils::FDListener, Utils::ThreadProc {
+		friend class Workers;
+
+		struct _Parcel {
+			_Parcel* next;
+			bool hasVnet;
+			Net::VnetHeader vnet;
+			size_t bytes;
+			uint8_t data[1];
+		};
+
+		Workers* _workers;
+		size_t _index;
+		// 其余工作线程的_mac、_ipv4在线程里创建，和_steered一样加_lock读写，
+		// HTTP线程读指标时才能看到完整的值
+		TunMac* _mac;
+		Shaper* _shaper;
+		IPv4* _ipv4;
+		Utils::Thread* _thread;
+		mutable pthread_spinlock_t _lock;
+		_Parcel *_first, *_last;
+		int _event, _selector;
+		uint64_t _steered;
+
+		void _attach() THROWS;
+		const Net::Tun* _getTun() const;
+		IPv4* _getIPv4() const;
+		uint64_t _getSteered() const;
+		void _post(const void* packet, size_t bytes,
+				const Net::VnetHeader* vnet);
+
+		// MacProtocol
+		void dispatchPacket(void* packet, size_t bytes, Net::VnetHeader* vnet)
+				THROWS;
+
+		// Utils::FDListener
+		void onFDToRead() THROWS;
+		void onFDToWrite() {
+		}
+		void onFDClosed() {
+		}
+		void onFDError(Utils::Exception* e) THROWS {
+			THROW(e);
+		}
+
+		// Utils::ThreadProc
+		void* threadProc(Utils::Thread* thread, int param_i, void* param_p);
+
+		_Worker(Workers* workers, size_t index, TunMac* mac, Shaper* shaper,
+				IPv4* ipv4) THROWS;
+		virtual ~_Worker();
+	};
+
+	TransTCP* _transTCP;
+	uint32_t _vipMin, _vipMax, _agentMin, _agentMax;
+	_Worker** _workers;
+	size_t _count;
+
+	size_t _ownerOf(const uint8_t* packet, size_t bytes) const;
+
+public:
+	// mac、ipv4是主线程的，其上的TransTCP分片0已经绑定好；其余工作线程在这里启动。
+	// shaper为主线程套在mac外的出口整形，不为NULL时其余工作线程也各套一个同样限速的
+	Workers(size_t count, TunMac* mac, Shaper* shaper, IPv4* ipv4,
+			TransTCP* transTCP, const char* vipMin, const char* vipMax,
+			const char* agentMin, const char* agentMax) THROWS;
+	virtual ~Workers() {
+		Utils::Log::e("~Workers");
+	}
+
+	size_t getCount() const {
+		return _count;
+	}
+	uint64_t getTunRxPackets() const;
+	uint64_t getTunRxBatches() const;
+	double getAvgTunRxBatch() const {
+		uint64_t batches = getTunRxBatches();
+		return batches == 0 ? 0 : (double) getTunRxPackets() / batches;
+	}
+	uint64_t getTunTxPackets() const;
+	// 各队列发送排队中的包数，以及排满丢弃和写出错丢弃的包数
+	uint64_t getTunTxQueued() const;
+	uint64_t getTunTxDrops() const;
+	// 从读到的队列转交给其他工作线程处理的包数
+	uint64_t getSteeredPackets() const;
+
+	// Utils::MetricsSource：各TUN队列的收发和各IPv4按协议的分发计数
+	void writeMetrics(Utils::MetricsWriter& out);
+};
+
+}